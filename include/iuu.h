@@ -57,9 +57,49 @@ enum iuu_uart_baudrate_t {
 typedef enum iuu_uart_baudrate_t iuu_uart_baudrate;
 
 enum iuu_clk_t {
+   IUU_CLK_MIN = 760000,
    IUU_CLK_3579000 = 3579000,
    IUU_CLK_3680000 = 3680000,
-   IUU_CLK_6000000 = 6000000
+   IUU_CLK_4000000 = 4000000,
+   IUU_CLK_4915200 = 4915200,
+   IUU_CLK_5000000 = 5000000,
+   IUU_CLK_6000000 = 6000000,
+   IUU_CLK_7160000 = 7160000,
+   IUU_CLK_8000000 = 8000000,
+   IUU_CLK_MAX = 25000000
+};
+
+// Number of clock generator registers written by iuu_clk()
+enum iuu_clk_regs_t {
+   IUU_CLK_NREGS = 11
+};
+
+// Settings of the on board clock generator, CLK = 12MHz*P/(Q*DIV)
+struct iuu_clk_setting {
+   u_int16_t P;                 // 8 to 2055
+   u_int8_t Q;                  // 2 to 47
+   u_int8_t DIV;                // 4 to 127
+   u_int8_t XDRV;               // crystal drive
+   u_int32_t freq;              // frequency actually achieved (Hz)
+   int error;                   // freq minus the frequency requested
+};
+
+// Card and UART settings found by iuu_link_optimize()
+struct iuu_link {
+   struct iuu_clk_setting clk;  // card clock
+   u_int16_t F;                 // ISO7816 clock rate conversion factor
+   u_int8_t D;                  // ISO7816 baud rate adjustment factor
+   u_int8_t t1src;              // UART timer 1 clock source
+   u_int8_t t1reload;           // UART timer 1 reload value
+   u_int32_t baud;              // UART baud rate
+   u_int32_t card_baud;         // card baud rate, clk.freq * D / F
+};
+
+// Maximum difference between the card and the UART baud rates, per
+// mille. ISO7816-3 allows each character to drift 0.2 etu over its
+// ten bits.
+enum iuu_link_t {
+   IUU_LINK_TOLERANCE = 20
 };
 
 enum iuu_status_t {
@@ -68,6 +108,14 @@ enum iuu_status_t {
    IUU_MINICARD_IN = 0x04
 };
 
+// Data convention used by the card, as announced by the TS byte of
+// its ATR. Inverse convention cards send 0x03 on the wire for 0x3F.
+enum iuu_convention_t {
+   IUU_CONVENTION_DIRECT = 0x3B,
+   IUU_CONVENTION_INVERSE = 0x3F
+};
+typedef enum iuu_convention_t iuu_convention;
+
 enum iuu_vcc_t {
    IUU_VCC_5V = 0x00,           // 5.0V
    IUU_VCC_3V = 0x01            // 3.3V
@@ -85,7 +133,12 @@ enum iuu_error_t {
    IUU_WRITE_ERROR = 0x07,
    IUU_READ_ERROR = 0x08,
    IUU_TX_ERROR = 0x09,
-   IUU_RX_ERROR = 0x0A
+   IUU_RX_ERROR = 0x0A,
+   IUU_OUT_OF_MEMORY = 0x0B,
+   IUU_VERIFY_FAILED = 0x0C,
+   IUU_FILE_ERROR = 0x0D,
+   IUU_IMAGE_ERROR = 0x0E,
+   IUU_SCRIPT_ERROR = 0x0F
 };
 typedef enum iuu_error_t iuu_error;
 
@@ -93,10 +146,231 @@ struct usb_infinity {
    struct usb_device *dev;
    struct usb_dev_handle *handle;
    struct usb_endpoint_descriptor *ep_in, *ep_out;
+   iuu_convention conv;         // phoenix data is transcoded when inverse
+   u_int8_t clk_regs[IUU_CLK_NREGS];    // last values sent to the clock
+   u_int8_t clk_valid;          // generator, only valid when this is set
+   const struct iuu_eeprom_chip *eeprom;        // last chip detected
+   u_int8_t eeprom_ctrl;        // and where, see iuu_eeprom_detect()
    // Consider to add here a char iuu_fifo_buf[256] datatype
 };
 typedef struct usb_infinity iuu;
 
+// A sequence of IUU commands already split in USB transfers, so it
+// can be built once and sent to as many devices as needed
+struct iuu_stream {
+   u_int8_t *buf;               // commands, one transfer after another
+   size_t len;                  // bytes used in buf
+   size_t size;                 // bytes allocated for buf
+   size_t *cut;                 // where every transfer ends in buf
+   int ncut;                    // number of transfers ended
+   int maxcut;                  // entries allocated for cut
+};
+
+// I2C EEPROM as seen by the EEPROM commands of the IUU
+struct iuu_eeprom_chip {
+   const char *name;
+   u_int32_t size;              // bytes
+   u_int16_t page;              // page write size in bytes
+   u_int8_t addr16;             // takes 16 bit addresses
+   u_int8_t twr;                // write cycle time in milliseconds
+};
+
+// How iuu_eeprom_program() goes about it
+enum iuu_eeprom_flags_t {
+   IUU_EEPROM_DIFF = 0x01,      // only write what differs from the chip
+   IUU_EEPROM_POLL = 0x02       // poll for the end of every write cycle
+};
+
+// What iuu_eeprom_program() did
+struct iuu_eeprom_stats {
+   size_t written;              // bytes written
+   size_t skipped;              // bytes already holding the image
+};
+
+// A run of bytes of a program or memory image
+struct iuu_segment {
+   u_int32_t addr;              // where it starts
+   u_int32_t len;               // bytes
+   u_int8_t *data;              // into the buffer of the image
+};
+
+// A sparse image, as loaded from an Intel HEX, S-record or raw file
+struct iuu_image {
+   struct iuu_segment *seg;     // sorted by address, none touching
+   int nseg;                    // number of segments
+   int maxseg;                  // entries allocated for seg
+   u_int8_t *buf;               // data of all segments
+   size_t len;                  // bytes used in buf
+   size_t size;                 // bytes allocated for buf
+   u_int8_t fill;               // what is not in a segment reads as
+   u_int32_t entry;             // start address, if the file gives one
+};
+
+enum iuu_image_format_t {
+   IUU_IMAGE_AUTO = 0x00,       // guess from the contents
+   IUU_IMAGE_IHEX = 0x01,
+   IUU_IMAGE_SREC = 0x02,
+   IUU_IMAGE_RAW = 0x03
+};
+typedef enum iuu_image_format_t iuu_image_format;
+
+// Where the program counter of an AVR or PIC card is, so that it can
+// be moved around with the fewest commands
+struct iuu_cursor {
+   u_int8_t reset;              // command taking the counter to 0
+   u_int8_t inc;                // and the ones incrementing it by 1
+   u_int8_t incn;               // and by up to 255
+   u_int8_t target;             // IUU_CURSOR_AVR or IUU_CURSOR_PIC
+   u_int8_t valid;              // pc is where the card is
+   u_int32_t pc;                // in words
+};
+
+enum iuu_cursor_target_t {
+   IUU_CURSOR_AVR = 0x00,
+   IUU_CURSOR_PIC = 0x01
+};
+typedef enum iuu_cursor_target_t iuu_cursor_target;
+
+// Memories of AVR and PIC cards
+enum iuu_space_t {
+   IUU_SPACE_PROGRAM = 0x00,
+   IUU_SPACE_DATA = 0x01
+};
+typedef enum iuu_space_t iuu_space;
+
+// PIC16F8x as programmed by iuu_pic_program()
+struct iuu_pic_chip {
+   const char *name;
+   u_int16_t psize;             // program memory words
+   u_int16_t dsize;             // data EEPROM bytes
+   u_int8_t prog;               // ICSP command starting a program cycle
+   u_int16_t tprog;             // program cycle time in microseconds
+   u_int8_t terase;             // bulk erase time in milliseconds
+};
+
+// How iuu_pic_program() goes about it and what iuu_pic_encode() and
+// iuu_pic_verify() take care of
+enum iuu_pic_flags_t {
+   IUU_PIC_VERIFY = 0x01,       // read everything back afterwards
+   IUU_PIC_MEMORY = 0x02,       // program and data memory
+   IUU_PIC_CONFIG = 0x04,       // IDs and configuration word
+   IUU_PIC_NOERASE = 0x08       // write memory without erasing it first
+};
+
+// Bytes that did not verify, see iuu_eeprom_verify()
+struct iuu_mismatch {
+   u_int32_t addr;              // first one
+   size_t len;                  // how many in a row
+};
+
+// Kinds of cards a programming job can be for
+enum iuu_target_t {
+   IUU_TARGET_EEPROM = 0,
+   IUU_TARGET_AVR = 1,
+   IUU_TARGET_PIC = 2
+};
+typedef enum iuu_target_t iuu_target;
+
+// How a job is carried out
+enum iuu_job_flags_t {
+   IUU_JOB_VERIFY = 0x01,       // read the card back once programmed
+   IUU_JOB_POWER = 0x02         // power the card on before, off after
+};
+
+// What card an image goes to, see iuu_job_encode()
+struct iuu_job {
+   iuu_target target;
+   const struct iuu_eeprom_chip *eeprom;        // for IUU_TARGET_EEPROM
+   u_int8_t ctrl;               // control byte for IUU_TARGET_EEPROM
+   const struct iuu_pic_chip *pic;      // for IUU_TARGET_PIC
+   int flags;                   // OR of enum iuu_job_flags_t
+};
+
+// One reader of a gang and how it is doing, see iuu_gang_program()
+struct iuu_gang_unit {
+   iuu *inf;
+   iuu_error status;            // outcome, once done
+   int done;                    // transfers sent so far
+   int total;                   // transfers to send
+   long record;                 // personalization record, -1 for none
+};
+typedef void (*iuu_gang_progress) (const struct iuu_gang_unit * unit,
+                                   void *arg);
+
+// How the text of a personalization field is written in the card
+enum iuu_field_kind_t {
+   IUU_FIELD_HEX = 0,           // two hex digits per byte
+   IUU_FIELD_TEXT = 1,          // as it is, padded with zeros
+   IUU_FIELD_DEC = 2            // decimal number, most significant first
+};
+typedef enum iuu_field_kind_t iuu_field_kind;
+
+// A field of personalization records, see iuu_perso_open()
+struct iuu_field {
+   u_int32_t addr;              // where it goes in the image
+   u_int32_t len;               // bytes it takes there
+   int column;                  // of a CSV record, from 0
+   iuu_field_kind kind;         // of a CSV record
+};
+
+// What personalization records look like
+enum iuu_perso_flags_t {
+   IUU_PERSO_BINARY = 0x01,     // fixed size records rather than CSV
+   IUU_PERSO_HEADER = 0x02      // skip the first line of a CSV file
+};
+
+// A card ready to be personalized, see iuu_perso_next()
+struct iuu_perso_card {
+   long record;                 // which one, from 0
+   struct iuu_image img;        // the pages holding its fields
+   struct iuu_stream s;         // commands writing them
+};
+
+struct iuu_perso;
+
+// Images ready to be programmed, see iuu_cache_load()
+struct iuu_cache;
+struct iuu_cache_entry;
+
+struct iuu_cache_stats {
+   unsigned long hits;          // lookups found
+   unsigned long misses;        // lookups that had to parse and encode
+   unsigned long evictions;     // entries dropped to fit the budget
+   size_t bytes;                // memory taken by the entries
+   int entries;                 // entries held
+};
+
+// Bytes of a card sequence that need the host when it is run: UART
+// data to transcode for inverse convention cards and answers to read
+struct iuu_seq_mark {
+   int transfer;                // stream transfer holding the command
+   size_t off;                  // where the TX data starts in the stream
+   u_int8_t len;                // TX data bytes, 0 for an answer
+   u_int16_t answer;            // bytes of a fixed size answer, 0 for an RX
+   u_int8_t *buf;               // where an answer goes, NULL to drop it
+   u_int8_t *rxlen;             // and the length of an RX answer
+   int atr;                     // the answer is an ATR, see iuu_seq_atr()
+};
+
+// Power up, clock, reset, waits and card exchanges run by the IUU in
+// one go, see iuu_seq_init()
+struct iuu_seq {
+   struct iuu_stream s;         // commands
+   u_int32_t clk;               // card clock (Hz) waits are worked out from
+   u_int16_t F;                 // ISO7816 F and D, an etu is F / D
+   u_int8_t D;                  // clock cycles
+   struct iuu_seq_mark *mark;
+   int nmark;
+   int maxmark;
+   int clk_set;                 // the clock generator gets written
+};
+
+// Reader recipes compiled to card sequences, see iuu_script_compile()
+struct iuu_script;
+
+// 24C01 to 24C1024, terminated by an entry with a NULL name
+extern const struct iuu_eeprom_chip iuu_eeprom_chips[];
+
 // General IUU commands
 iuu_error iuu_ndevs(int *numdev);
 iuu_error iuu_start(iuu * inf, int devnum);
@@ -113,6 +387,11 @@ iuu_error iuu_led(iuu * inf, u_int16_t R, u_int16_t G, u_int16_t B,
                   u_int8_t f);
 iuu_error iuu_vcc(iuu * inf, enum iuu_vcc_t vcc);
 iuu_error iuu_clk(iuu * inf, int freq);
+iuu_error iuu_clk_solve(int freq, struct iuu_clk_setting *set);
+iuu_error iuu_clk_set(iuu * inf, const struct iuu_clk_setting *set);
+iuu_error iuu_clk_encode(struct iuu_stream *s,
+                         const struct iuu_clk_setting *set);
+void iuu_clk_invalidate(iuu * inf);
 iuu_error iuu_reset(iuu * inf, u_int8_t wt);
 
 // Phoenix interface related commands 
@@ -123,6 +402,10 @@ iuu_error iuu_uart_set(iuu * inf, iuu_uart_baudrate br,
                        iuu_uart_stopbits stopbits);
 iuu_error iuu_uart_baud(iuu * inf, u_int32_t baud, u_int32_t * actual,
                         iuu_uart_parity parity);
+iuu_error iuu_link_optimize(u_int8_t ta1, u_int32_t fmax,
+                            struct iuu_link *link);
+iuu_error iuu_link_set(iuu * inf, const struct iuu_link *link,
+                       iuu_uart_parity parity);
 iuu_error iuu_uart_rx(iuu * inf, u_int8_t * data, u_int8_t * len);
 iuu_error iuu_uart_tx(iuu * inf, u_int8_t * data, u_int8_t len);
 iuu_error iuu_uart_txnops(iuu * inf, u_int8_t * data, u_int8_t len,
@@ -134,6 +417,8 @@ iuu_error iuu_uart_txmu(iuu * inf, u_int8_t * data, u_int8_t len,
 iuu_error iuu_uart_trap(iuu * inf, u_int8_t wt, u_int8_t cmdbyte);
 iuu_error iuu_uart_break(iuu * inf, u_int8_t wt, u_int8_t cmdbyte);
 iuu_error iuu_uart_flush(iuu * inf);
+iuu_error iuu_uart_convention(iuu * inf, iuu_convention conv);
+void iuu_inverse(u_int8_t * data, int len);
 
 // EEPROM through device related commands
 iuu_error iuu_eeprom_on(iuu * inf);
@@ -158,6 +443,35 @@ iuu_error iuu_eeprom_bread(iuu * inf, u_int8_t ctrl, u_int8_t addr,
                            u_int8_t n, u_int8_t * data);
 iuu_error iuu_eeprom_breadx(iuu * inf, u_int8_t ctrl, u_int16_t addr,
                             u_int8_t n, u_int8_t * data);
+iuu_error iuu_eeprom_read_range(iuu * inf, u_int8_t ctrl, u_int16_t addr,
+                                size_t len, u_int8_t * data);
+const struct iuu_eeprom_chip *iuu_eeprom_chip(const char *name);
+iuu_error iuu_eeprom_detect(iuu * inf, u_int8_t ctrl,
+                            const struct iuu_eeprom_chip **chip);
+iuu_error iuu_eeprom_ready(iuu * inf, u_int8_t ctrl,
+                           const struct iuu_eeprom_chip *chip,
+                           u_int32_t addr, u_int8_t data);
+iuu_error iuu_eeprom_encode(struct iuu_stream *s, u_int8_t ctrl,
+                            const struct iuu_eeprom_chip *chip,
+                            u_int32_t addr, const u_int8_t * data,
+                            size_t len);
+iuu_error iuu_eeprom_write_image(iuu * inf, u_int8_t ctrl,
+                                 const struct iuu_eeprom_chip *chip,
+                                 u_int32_t addr, const u_int8_t * data,
+                                 size_t len);
+iuu_error iuu_eeprom_program(iuu * inf, u_int8_t ctrl,
+                             const struct iuu_eeprom_chip *chip,
+                             u_int32_t addr, const u_int8_t * data,
+                             size_t len, int flags,
+                             struct iuu_eeprom_stats *stats);
+iuu_error iuu_eeprom_verify(iuu * inf, u_int8_t ctrl,
+                            const struct iuu_eeprom_chip *chip,
+                            u_int32_t addr, const u_int8_t * data,
+                            size_t len, struct iuu_mismatch *map,
+                            int maxmap, int *nmap);
+iuu_error iuu_eeprom_dump(iuu * inf, u_int8_t ctrl,
+                          const struct iuu_eeprom_chip *chip,
+                          u_int32_t addr, size_t len, u_int8_t * data);
 
 // AVR based cards related commands
 iuu_error iuu_avr_on(iuu * inf);
@@ -174,6 +488,13 @@ iuu_error iuu_avr_pwriten(iuu * inf, u_int8_t * data, u_int8_t len);
 iuu_error iuu_avr_dread(iuu * inf, u_int8_t * data);
 iuu_error iuu_avr_dreadn(iuu * inf, u_int8_t * data, u_int8_t len);
 iuu_error iuu_avr_dwrite(iuu * inf, u_int8_t data);
+iuu_error iuu_avr_read_at(iuu * inf, struct iuu_cursor *c, u_int32_t addr,
+                          u_int8_t * data, u_int8_t n);
+iuu_error iuu_avr_write_at(iuu * inf, struct iuu_cursor *c, u_int32_t addr,
+                           const u_int8_t * data, u_int8_t n);
+iuu_error iuu_avr_encode(struct iuu_stream *s, struct iuu_cursor *c,
+                         const struct iuu_image *img);
+iuu_error iuu_avr_program(iuu * inf, const struct iuu_image *img);
 
 // PIC based cards related commands
 iuu_error iuu_pic_cmd(iuu * inf, u_int8_t cmd);
@@ -189,6 +510,144 @@ iuu_error iuu_pic_pread(iuu * inf, u_int8_t * data);
 iuu_error iuu_pic_preadn(iuu * inf, u_int8_t * data, unsigned char n);
 iuu_error iuu_pic_dwrite(iuu * inf, u_int8_t * data);
 iuu_error iuu_pic_dread(iuu * inf, u_int8_t * data);
+iuu_error iuu_pic_read_at(iuu * inf, struct iuu_cursor *c, u_int32_t addr,
+                          u_int8_t * data, u_int8_t n);
+iuu_error iuu_pic_write_at(iuu * inf, struct iuu_cursor *c, u_int32_t addr,
+                           const u_int8_t * data, u_int8_t n);
+
+extern const struct iuu_pic_chip iuu_pic_chips[];
+const struct iuu_pic_chip *iuu_pic_chip(const char *name);
+iuu_error iuu_pic_encode(struct iuu_stream *s, const struct iuu_pic_chip *chip,
+                         const struct iuu_image *img, int what);
+iuu_error iuu_pic_verify(iuu * inf, const struct iuu_pic_chip *chip,
+                         const struct iuu_image *img, int what);
+iuu_error iuu_pic_program(iuu * inf, const struct iuu_pic_chip *chip,
+                          const struct iuu_image *img, int flags);
+
+// Program counter of AVR and PIC cards
+void iuu_cursor_init(struct iuu_cursor *c, iuu_cursor_target target);
+void iuu_cursor_advance(struct iuu_cursor *c, u_int32_t n);
+u_int32_t iuu_cursor_cost(const struct iuu_cursor *c, u_int32_t to);
+iuu_error iuu_cursor_encode(struct iuu_stream *s, struct iuu_cursor *c,
+                            u_int32_t to);
+
+// Read back and verify of AVR and PIC cards
+iuu_error iuu_prog_read(iuu * inf, struct iuu_cursor *c, iuu_space space,
+                        u_int32_t addr, size_t len, u_int8_t * data);
+iuu_error iuu_prog_verify(iuu * inf, struct iuu_cursor *c, iuu_space space,
+                          const struct iuu_image *img,
+                          struct iuu_mismatch *map, int maxmap, int *nmap);
+
+// Prebuilt command streams
+iuu_error iuu_stream_init(struct iuu_stream *s);
+void iuu_stream_free(struct iuu_stream *s);
+void iuu_stream_reset(struct iuu_stream *s);
+iuu_error iuu_stream_add(struct iuu_stream *s, const u_int8_t * cmd,
+                         int len);
+iuu_error iuu_stream_cut(struct iuu_stream *s);
+iuu_error iuu_stream_wait(struct iuu_stream *s, u_int32_t us);
+int iuu_stream_transfers(const struct iuu_stream *s);
+iuu_error iuu_stream_send(iuu * inf, const struct iuu_stream *s);
+iuu_error iuu_stream_send_range(iuu * inf, const struct iuu_stream *s,
+                                int first, int n);
+
+// Card sequences timed by the IUU
+iuu_error iuu_seq_init(struct iuu_seq *q, u_int32_t clk);
+void iuu_seq_free(struct iuu_seq *q);
+void iuu_seq_reset(struct iuu_seq *q);
+iuu_error iuu_seq_timing(struct iuu_seq *q, u_int32_t clk, u_int16_t F,
+                         u_int8_t D);
+iuu_error iuu_seq_cmd(struct iuu_seq *q, const u_int8_t * cmd, int len,
+                      int answer, u_int8_t * buf);
+iuu_error iuu_seq_vcc(struct iuu_seq *q, enum iuu_vcc_t vcc);
+iuu_error iuu_seq_clk(struct iuu_seq *q, const struct iuu_clk_setting *set);
+iuu_error iuu_seq_rst(struct iuu_seq *q, int on);
+iuu_error iuu_seq_wait(struct iuu_seq *q, u_int32_t us);
+iuu_error iuu_seq_wait_clk(struct iuu_seq *q, u_int32_t n);
+iuu_error iuu_seq_wait_etu(struct iuu_seq *q, u_int32_t n);
+iuu_error iuu_seq_tx(struct iuu_seq *q, const u_int8_t * data, int len,
+                     u_int8_t egt);
+iuu_error iuu_seq_rx(struct iuu_seq *q, u_int8_t * buf, u_int8_t * len);
+iuu_error iuu_seq_atr(struct iuu_seq *q, u_int32_t us, u_int8_t * atr,
+                      u_int8_t * len);
+iuu_error iuu_seq_run(iuu * inf, const struct iuu_seq *q);
+
+// Command scripts
+iuu_error iuu_script_compile(struct iuu_script **script, const char *text,
+                             size_t len, const char *const *params,
+                             const char *cachedir, int *line);
+iuu_error iuu_script_load(struct iuu_script **script, const char *path,
+                          const char *const *params, const char *cachedir,
+                          int *line);
+void iuu_script_free(struct iuu_script *sc);
+const struct iuu_seq *iuu_script_seq(const struct iuu_script *sc);
+iuu_error iuu_script_run(iuu * inf, struct iuu_script *sc);
+int iuu_script_answers(const struct iuu_script *sc);
+const u_int8_t *iuu_script_answer(const struct iuu_script *sc, int i,
+                                  int *len);
+
+// Programming jobs of any kind of card
+iuu_error iuu_job_encode(struct iuu_stream *s, const struct iuu_job *job,
+                         const struct iuu_image *img);
+iuu_error iuu_job_verify(iuu * inf, const struct iuu_job *job,
+                         const struct iuu_image *img);
+iuu_error iuu_job_power(iuu * inf, const struct iuu_job *job, int on);
+iuu_error iuu_job_resume(iuu * inf, const struct iuu_job *job,
+                         const struct iuu_image *img, const char *journal);
+
+// Cache of parsed and encoded images
+iuu_error iuu_cache_open(struct iuu_cache **cache, size_t budget);
+void iuu_cache_close(struct iuu_cache *cache);
+iuu_error iuu_cache_load(struct iuu_cache *cache, const struct iuu_job *job,
+                         const char *path, iuu_image_format fmt,
+                         u_int32_t base, struct iuu_cache_entry **entry);
+iuu_error iuu_cache_encode(struct iuu_cache *cache,
+                           const struct iuu_job *job,
+                           const struct iuu_image *img,
+                           struct iuu_cache_entry **entry);
+void iuu_cache_release(struct iuu_cache *cache, struct iuu_cache_entry *e);
+const struct iuu_image *iuu_cache_image(const struct iuu_cache_entry *e);
+const struct iuu_stream *iuu_cache_stream(const struct iuu_cache_entry *e);
+void iuu_cache_get_stats(struct iuu_cache *cache,
+                         struct iuu_cache_stats *stats);
+
+// Personalization of cards from a template and a file of records
+iuu_error iuu_perso_open(struct iuu_perso **p, const struct iuu_job *job,
+                         const struct iuu_image *tmpl,
+                         const struct iuu_field *field, int nfield,
+                         const char *path, int flags);
+void iuu_perso_close(struct iuu_perso *p);
+const struct iuu_image *iuu_perso_image(const struct iuu_perso *p);
+const struct iuu_stream *iuu_perso_stream(const struct iuu_perso *p);
+iuu_error iuu_perso_next(struct iuu_perso *p, struct iuu_perso_card **card);
+void iuu_perso_release(struct iuu_perso *p, struct iuu_perso_card *card);
+iuu_error iuu_perso_program(struct iuu_gang_unit *u, struct iuu_perso *p,
+                            iuu_gang_progress progress, void *arg);
+iuu_error iuu_perso_gang(struct iuu_gang_unit *units, int n,
+                         struct iuu_perso *p, iuu_gang_progress progress,
+                         void *arg);
+
+// Many readers programming the same image at once
+iuu_error iuu_gang_open(iuu * inf, struct iuu_gang_unit *units, int max,
+                        int *n);
+iuu_error iuu_gang_close(struct iuu_gang_unit *units, int n);
+iuu_error iuu_gang_program(struct iuu_gang_unit *units, int n,
+                           const struct iuu_job *job,
+                           const struct iuu_image *img,
+                           const struct iuu_stream *s,
+                           iuu_gang_progress progress, void *arg);
+
+// Program and memory images
+iuu_error iuu_image_init(struct iuu_image *img, u_int8_t fill);
+void iuu_image_free(struct iuu_image *img);
+void iuu_image_reset(struct iuu_image *img);
+iuu_error iuu_image_parse(struct iuu_image *img, const char *text,
+                          size_t len, iuu_image_format fmt, u_int32_t base);
+iuu_error iuu_image_load(struct iuu_image *img, const char *path,
+                         iuu_image_format fmt, u_int32_t base);
+iuu_error iuu_image_sparse(struct iuu_image *img, size_t minrun);
+void iuu_image_flatten(const struct iuu_image *img, u_int32_t addr,
+                       size_t len, u_int8_t * out);
 
 // This ones come handy when testing
 iuu_error iuu_get_atr(iuu * inf, u_int8_t * atr, u_int8_t * len);
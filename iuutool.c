@@ -0,0 +1,686 @@
+/* 
+ *  iuutool - command line driver for the WBE's Infinity USB Unlimited
+ *
+ *  Copyright (C) 2006 Juan Carlos Borrs
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ * 
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ * 
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software 
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <usb.h>
+
+#include <iuu.h>
+
+/*
+ Every command prints a single line: its name, "ok" or "error", and
+ key=value pairs. Values never have spaces and binary data goes as hex,
+ so scripts can split the line on blanks. Commands come from the
+ command line or, one per line, from a file or stdin, and all of them
+ run on the same open device.
+*/
+
+#define TOOL_ARGS 64
+#define TOOL_LINE 4096
+
+// What the commands share
+struct tool {
+   iuu inf;
+   u_int8_t ctrl;               // EEPROM control byte
+   u_int32_t clk;               // card clock last set
+   int verify;                  // read back what gets programmed
+   const char *cachedir;        // compiled scripts, see iuu_script_compile()
+   char *out;                   // key=value pairs of the command running
+   size_t len, size;
+};
+
+struct tool_cmd {
+   const char *name;
+   int min, max;                // arguments it takes
+   iuu_error(*run) (struct tool * t, int argc, char **argv);
+   const char *usage;
+};
+
+static const char tool_hexdigits[] = "0123456789abcdef";
+
+// Appends to the output of the command running
+static void tool_out(struct tool *t, const char *fmt, ...)
+{
+   va_list ap;
+   int n;
+
+   for (;;) {
+      va_start(ap, fmt);
+      n = vsnprintf(t->out + t->len, t->size - t->len, fmt, ap);
+      va_end(ap);
+      if (n < 0)
+         return;
+      if (t->len + n < t->size) {
+         t->len += n;
+         return;
+      }
+      t->size = 2 * (t->len + n + 1);
+      t->out = realloc(t->out, t->size);
+      if (!t->out) {
+         fprintf(stderr, "Out of memory\n");
+         exit(2);
+      }
+   }
+}
+
+// Appends key=hex of n bytes
+static void tool_hex(struct tool *t, const char *key, const u_int8_t * p,
+                     size_t n)
+{
+   size_t i;
+   char *s;
+
+   tool_out(t, " %s=%s", key, n ? "" : "-");
+   if (t->len + 2 * n + 1 > t->size) {
+      t->size = 2 * (t->len + 2 * n + 1);
+      t->out = realloc(t->out, t->size);
+      if (!t->out) {
+         fprintf(stderr, "Out of memory\n");
+         exit(2);
+      }
+   }
+   s = t->out + t->len;
+   for (i = 0; i < n; i++) {
+      *s++ = tool_hexdigits[p[i] >> 4];
+      *s++ = tool_hexdigits[p[i] & 0x0F];
+   }
+   *s = '\0';
+   t->len += 2 * n;
+}
+
+// Appends key=text, with blanks and other odd characters as '_'
+static void tool_text(struct tool *t, const char *key, const char *text)
+{
+   char buf[256];
+   int i;
+
+   for (i = 0; text[i] && i < (int)sizeof(buf) - 1; i++)
+      buf[i] = isgraph((u_int8_t) text[i]) ? text[i] : '_';
+   while (i > 0 && buf[i - 1] == '_')
+      i--;
+   buf[i] = '\0';
+   tool_out(t, " %s=%s", key, i ? buf : "-");
+}
+
+// Number in decimal, or hex with 0x, no larger than max
+static iuu_error tool_num(const char *s, unsigned long max,
+                          unsigned long *v)
+{
+   char *end;
+
+   errno = 0;
+   *v = strtoul(s, &end, 0);
+   if (!*s || *end || errno || *v > max || *s == '-') {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+   return IUU_OPERATION_OK;
+}
+
+// Bytes given as a string of hex digits
+static iuu_error tool_bytes(const char *s, u_int8_t * out, int max,
+                            int *len)
+{
+   int i, hi, lo;
+
+   if (!strncmp(s, "0x", 2))
+      s += 2;
+   *len = strlen(s) / 2;
+   if (strlen(s) % 2 || *len > max) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+   for (i = 0; i < *len; i++) {
+      if (!isxdigit((u_int8_t) s[2 * i]) ||
+          !isxdigit((u_int8_t) s[2 * i + 1])) {
+         iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+         return IUU_INVALID_PARAMETER;
+      }
+      hi = strchr(tool_hexdigits, tolower((u_int8_t) s[2 * i])) -
+          tool_hexdigits;
+      lo = strchr(tool_hexdigits, tolower((u_int8_t) s[2 * i + 1])) -
+          tool_hexdigits;
+      out[i] = (hi << 4) | lo;
+   }
+   return IUU_OPERATION_OK;
+}
+
+static iuu_error tool_info(struct tool *t, int argc, char **argv)
+{
+   char name[17], firm[5], loader[5];
+   iuu_error status;
+   u_int8_t st;
+
+   memset(name, 0, sizeof(name));
+   memset(firm, 0, sizeof(firm));
+   memset(loader, 0, sizeof(loader));
+   status = iuu_name(&t->inf, name);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_firmware(&t->inf, firm);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_loader(&t->inf, loader);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_status(&t->inf, &st);
+   if (status != IUU_OPERATION_OK)
+      return status;
+
+   tool_text(t, "name", name);
+   tool_text(t, "firmware", firm);
+   tool_text(t, "loader", loader);
+   tool_out(t, " status=0x%02x card=%s", st,
+            st & IUU_FULLCARD_IN ? "full" :
+            st & IUU_MINICARD_IN ? "mini" : "none");
+   return IUU_OPERATION_OK;
+}
+
+static iuu_error tool_clk(struct tool *t, int argc, char **argv)
+{
+   struct iuu_clk_setting set;
+   iuu_error status;
+   unsigned long hz;
+
+   status = tool_num(argv[0], IUU_CLK_MAX, &hz);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_clk_solve(hz, &set);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_clk_set(&t->inf, &set);
+   if (status != IUU_OPERATION_OK)
+      return status;
+
+   t->clk = set.freq;
+   tool_out(t, " freq=%lu error=%d", (unsigned long)set.freq, set.error);
+   return IUU_OPERATION_OK;
+}
+
+static iuu_error tool_vcc(struct tool *t, int argc, char **argv)
+{
+   if (!strcmp(argv[0], "5"))
+      return iuu_vcc(&t->inf, IUU_VCC_5V);
+   if (!strcmp(argv[0], "3") || !strcmp(argv[0], "3.3"))
+      return iuu_vcc(&t->inf, IUU_VCC_3V);
+   iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+   return IUU_INVALID_PARAMETER;
+}
+
+static iuu_error tool_uart(struct tool *t, int argc, char **argv)
+{
+   iuu_uart_parity parity = IUU_PARITY_EVEN;
+   iuu_error status;
+   unsigned long baud;
+   u_int32_t actual;
+
+   status = tool_num(argv[0], 0xFFFFFFFF, &baud);
+   if (status != IUU_OPERATION_OK)
+      return status;
+   if (argc > 1) {
+      if (!strcmp(argv[1], "none"))
+         parity = IUU_PARITY_NONE;
+      else if (!strcmp(argv[1], "odd"))
+         parity = IUU_PARITY_ODD;
+      else if (strcmp(argv[1], "even")) {
+         iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+         return IUU_INVALID_PARAMETER;
+      }
+   }
+
+   status = iuu_uart_on(&t->inf);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_uart_baud(&t->inf, baud, &actual, parity);
+   if (status != IUU_OPERATION_OK)
+      return status;
+
+   tool_out(t, " baud=%lu", (unsigned long)actual);
+   return IUU_OPERATION_OK;
+}
+
+// Resets the card and reads its ATR, timed by the IUU (see seq.c)
+static iuu_error tool_atr(struct tool *t, int argc, char **argv)
+{
+   struct iuu_clk_setting set;
+   struct iuu_seq q;
+   iuu_error status;
+   unsigned long hz = t->clk;
+   u_int8_t atr[256], len = 0;
+
+   status = argc ? tool_num(argv[0], IUU_CLK_MAX, &hz) : IUU_OPERATION_OK;
+   if (status == IUU_OPERATION_OK)
+      status = iuu_clk_solve(hz, &set);
+   if (status != IUU_OPERATION_OK)
+      return status;
+
+   iuu_seq_init(&q, set.freq);
+   status = iuu_seq_clk(&q, &set);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_seq_atr(&q, 500000, atr, &len);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_uart_on(&t->inf);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_seq_run(&t->inf, &q);
+   iuu_seq_free(&q);
+   if (status != IUU_OPERATION_OK)
+      return status;
+
+   t->clk = set.freq;
+   tool_hex(t, "atr", atr, len);
+   tool_out(t, " conv=%s", t->inf.conv == IUU_CONVENTION_INVERSE ?
+            "inverse" : "direct");
+   return len ? IUU_OPERATION_OK : IUU_RX_ERROR;
+}
+
+// Sends a command to the card and reads what it answers after a wait
+static iuu_error tool_apdu(struct tool *t, int argc, char **argv)
+{
+   u_int8_t cmd[TOOL_LINE / 2], rsp[256], len = 0;
+   struct iuu_seq q;
+   iuu_error status;
+   unsigned long ms = 100;
+   int n;
+
+   status = tool_bytes(argv[0], cmd, sizeof(cmd), &n);
+   if (status == IUU_OPERATION_OK && argc > 1)
+      status = tool_num(argv[1], 60000, &ms);
+   if (status != IUU_OPERATION_OK)
+      return status;
+
+   iuu_seq_init(&q, t->clk);
+   status = iuu_seq_tx(&q, cmd, n, 0);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_seq_wait(&q, ms * 1000);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_seq_rx(&q, rsp, &len);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_seq_run(&t->inf, &q);
+   iuu_seq_free(&q);
+   if (status != IUU_OPERATION_OK)
+      return status;
+
+   tool_hex(t, "resp", rsp, len);
+   if (len >= 2)
+      tool_hex(t, "sw", rsp + len - 2, 2);
+   return len ? IUU_OPERATION_OK : IUU_RX_ERROR;
+}
+
+// Loads an image file, programs it as job says unless only checking,
+// and reads it back if asked to
+static iuu_error tool_program(struct tool *t, const struct iuu_job *job,
+                              const char *path, int write)
+{
+   struct iuu_image img;
+   struct iuu_stream s;
+   iuu_error status, off;
+   size_t bytes = 0;
+   int i;
+
+   iuu_image_init(&img, 0xFF);
+   iuu_stream_init(&s);
+   status = iuu_image_load(&img, path, IUU_IMAGE_AUTO, 0);
+   if (status == IUU_OPERATION_OK && write)
+      status = iuu_job_encode(&s, job, &img);
+   if (status != IUU_OPERATION_OK)
+      goto out;
+   for (i = 0; i < img.nseg; i++)
+      bytes += img.seg[i].len;
+
+   status = iuu_job_power(&t->inf, job, 1);
+   if (status != IUU_OPERATION_OK)
+      goto out;
+   if (write)
+      status = iuu_stream_send(&t->inf, &s);
+   if (status == IUU_OPERATION_OK && (!write || t->verify))
+      status = iuu_job_verify(&t->inf, job, &img);
+   off = iuu_job_power(&t->inf, job, 0);
+   if (status == IUU_OPERATION_OK)
+      status = off;
+
+   tool_out(t, " bytes=%lu", (unsigned long)bytes);
+   if (write)
+      tool_out(t, " transfers=%d", iuu_stream_transfers(&s));
+   if (!write || t->verify)
+      tool_out(t, " verify=%s", status == IUU_VERIFY_FAILED ? "failed" :
+               status == IUU_OPERATION_OK ? "ok" : "-");
+
+ out:
+   iuu_stream_free(&s);
+   iuu_image_free(&img);
+   return status;
+}
+
+// The EEPROM chip a command names, probed for with "auto"
+static iuu_error tool_eeprom_chip(struct tool *t, const char *name,
+                                  const struct iuu_eeprom_chip **chip)
+{
+   iuu_error status, off;
+
+   if (strcmp(name, "auto")) {
+      *chip = iuu_eeprom_chip(name);
+      if (*chip)
+         return IUU_OPERATION_OK;
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+
+   status = iuu_eeprom_on(&t->inf);
+   if (status != IUU_OPERATION_OK)
+      return status;
+   status = iuu_eeprom_detect(&t->inf, t->ctrl, chip);
+   off = iuu_eeprom_off(&t->inf);
+   return status == IUU_OPERATION_OK ? off : status;
+}
+
+static iuu_error tool_eeprom(struct tool *t, int argc, char **argv)
+{
+   const struct iuu_eeprom_chip *chip;
+   struct iuu_job job;
+   iuu_error status, off;
+   unsigned long addr = 0, len;
+   u_int8_t *data;
+
+   status = tool_eeprom_chip(t, argv[1], &chip);
+   if (status != IUU_OPERATION_OK)
+      return status;
+   tool_out(t, " op=%s chip=%s", argv[0], chip->name);
+
+   memset(&job, 0, sizeof(job));
+   job.target = IUU_TARGET_EEPROM;
+   job.eeprom = chip;
+   job.ctrl = t->ctrl;
+
+   if (!strcmp(argv[0], "write") && argc == 3)
+      return tool_program(t, &job, argv[2], 1);
+   if (!strcmp(argv[0], "verify") && argc == 3)
+      return tool_program(t, &job, argv[2], 0);
+   if (strcmp(argv[0], "dump")) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+
+   if (argc > 2)
+      status = tool_num(argv[2], chip->size - 1, &addr);
+   len = chip->size - addr;
+   if (status == IUU_OPERATION_OK && argc > 3)
+      status = tool_num(argv[3], chip->size - addr, &len);
+   if (status != IUU_OPERATION_OK)
+      return status;
+
+   data = malloc(len ? len : 1);
+   if (!data) {
+      iuu_process_error(IUU_OUT_OF_MEMORY, __FILE__, __LINE__);
+      return IUU_OUT_OF_MEMORY;
+   }
+   status = iuu_eeprom_on(&t->inf);
+   if (status == IUU_OPERATION_OK) {
+      status = iuu_eeprom_dump(&t->inf, t->ctrl, chip, addr, len, data);
+      off = iuu_eeprom_off(&t->inf);
+      if (status == IUU_OPERATION_OK)
+         status = off;
+   }
+   if (status == IUU_OPERATION_OK) {
+      tool_out(t, " addr=0x%lx len=%lu", addr, len);
+      tool_hex(t, "data", data, len);
+   }
+   free(data);
+   return status;
+}
+
+static iuu_error tool_avr(struct tool *t, int argc, char **argv)
+{
+   struct iuu_job job;
+
+   memset(&job, 0, sizeof(job));
+   job.target = IUU_TARGET_AVR;
+   tool_out(t, " op=%s", argv[0]);
+   if (!strcmp(argv[0], "flash"))
+      return tool_program(t, &job, argv[1], 1);
+   if (!strcmp(argv[0], "verify"))
+      return tool_program(t, &job, argv[1], 0);
+   iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+   return IUU_INVALID_PARAMETER;
+}
+
+static iuu_error tool_pic(struct tool *t, int argc, char **argv)
+{
+   struct iuu_job job;
+
+   memset(&job, 0, sizeof(job));
+   job.target = IUU_TARGET_PIC;
+   job.pic = iuu_pic_chip(argv[1]);
+   if (!job.pic) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+   tool_out(t, " op=%s chip=%s", argv[0], job.pic->name);
+   if (!strcmp(argv[0], "flash"))
+      return tool_program(t, &job, argv[2], 1);
+   if (!strcmp(argv[0], "verify"))
+      return tool_program(t, &job, argv[2], 0);
+   iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+   return IUU_INVALID_PARAMETER;
+}
+
+// Runs a command script (see lib/script.c), printing its answers
+static iuu_error tool_script(struct tool *t, int argc, char **argv)
+{
+   struct iuu_script *sc;
+   const u_int8_t *a;
+   iuu_error status;
+   char key[16];
+   int i, len, line;
+
+   status = iuu_script_load(&sc, argv[0], (const char *const *)argv + 1,
+                            t->cachedir, &line);
+   if (status != IUU_OPERATION_OK) {
+      if (status == IUU_SCRIPT_ERROR)
+         tool_out(t, " line=%d", line);
+      return status;
+   }
+
+   status = iuu_script_run(&t->inf, sc);
+   tool_out(t, " transfers=%d answers=%d",
+            iuu_stream_transfers(&iuu_script_seq(sc)->s),
+            iuu_script_answers(sc));
+   for (i = 0; status == IUU_OPERATION_OK && i < iuu_script_answers(sc);
+        i++) {
+      a = iuu_script_answer(sc, i, &len);
+      snprintf(key, sizeof(key), "ans%d", i);
+      tool_hex(t, key, a, len);
+   }
+   iuu_script_free(sc);
+   return status;
+}
+
+static const struct tool_cmd tool_cmds[] = {
+   {"info", 0, 0, tool_info, "info"},
+   {"clk", 1, 1, tool_clk, "clk HZ"},
+   {"vcc", 1, 1, tool_vcc, "vcc 5|3"},
+   {"uart", 1, 2, tool_uart, "uart BAUD [even|odd|none]"},
+   {"atr", 0, 1, tool_atr, "atr [HZ]"},
+   {"apdu", 1, 2, tool_apdu, "apdu HEX [MS]"},
+   {"eeprom", 2, 4, tool_eeprom,
+    "eeprom dump CHIP|auto [ADDR [LEN]] | write|verify CHIP|auto FILE"},
+   {"avr", 2, 2, tool_avr, "avr flash|verify FILE"},
+   {"pic", 3, 3, tool_pic, "pic flash|verify CHIP FILE"},
+   {"script", 1, TOOL_ARGS, tool_script, "script FILE [NAME=VALUE ...]"},
+   {NULL, 0, 0, NULL, NULL}
+};
+
+static void tool_usage(FILE * f)
+{
+   const struct tool_cmd *c;
+
+   fprintf(f, "Usage: iuutool [-d N] [-a CTRL] [-c DIR] [-k] [-n] "
+           "[-f FILE|-] [COMMAND ARGS...]\n\n");
+   fprintf(f, "  -d N     use IUU number N (0 is the first one)\n");
+   fprintf(f, "  -a CTRL  EEPROM control byte (0xA0)\n");
+   fprintf(f, "  -c DIR   keep compiled scripts in DIR\n");
+   fprintf(f, "  -k       keep going after a command fails\n");
+   fprintf(f, "  -n       do not read back what gets programmed\n");
+   fprintf(f, "  -f FILE  run the commands in FILE, one per line "
+           "(stdin with - or\n           when no command is given)\n\n");
+   fprintf(f, "Commands:\n");
+   for (c = tool_cmds; c->name; c++)
+      fprintf(f, "  %s\n", c->usage);
+}
+
+// Runs a command and prints its line, returns 0 if it went right
+static int tool_run(struct tool *t, int argc, char **argv)
+{
+   const struct tool_cmd *c;
+   iuu_error status;
+
+   for (c = tool_cmds; c->name; c++)
+      if (!strcmp(c->name, argv[0]))
+         break;
+
+   t->len = 0;
+   t->out[0] = '\0';
+   if (!c->name || argc - 1 < c->min || argc - 1 > c->max) {
+      status = IUU_INVALID_PARAMETER;
+      if (c->name)
+         fprintf(stderr, "Usage: %s\n", c->usage);
+      else
+         fprintf(stderr, "Unknown command %s\n", argv[0]);
+   } else
+      status = c->run(t, argc - 1, argv + 1);
+
+   if (status == IUU_OPERATION_OK)
+      printf("%s ok%s\n", argv[0], t->out);
+   else
+      printf("%s error code=%d%s\n", argv[0], status, t->out);
+   fflush(stdout);
+   return status != IUU_OPERATION_OK;
+}
+
+// Runs the commands in f one per line, skipping blank lines and '#'
+// comments. Returns the number of commands that failed.
+static int tool_batch(struct tool *t, FILE * f, int keep)
+{
+   char line[TOOL_LINE], *argv[TOOL_ARGS + 2], *p;
+   int argc, failed = 0;
+
+   while (fgets(line, sizeof(line), f)) {
+      p = strchr(line, '#');
+      if (p)
+         *p = '\0';
+      argc = 0;
+      for (p = strtok(line, " \t\r\n"); p && argc <= TOOL_ARGS;
+           p = strtok(NULL, " \t\r\n"))
+         argv[argc++] = p;
+      argv[argc] = NULL;
+      if (!argc)
+         continue;
+
+      failed += tool_run(t, argc, argv);
+      if (failed && !keep)
+         break;
+   }
+   return failed;
+}
+
+int main(int argc, char **argv)
+{
+   struct tool t;
+   const char *batch = NULL;
+   unsigned long v;
+   int opt, ndev, devnum = 0, keep = 0, failed;
+   iuu_error status;
+   FILE *f;
+
+   memset(&t, 0, sizeof(t));
+   t.ctrl = 0xA0;
+   t.clk = IUU_CLK_3579000;
+   t.verify = 1;
+
+   while ((opt = getopt(argc, argv, "+d:a:c:f:knh")) != -1) {
+      switch (opt) {
+      case 'd':
+         if (tool_num(optarg, 255, &v) != IUU_OPERATION_OK)
+            return 2;
+         devnum = v;
+         break;
+      case 'a':
+         if (tool_num(optarg, 0xFF, &v) != IUU_OPERATION_OK)
+            return 2;
+         t.ctrl = v;
+         break;
+      case 'c':
+         t.cachedir = optarg;
+         break;
+      case 'f':
+         batch = optarg;
+         break;
+      case 'k':
+         keep = 1;
+         break;
+      case 'n':
+         t.verify = 0;
+         break;
+      case 'h':
+         tool_usage(stdout);
+         return 0;
+      default:
+         tool_usage(stderr);
+         return 2;
+      }
+   }
+   if (optind == argc && !batch)
+      batch = "-";
+
+   f = stdin;
+   if (batch && strcmp(batch, "-")) {
+      f = fopen(batch, "r");
+      if (!f) {
+         perror(batch);
+         return 2;
+      }
+   }
+
+   status = iuu_ndevs(&ndev);
+   if (status == IUU_OPERATION_OK && devnum >= ndev)
+      status = IUU_DEVICE_NOT_FOUND;
+   if (status == IUU_OPERATION_OK)
+      status = iuu_start(&t.inf, devnum);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_cts(&t.inf);
+   if (status != IUU_OPERATION_OK) {
+      iuu_process_error(status, __FILE__, __LINE__);
+      printf("open error code=%d\n", status);
+      return 2;
+   }
+
+   t.size = 256;
+   t.out = malloc(t.size);
+   if (!t.out)
+      return 2;
+
+   if (batch)
+      failed = tool_batch(&t, f, keep);
+   else
+      failed = tool_run(&t, argc - optind, argv + optind);
+
+   if (f != stdin)
+      fclose(f);
+   free(t.out);
+   iuu_stop(&t.inf);
+   return failed ? 1 : 0;
+}
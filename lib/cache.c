@@ -0,0 +1,338 @@
+/*
+ *  iuutool - a port of WBE's Infinity USB Unlimited SDK
+ * 
+ *  Copyright (C) 2006 Juan Carlos Borrs
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as 
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <stdio.h>
+#include <usb.h>
+
+#include <iuu.h>
+#include "iuu_priv.h"
+
+// What an entry was built from
+struct iuu_cache_key {
+   u_int64_t hash;              // of the contents, see iuu_hash()
+   size_t len;                  // bytes hashed
+   int file;                    // from a file rather than an image
+   iuu_image_format fmt;        // file format
+   u_int32_t base;              // file base address
+   iuu_target target;
+   const void *chip;            // EEPROM or PIC profile
+   u_int8_t ctrl;               // EEPROM control byte
+};
+
+struct iuu_cache_entry {
+   struct iuu_cache_key key;
+   struct iuu_image img;
+   struct iuu_stream s;
+   size_t bytes;                // memory taken
+   int refs;                    // users, an entry in use is not evicted
+   struct iuu_cache_entry *prev, *next; // most recently used first
+};
+
+struct iuu_cache {
+   pthread_mutex_t lock;
+   struct iuu_cache_entry *head, *tail;
+   size_t budget;
+   struct iuu_cache_stats stats;
+};
+
+// Fills the part of k that comes from job
+static void iuu_cache_job(struct iuu_cache_key *k, const struct iuu_job *job)
+{
+   k->target = job->target;
+   k->chip = NULL;
+   k->ctrl = 0;
+   if (job->target == IUU_TARGET_EEPROM) {
+      k->chip = job->eeprom;
+      k->ctrl = job->ctrl;
+   } else if (job->target == IUU_TARGET_PIC)
+      k->chip = job->pic;
+}
+
+static int iuu_cache_same(const struct iuu_cache_key *a,
+                          const struct iuu_cache_key *b)
+{
+   return a->hash == b->hash && a->len == b->len && a->file == b->file &&
+       a->fmt == b->fmt && a->base == b->base && a->target == b->target &&
+       a->chip == b->chip && a->ctrl == b->ctrl;
+}
+
+static void iuu_cache_unlink(struct iuu_cache *cache,
+                             struct iuu_cache_entry *e)
+{
+   if (e->prev)
+      e->prev->next = e->next;
+   else
+      cache->head = e->next;
+   if (e->next)
+      e->next->prev = e->prev;
+   else
+      cache->tail = e->prev;
+   e->prev = e->next = NULL;
+}
+
+static void iuu_cache_front(struct iuu_cache *cache,
+                            struct iuu_cache_entry *e)
+{
+   e->prev = NULL;
+   e->next = cache->head;
+   if (cache->head)
+      cache->head->prev = e;
+   else
+      cache->tail = e;
+   cache->head = e;
+}
+
+static void iuu_cache_destroy(struct iuu_cache_entry *e)
+{
+   iuu_image_free(&e->img);
+   iuu_stream_free(&e->s);
+   free(e);
+}
+
+// Evicts the least recently used entries until the cache fits its
+// budget. Entries in use stay until they are released.
+static void iuu_cache_evict(struct iuu_cache *cache)
+{
+   struct iuu_cache_entry *e = cache->tail, *prev;
+
+   for (; e && cache->stats.bytes > cache->budget; e = prev) {
+      prev = e->prev;
+      if (e->refs)
+         continue;
+      iuu_cache_unlink(cache, e);
+      cache->stats.bytes -= e->bytes;
+      cache->stats.entries--;
+      cache->stats.evictions++;
+      iuu_cache_destroy(e);
+   }
+}
+
+// Creates a cache that keeps up to budget bytes of images and streams
+iuu_error iuu_cache_open(struct iuu_cache **cache, size_t budget)
+{
+   *cache = calloc(1, sizeof(**cache));
+   if (!*cache) {
+      iuu_process_error(IUU_OUT_OF_MEMORY, __FILE__, __LINE__);
+      return IUU_OUT_OF_MEMORY;
+   }
+   pthread_mutex_init(&(*cache)->lock, NULL);
+   (*cache)->budget = budget;
+   return IUU_OPERATION_OK;
+}
+
+// Frees the cache and every entry in it, none of which may be in use
+void iuu_cache_close(struct iuu_cache *cache)
+{
+   struct iuu_cache_entry *e, *next;
+
+   if (!cache)
+      return;
+   for (e = cache->head; e; e = next) {
+      next = e->next;
+      iuu_cache_destroy(e);
+   }
+   pthread_mutex_destroy(&cache->lock);
+   free(cache);
+}
+
+// Looks k up, counting a hit and taking a reference if found
+static struct iuu_cache_entry *iuu_cache_find(struct iuu_cache *cache,
+                                              const struct iuu_cache_key
+                                              *k)
+{
+   struct iuu_cache_entry *e;
+
+   for (e = cache->head; e; e = e->next)
+      if (iuu_cache_same(&e->key, k))
+         break;
+   if (e) {
+      e->refs++;
+      cache->stats.hits++;
+      iuu_cache_unlink(cache, e);
+      iuu_cache_front(cache, e);
+   }
+   return e;
+}
+
+// Looks k up and, on a miss, builds the entry with img already parsed
+// by the caller. The encoding goes on without the lock held, so that
+// readers of other entries are not kept waiting; if someone else got
+// there first meanwhile their entry is the one kept, and the lookup
+// counts as a hit rather than a miss.
+static iuu_error iuu_cache_get(struct iuu_cache *cache,
+                               const struct iuu_cache_key *k,
+                               const struct iuu_job *job,
+                               struct iuu_image *img,
+                               struct iuu_cache_entry **entry)
+{
+   struct iuu_cache_entry *e, *found;
+   iuu_error status;
+
+   e = calloc(1, sizeof(*e));
+   if (!e) {
+      iuu_process_error(IUU_OUT_OF_MEMORY, __FILE__, __LINE__);
+      return IUU_OUT_OF_MEMORY;
+   }
+   e->key = *k;
+   e->img = *img;
+   memset(img, 0, sizeof(*img));
+   iuu_stream_init(&e->s);
+   status = iuu_job_encode(&e->s, job, &e->img);
+   if (status != IUU_OPERATION_OK) {
+      iuu_cache_destroy(e);
+      return status;
+   }
+   e->bytes = sizeof(*e) + e->img.size +
+       e->img.maxseg * sizeof(*e->img.seg) + e->s.size +
+       e->s.maxcut * sizeof(*e->s.cut);
+   e->refs = 1;
+
+   pthread_mutex_lock(&cache->lock);
+   found = iuu_cache_find(cache, k);
+   if (!found) {
+      cache->stats.misses++;
+      iuu_cache_front(cache, e);
+      cache->stats.bytes += e->bytes;
+      cache->stats.entries++;
+      iuu_cache_evict(cache);
+   }
+   pthread_mutex_unlock(&cache->lock);
+
+   if (found) {
+      iuu_cache_destroy(e);
+      e = found;
+   }
+   *entry = e;
+   return IUU_OPERATION_OK;
+}
+
+// Gives the parsed image and encoded commands of the file at path,
+// read as iuu_image_load() does, to be programmed as job says. The
+// file is only hashed when it is already cached. The entry must be
+// handed back with iuu_cache_release() and is shared, read only, by
+// every thread that gets it.
+iuu_error iuu_cache_load(struct iuu_cache *cache, const struct iuu_job *job,
+                         const char *path, iuu_image_format fmt,
+                         u_int32_t base, struct iuu_cache_entry **entry)
+{
+   struct iuu_cache_key k;
+   struct iuu_image img;
+   iuu_error status;
+   size_t len;
+   void *map;
+
+   status = iuu_image_map(path, &map, &len);
+   if (status != IUU_OPERATION_OK)
+      return status;
+
+   memset(&k, 0, sizeof(k));
+   k.hash = iuu_hash(0, map, len);
+   k.len = len;
+   k.file = 1;
+   k.fmt = fmt;
+   k.base = base;
+   iuu_cache_job(&k, job);
+
+   pthread_mutex_lock(&cache->lock);
+   *entry = iuu_cache_find(cache, &k);
+   pthread_mutex_unlock(&cache->lock);
+   if (*entry) {
+      iuu_image_unmap(map, len);
+      return IUU_OPERATION_OK;
+   }
+
+   status = iuu_image_init(&img, 0xFF);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_image_parse(&img, map ? map : "", len, fmt, base);
+   iuu_image_unmap(map, len);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_cache_get(cache, &k, job, &img, entry);
+   iuu_image_free(&img);
+   return status;
+}
+
+// Same as iuu_cache_load() for an image already in memory, which is
+// copied if it has to be encoded
+iuu_error iuu_cache_encode(struct iuu_cache *cache,
+                           const struct iuu_job *job,
+                           const struct iuu_image *img,
+                           struct iuu_cache_entry **entry)
+{
+   struct iuu_cache_key k;
+   struct iuu_image copy;
+   iuu_error status;
+   int i;
+
+   memset(&k, 0, sizeof(k));
+   k.hash = iuu_image_hash(img);
+   for (i = 0; i < img->nseg; i++)
+      k.len += img->seg[i].len;
+   iuu_cache_job(&k, job);
+
+   pthread_mutex_lock(&cache->lock);
+   *entry = iuu_cache_find(cache, &k);
+   pthread_mutex_unlock(&cache->lock);
+   if (*entry)
+      return IUU_OPERATION_OK;
+
+   status = iuu_image_init(&copy, img->fill);
+   for (i = 0; i < img->nseg && status == IUU_OPERATION_OK; i++)
+      status = iuu_image_parse(&copy, (const char *)img->seg[i].data,
+                               img->seg[i].len, IUU_IMAGE_RAW,
+                               img->seg[i].addr);
+   copy.entry = img->entry;
+   if (status == IUU_OPERATION_OK)
+      status = iuu_cache_get(cache, &k, job, &copy, entry);
+   iuu_image_free(&copy);
+   return status;
+}
+
+// Hands back an entry given by iuu_cache_load() or iuu_cache_encode()
+void iuu_cache_release(struct iuu_cache *cache, struct iuu_cache_entry *e)
+{
+   pthread_mutex_lock(&cache->lock);
+   e->refs--;
+   if (!e->refs)
+      iuu_cache_evict(cache);
+   pthread_mutex_unlock(&cache->lock);
+}
+
+// The image and commands of an entry
+const struct iuu_image *iuu_cache_image(const struct iuu_cache_entry *e)
+{
+   return &e->img;
+}
+
+const struct iuu_stream *iuu_cache_stream(const struct iuu_cache_entry *e)
+{
+   return &e->s;
+}
+
+// How the cache has done so far
+void iuu_cache_get_stats(struct iuu_cache *cache,
+                         struct iuu_cache_stats *stats)
+{
+   pthread_mutex_lock(&cache->lock);
+   *stats = cache->stats;
+   pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,689 @@
+/*
+ *  iuutool - a port of WBE's Infinity USB Unlimited SDK
+ * 
+ *  Copyright (C) 2006 Juan Carlos Borrs
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as 
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+
+#include <stdio.h>
+#include <usb.h>
+
+#include <iuu.h>
+#include "iuu_priv.h"
+
+const struct iuu_eeprom_chip iuu_eeprom_chips[] = {
+   {"24C01", 128, 8, 0, 10},
+   {"24C02", 256, 8, 0, 10},
+   {"24C04", 512, 16, 0, 10},
+   {"24C08", 1024, 16, 0, 10},
+   {"24C16", 2048, 16, 0, 10},
+   {"24C32", 4096, 32, 1, 5},
+   {"24C64", 8192, 32, 1, 5},
+   {"24C128", 16384, 64, 1, 5},
+   {"24C256", 32768, 64, 1, 5},
+   {"24C512", 65536, 128, 1, 5},
+   {"24C1024", 131072, 256, 1, 5},
+   {NULL, 0, 0, 0, 0}
+};
+
+// Returns the profile of the chip called name (e.g. "24C64"), or NULL
+// if we do not know about it
+const struct iuu_eeprom_chip *iuu_eeprom_chip(const char *name)
+{
+   const struct iuu_eeprom_chip *chip;
+
+   for (chip = iuu_eeprom_chips; chip->name; chip++)
+      if (!strcasecmp(chip->name, name))
+         return chip;
+   return NULL;
+}
+
+// Largest write command that can be used at addr for at most len
+// bytes without crossing a page of chip
+static size_t iuu_eeprom_block(const struct iuu_eeprom_chip *chip,
+                               u_int32_t addr, size_t len)
+{
+   static const size_t sizes8[] = { 16, 8, 1 };
+   static const size_t sizes16[] = { 64, 32, 1 };
+   const size_t *sizes = chip->addr16 ? sizes16 : sizes8;
+   int i;
+
+   for (i = 0; i < 2; i++)
+      if (sizes[i] <= chip->page && sizes[i] <= len &&
+          addr % sizes[i] == 0)
+         return sizes[i];
+   return 1;
+}
+
+// Builds in cmd the write command for n bytes of data at addr (n as
+// returned by iuu_eeprom_block()) followed by a wait of twr ms for the
+// write cycle of the chip, if any. Returns the length of it all.
+static int iuu_eeprom_cmd(u_int8_t * cmd, u_int8_t ctrl,
+                          const struct iuu_eeprom_chip *chip,
+                          u_int32_t addr, const u_int8_t * data, size_t n,
+                          u_int8_t twr)
+{
+   int len = 0;
+
+   if (chip->addr16) {
+      cmd[len++] = n == 64 ? IUU_EEPROM_WRITEX64 :
+          (n == 32 ? IUU_EEPROM_WRITEX32 : IUU_EEPROM_WRITEX);
+      cmd[len++] = ctrl | (((addr >> 16) & 0x07) << 1);
+      cmd[len++] = (u_int8_t) (addr & 0x00FF);
+      cmd[len++] = (u_int8_t) ((addr >> 8) & 0x00FF);
+   } else {
+      cmd[len++] = n == 16 ? IUU_EEPROM_WRITE16 :
+          (n == 8 ? IUU_EEPROM_WRITE8 : IUU_EEPROM_WRITE);
+      cmd[len++] = ctrl | (((addr >> 8) & 0x07) << 1);
+      cmd[len++] = (u_int8_t) (addr & 0x00FF);
+   }
+   memcpy(&cmd[len], data, n);
+   len += n;
+
+   if (twr) {
+      cmd[len++] = IUU_WAIT_MS;
+      cmd[len++] = twr;
+   }
+
+   return len;
+}
+
+// Builds in cmd a single byte read of addr and returns its length
+static int iuu_eeprom_probe(u_int8_t * cmd, u_int8_t ctrl,
+                            const struct iuu_eeprom_chip *chip,
+                            u_int32_t addr)
+{
+   int len = 0;
+
+   if (chip->addr16) {
+      cmd[len++] = IUU_EEPROM_READX;
+      cmd[len++] = ctrl | (((addr >> 16) & 0x07) << 1);
+      cmd[len++] = (u_int8_t) (addr & 0x00FF);
+      cmd[len++] = (u_int8_t) ((addr >> 8) & 0x00FF);
+   } else {
+      cmd[len++] = IUU_EEPROM_READ;
+      cmd[len++] = ctrl | (((addr >> 8) & 0x07) << 1);
+      cmd[len++] = (u_int8_t) (addr & 0x00FF);
+   }
+
+   return len;
+}
+
+// Polls the chip until addr reads as data, which happens as soon as
+// the write cycle is over since a busy chip does not acknowledge and
+// reads as 0xFF. The first probe goes in the same transfer as the len
+// bytes already in cmd. Gives up with IUU_VERIFY_FAILED after twice the
+// write cycle time of the chip.
+static iuu_error iuu_eeprom_poll(iuu * inf, u_int8_t ctrl,
+                                 const struct iuu_eeprom_chip *chip,
+                                 u_int32_t addr, u_int8_t data,
+                                 u_int8_t * cmd, int len)
+{
+   iuu_error status;
+   u_int8_t b;
+   int i, probes;
+
+   probes = 2 * 100 * chip->twr / IUU_EEPROM_POLL_STEP + 1;
+
+   for (i = 0; i < probes; i++) {
+      cmd[len++] = IUU_WAIT_MUS;
+      cmd[len++] = IUU_EEPROM_POLL_STEP;
+      len += iuu_eeprom_probe(cmd + len, ctrl, chip, addr);
+
+      status = iuu_write(inf, cmd, len);
+      if (status != IUU_OPERATION_OK) {
+         iuu_process_error(status, __FILE__, __LINE__);
+         return status;
+      }
+
+      status = iuu_read_all(inf, &b, 1);
+      if (status != IUU_OPERATION_OK) {
+         iuu_process_error(status, __FILE__, __LINE__);
+         return status;
+      }
+
+      if (b == data)
+         return IUU_OPERATION_OK;
+      len = 0;
+   }
+
+   return IUU_VERIFY_FAILED;
+}
+
+// Waits until the chip has finished the write cycle of a write that
+// left data at addr, instead of sleeping for the worst case tWR. Since
+// a busy chip reads as 0xFF, data should be anything else; for 0xFF
+// this just waits for the write cycle time of the chip.
+iuu_error iuu_eeprom_ready(iuu * inf, u_int8_t ctrl,
+                           const struct iuu_eeprom_chip *chip,
+                           u_int32_t addr, u_int8_t data)
+{
+   iuu_error status;
+   u_int8_t cmd[16];
+
+   if (data == 0xFF) {
+      cmd[0] = IUU_WAIT_MS;
+      cmd[1] = chip->twr;
+      status = iuu_write(inf, cmd, 2);
+   } else
+      status = iuu_eeprom_poll(inf, ctrl, chip, addr, data, cmd, 0);
+
+   if (status != IUU_OPERATION_OK)
+      iuu_process_error(status, __FILE__, __LINE__);
+   return status;
+}
+
+// Writes n bytes (as returned by iuu_eeprom_block()) and waits for the
+// write cycle to be over by polling the last byte of the block which
+// does not read as a busy chip
+static iuu_error iuu_eeprom_write_poll(iuu * inf, u_int8_t ctrl,
+                                       const struct iuu_eeprom_chip *chip,
+                                       u_int32_t addr,
+                                       const u_int8_t * data, size_t n)
+{
+   u_int8_t cmd[IUU_USB_MAX_PAYLOAD];
+   int i, len;
+
+   for (i = n - 1; i >= 0; i--)
+      if (data[i] != 0xFF)
+         break;
+
+   if (i < 0) {
+      len = iuu_eeprom_cmd(cmd, ctrl, chip, addr, data, n, chip->twr);
+      return iuu_write(inf, cmd, len);
+   }
+
+   len = iuu_eeprom_cmd(cmd, ctrl, chip, addr, data, n, 0);
+   return iuu_eeprom_poll(inf, ctrl, chip, addr + i, data[i], cmd, len);
+}
+
+// Appends to s the commands writing len bytes of data at addr of an
+// EEPROM of type chip. Every write is as large as the page of the chip
+// and the commands of the IUU allow, and is followed by a firmware
+// side wait for its write cycle. Unaligned heads and tails are written
+// byte by byte; iuu_eeprom_write_image() avoids that by filling them
+// up with what the chip already holds.
+iuu_error iuu_eeprom_encode(struct iuu_stream *s, u_int8_t ctrl,
+                            const struct iuu_eeprom_chip *chip,
+                            u_int32_t addr, const u_int8_t * data,
+                            size_t len)
+{
+   iuu_error status;
+   u_int8_t cmd[IUU_USB_MAX_PAYLOAD];
+   size_t done = 0, n;
+   int l;
+
+   if (len > chip->size || addr > chip->size - len) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+
+   while (done < len) {
+      n = iuu_eeprom_block(chip, addr + done, len - done);
+      l = iuu_eeprom_cmd(cmd, ctrl, chip, addr + done, data + done, n,
+                         chip->twr);
+      status = iuu_stream_add(s, cmd, l);
+      if (status != IUU_OPERATION_OK)
+         return status;
+      done += n;
+   }
+
+   return IUU_OPERATION_OK;
+}
+
+// Writes len bytes of data at addr of an EEPROM of type chip with as
+// few write cycles and USB transfers as possible. If the image does
+// not start or end at a write boundary, the missing bytes are read
+// from the chip first so the edges do not have to go byte by byte.
+iuu_error iuu_eeprom_write_image(iuu * inf, u_int8_t ctrl,
+                                 const struct iuu_eeprom_chip *chip,
+                                 u_int32_t addr, const u_int8_t * data,
+                                 size_t len)
+{
+   return iuu_eeprom_program(inf, ctrl, chip, addr, data, len, 0, NULL);
+}
+
+// Like iuu_eeprom_write_image() but flags (an OR of enum
+// iuu_eeprom_flags_t) select how, and if stats is not NULL it tells
+// what was done. With IUU_EEPROM_DIFF the chip is read first and only
+// the blocks that differ from the image are written, which saves most
+// of the write cycles when reprogramming a card with a similar image.
+// With IUU_EEPROM_POLL every write waits just as long as the chip
+// needs, see iuu_eeprom_ready(), instead of its worst case tWR. That
+// costs a round trip per write so it pays off for slow chips and
+// fast USB hosts.
+iuu_error iuu_eeprom_program(iuu * inf, u_int8_t ctrl,
+                             const struct iuu_eeprom_chip *chip,
+                             u_int32_t addr, const u_int8_t * data,
+                             size_t len, int flags,
+                             struct iuu_eeprom_stats *stats)
+{
+   iuu_error status = IUU_OPERATION_OK;
+   struct iuu_stream s;
+   u_int8_t *buf = NULL, *old = NULL;
+   u_int32_t start, end, g, o;
+   size_t written = 0, skipped = 0;
+
+   if (len > chip->size || addr > chip->size - len) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+
+   // Work on whole write blocks
+   g = iuu_eeprom_block(chip, 0, chip->page);
+   start = addr - addr % g;
+   end = addr + len;
+   if (end % g)
+      end += g - end % g;
+
+   if (start != addr || end != addr + len || (flags & IUU_EEPROM_DIFF)) {
+      buf = malloc(end - start);
+      if (flags & IUU_EEPROM_DIFF)
+         old = malloc(end - start);
+      if (!buf || ((flags & IUU_EEPROM_DIFF) && !old)) {
+         iuu_process_error(IUU_OUT_OF_MEMORY, __FILE__, __LINE__);
+         free(buf);
+         free(old);
+         return IUU_OUT_OF_MEMORY;
+      }
+
+      if (flags & IUU_EEPROM_DIFF) {
+         status = iuu_eeprom_read_batch(inf, ctrl, start, end - start,
+                                        old, chip->addr16);
+         memcpy(buf, old, end - start);
+      } else {
+         if (start < addr)
+            status = iuu_eeprom_read_batch(inf, ctrl, start,
+                                           addr - start, buf,
+                                           chip->addr16);
+         if (status == IUU_OPERATION_OK && end > addr + len)
+            status = iuu_eeprom_read_batch(inf, ctrl, addr + len,
+                                           end - addr - len,
+                                           buf + (addr + len - start),
+                                           chip->addr16);
+      }
+      if (status != IUU_OPERATION_OK) {
+         iuu_process_error(status, __FILE__, __LINE__);
+         free(buf);
+         free(old);
+         return status;
+      }
+
+      memcpy(buf + (addr - start), data, len);
+      data = buf;
+   }
+
+   iuu_stream_init(&s);
+   for (o = 0; o < end - start && status == IUU_OPERATION_OK; o += g) {
+      if (old && !memcmp(data + o, old + o, g)) {
+         skipped += g;
+         continue;
+      }
+      if (flags & IUU_EEPROM_POLL)
+         status = iuu_eeprom_write_poll(inf, ctrl, chip, start + o,
+                                        data + o, g);
+      else
+         status = iuu_eeprom_encode(&s, ctrl, chip, start + o,
+                                    data + o, g);
+      written += g;
+   }
+
+   if (status == IUU_OPERATION_OK)
+      status = iuu_stream_send(inf, &s);
+   if (status != IUU_OPERATION_OK)
+      iuu_process_error(status, __FILE__, __LINE__);
+
+   if (stats) {
+      stats->written = written;
+      stats->skipped = skipped;
+   }
+
+   iuu_stream_free(&s);
+   free(buf);
+   free(old);
+   return status;
+}
+
+// Writes data at addr if wr is set and then reads back addr and other,
+// all in a single round trip
+static iuu_error iuu_eeprom_touch(iuu * inf, u_int8_t ctrl,
+                                  const struct iuu_eeprom_chip *chip,
+                                  u_int32_t addr, u_int32_t other, int wr,
+                                  u_int8_t data, u_int8_t * back)
+{
+   iuu_error status;
+   u_int8_t cmd[32];
+   int len = 0;
+
+   if (wr)
+      len = iuu_eeprom_cmd(cmd, ctrl, chip, addr, &data, 1, chip->twr);
+   len += iuu_eeprom_probe(cmd + len, ctrl, chip, addr);
+   len += iuu_eeprom_probe(cmd + len, ctrl, chip, other);
+
+   status = iuu_write(inf, cmd, len);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_read_all(inf, back, 2);
+   return status;
+}
+
+// A marker that none of a, b or a chip that does not answer reads as
+static u_int8_t iuu_eeprom_marker(u_int8_t a, u_int8_t b)
+{
+   u_int8_t m = 0x5A;
+
+   while (m == a || m == b || m == 0xFF)
+      m++;
+   return m;
+}
+
+// Finds out whether addr is a cell of its own, which is the case when
+// the chip is bigger than addr. Otherwise addr either wraps around to
+// address 0 or there is nothing answering at it. The cell touched is
+// restored afterwards.
+static iuu_error iuu_eeprom_inside(iuu * inf, u_int8_t ctrl,
+                                   const struct iuu_eeprom_chip *chip,
+                                   u_int32_t addr, int *inside)
+{
+   iuu_error status;
+   u_int8_t v[2], b[2], m;
+
+   *inside = 0;
+   status = iuu_eeprom_touch(inf, ctrl, chip, addr, 0, 0, 0, v);
+   if (status != IUU_OPERATION_OK)
+      return status;
+
+   m = iuu_eeprom_marker(v[0], v[1]);
+   status = iuu_eeprom_touch(inf, ctrl, chip, addr, 0, 1, m, b);
+   if (status != IUU_OPERATION_OK)
+      return status;
+
+   if (b[1] == m)
+      return iuu_eeprom_touch(inf, ctrl, chip, 0, 0, 1, v[1], b);
+   if (b[0] == m) {
+      *inside = 1;
+      return iuu_eeprom_touch(inf, ctrl, chip, addr, 0, 1, v[0], b);
+   }
+   return IUU_OPERATION_OK;
+}
+
+// Tells 8 from 16 bit addressed chips. A write with 8 bit addressing
+// only loads the address pointer of a 16 bit chip, so a marker that
+// sticks (twice, to rule out luck) means 8 bit addressing. Otherwise a
+// marker written with 16 bit addressing must stick, or there is no chip
+// answering at ctrl (or it is write protected) and IUU_DEVICE_NOT_FOUND
+// is returned.
+static iuu_error iuu_eeprom_width(iuu * inf, u_int8_t ctrl, int *addr16)
+{
+   const struct iuu_eeprom_chip *chip = &iuu_eeprom_chips[0];
+   iuu_error status;
+   u_int8_t v[2], b[2], m;
+
+   *addr16 = 1;
+   status = iuu_eeprom_touch(inf, ctrl, chip, 0, 0, 0, 0, v);
+   if (status != IUU_OPERATION_OK)
+      return status;
+
+   m = iuu_eeprom_marker(v[0], v[0]);
+   status = iuu_eeprom_touch(inf, ctrl, chip, 0, 0, 1, m, b);
+   if (status != IUU_OPERATION_OK)
+      return status;
+   if (b[0] == m) {
+      m = iuu_eeprom_marker(v[0], m);
+      status = iuu_eeprom_touch(inf, ctrl, chip, 0, 0, 1, m, b);
+      if (status != IUU_OPERATION_OK)
+         return status;
+      if (b[0] == m) {
+         *addr16 = 0;
+         return iuu_eeprom_touch(inf, ctrl, chip, 0, 0, 1, v[0], b);
+      }
+   }
+
+   while (!chip->addr16)
+      chip++;
+   status = iuu_eeprom_touch(inf, ctrl, chip, 0, 0, 0, 0, v);
+   if (status != IUU_OPERATION_OK)
+      return status;
+
+   m = iuu_eeprom_marker(v[0], v[0]);
+   status = iuu_eeprom_touch(inf, ctrl, chip, 0, 0, 1, m, b);
+   if (status != IUU_OPERATION_OK)
+      return status;
+   if (b[0] != m)
+      return IUU_DEVICE_NOT_FOUND;
+   return iuu_eeprom_touch(inf, ctrl, chip, 0, 0, 1, v[0], b);
+}
+
+// Finds out the addressing and size of the EEPROM at ctrl and returns
+// in chip the profile that matches, without having to read it all.
+// Sizes are told apart by a binary search on the addresses where the
+// chips of iuu_eeprom_chips[] would wrap around, so it takes a handful
+// of round trips and write cycles. Every cell written to is restored.
+// The result is kept until the next iuu_eeprom_on() or iuu_eeprom_off().
+iuu_error iuu_eeprom_detect(iuu * inf, u_int8_t ctrl,
+                            const struct iuu_eeprom_chip **chip)
+{
+   const struct iuu_eeprom_chip *c, *first = NULL;
+   iuu_error status;
+   int addr16, n = 0, lo, hi, mid, inside;
+
+   if (inf->eeprom && inf->eeprom_ctrl == ctrl) {
+      *chip = inf->eeprom;
+      return IUU_OPERATION_OK;
+   }
+
+   inf->eeprom = NULL;
+   status = iuu_eeprom_width(inf, ctrl, &addr16);
+   if (status != IUU_OPERATION_OK) {
+      iuu_process_error(status, __FILE__, __LINE__);
+      return status;
+   }
+
+   // chips of a width are contiguous and sorted by size in the table
+   for (c = iuu_eeprom_chips; c->name; c++)
+      if (c->addr16 == addr16) {
+         if (!first)
+            first = c;
+         n++;
+      }
+
+   lo = 0;
+   hi = n - 1;
+   while (lo < hi) {
+      mid = (lo + hi) / 2;
+      status = iuu_eeprom_inside(inf, ctrl, &first[hi], first[mid].size,
+                                 &inside);
+      if (status != IUU_OPERATION_OK) {
+         iuu_process_error(status, __FILE__, __LINE__);
+         return status;
+      }
+      if (inside)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   inf->eeprom = &first[lo];
+   inf->eeprom_ctrl = ctrl;
+   *chip = inf->eeprom;
+   return IUU_OPERATION_OK;
+}
+
+// Number of bytes a and b have the same from the start. The common all
+// equal case is left to memcmp(), which is vectorized by the C library.
+static size_t iuu_mismatch_same(const u_int8_t * a, const u_int8_t * b,
+                                size_t n)
+{
+   u_int64_t x, y;
+   size_t i = 0;
+
+   if (!memcmp(a, b, n))
+      return n;
+   for (; i + sizeof(x) <= n; i += sizeof(x)) {
+      memcpy(&x, a + i, sizeof(x));
+      memcpy(&y, b + i, sizeof(y));
+      if (x != y)
+         break;
+   }
+   while (i < n && a[i] == b[i])
+      i++;
+   return i;
+}
+
+// Number of bytes a and b differ from the start
+static size_t iuu_mismatch_differ(const u_int8_t * a, const u_int8_t * b,
+                                  size_t n)
+{
+   size_t i = 0;
+
+   while (i < n && a[i] != b[i])
+      i++;
+   return i;
+}
+
+// Starts collecting in map up to max runs of differing bytes
+void iuu_mismatch_init(struct iuu_mismatch_map *m, struct iuu_mismatch *map,
+                       int max)
+{
+   memset(m, 0, sizeof(*m));
+   m->map = map;
+   m->max = max;
+}
+
+// Compares the n bytes read from addr in got with the ones expected in
+// want and adds the runs that differ to m, carrying on the last run if
+// addr follows the previous call. Returns nonzero, and stops, at the
+// first run that does not fit.
+int iuu_mismatch_scan(struct iuu_mismatch_map *m, u_int32_t addr,
+                      const u_int8_t * got, const u_int8_t * want, size_t n)
+{
+   size_t i, k;
+
+   if (addr != m->next)
+      m->open = 0;
+   m->next = addr + n;
+
+   for (i = 0; i < n && !m->full; i = k) {
+      if (m->open) {
+         k = i + iuu_mismatch_differ(got + i, want + i, n - i);
+         m->map[m->n - 1].len += k - i;
+         if (k < n)
+            m->open = 0;
+         continue;
+      }
+      k = i + iuu_mismatch_same(got + i, want + i, n - i);
+      if (k == n)
+         break;
+      if (m->n == m->max) {
+         m->full = 1;
+         break;
+      }
+      m->map[m->n].addr = addr + k;
+      m->map[m->n++].len = 0;
+      m->open = 1;
+   }
+   return m->full;
+}
+
+// Checks that the len bytes of chip at addr hold data. Reading is
+// double buffered in the IUU: the block reads for the next chunk are
+// already queued while the previous one is drained and compared, so it
+// takes about as long as reading the chip. Runs of differing bytes go
+// to map, up to maxmap of them, and their number to nmap. It stops at
+// the first mismatch that does not fit in map, so with maxmap 0 it just
+// tells whether it all verified. Returns IUU_VERIFY_FAILED on any
+// mismatch.
+iuu_error iuu_eeprom_verify(iuu * inf, u_int8_t ctrl,
+                            const struct iuu_eeprom_chip *chip,
+                            u_int32_t addr, const u_int8_t * data,
+                            size_t len, struct iuu_mismatch *map,
+                            int maxmap, int *nmap)
+{
+   iuu_error status = IUU_OPERATION_OK;
+   struct iuu_mismatch_map m;
+   u_int8_t cmd[IUU_USB_MAX_PAYLOAD];
+   u_int8_t buf[IUU_USB_MAX_READ / 2];
+   size_t sent = 0, done = 0, want[2];
+   int n, q = 0;
+
+   iuu_mismatch_init(&m, map, maxmap);
+   if (nmap)
+      *nmap = 0;
+   if (len > chip->size || addr > chip->size - len) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+
+   // q chunks of want[] bytes are queued, at most two of half the
+   // read size so that the IUU can always hold both
+   while (done < len) {
+      while (q < 2 && sent < len && !m.full) {
+         want[q] = iuu_eeprom_read_cmd(cmd, &n, ctrl, addr + sent,
+                                       len - sent, sizeof(buf),
+                                       chip->addr16);
+         status = iuu_write(inf, cmd, n);
+         if (status != IUU_OPERATION_OK)
+            goto out;
+         sent += want[q++];
+      }
+      if (!q)
+         break;
+
+      status = iuu_read_all(inf, buf, want[0]);
+      if (status != IUU_OPERATION_OK)
+         goto out;
+
+      iuu_mismatch_scan(&m, addr + done, buf, data + done, want[0]);
+      done += want[0];
+      want[0] = want[1];
+      q--;
+      // once stopped just drain what is left queued
+      if (m.full && q) {
+         status = iuu_read_all(inf, buf, want[0]);
+         break;
+      }
+   }
+
+ out:
+   if (nmap)
+      *nmap = m.n;
+   if (status != IUU_OPERATION_OK) {
+      iuu_process_error(status, __FILE__, __LINE__);
+      return status;
+   }
+   return m.n || m.full ? IUU_VERIFY_FAILED : IUU_OPERATION_OK;
+}
+
+// Reads len bytes at addr of an EEPROM of the given chip, addressed
+// the way the chip wants, see iuu_eeprom_read_batch()
+iuu_error iuu_eeprom_dump(iuu * inf, u_int8_t ctrl,
+                          const struct iuu_eeprom_chip *chip,
+                          u_int32_t addr, size_t len, u_int8_t * data)
+{
+   iuu_error status;
+
+   if (len > chip->size || addr > chip->size - len) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+
+   status = iuu_eeprom_read_batch(inf, ctrl, addr, len, data, chip->addr16);
+   if (status != IUU_OPERATION_OK)
+      iuu_process_error(status, __FILE__, __LINE__);
+   return status;
+}
@@ -0,0 +1,234 @@
+/*
+ *  iuutool - a port of WBE's Infinity USB Unlimited SDK
+ * 
+ *  Copyright (C) 2006 Juan Carlos Borrs
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as 
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <stdio.h>
+#include <usb.h>
+
+#include <iuu.h>
+#include "iuu_priv.h"
+
+// What every thread of a gang shares, see iuu_gang_run()
+struct iuu_gang_shared {
+   const struct iuu_job *job;
+   iuu_gang_progress progress;
+   void *arg;
+};
+
+// A reader of a gang and what it is to do
+struct iuu_gang_worker {
+   struct iuu_gang_unit *unit;
+   const struct iuu_gang_task *task;
+   const struct iuu_gang_shared *sh;
+   pthread_t thread;
+   int started;                 // thread was created
+};
+
+// Programs the card of reader u as task says: powers it on, sends the
+// streams of task one transfer at a time, verifies and powers it off,
+// as job->flags tell. progress, if not NULL, is called after every
+// transfer and at the end. The outcome is also left in u->status.
+iuu_error iuu_gang_work(struct iuu_gang_unit *u, const struct iuu_job *job,
+                        const struct iuu_gang_task *task,
+                        iuu_gang_progress progress, void *arg)
+{
+   iuu_error status = IUU_OPERATION_OK;
+   int k, i, n;
+
+   u->status = IUU_OPERATION_OK;
+   u->done = u->total = 0;
+   for (k = 0; k < 2; k++)
+      if (task->s[k])
+         u->total += iuu_stream_transfers(task->s[k]);
+
+   if (job->flags & IUU_JOB_POWER)
+      status = iuu_job_power(u->inf, job, 1);
+
+   for (k = 0; k < 2 && status == IUU_OPERATION_OK; k++) {
+      n = task->s[k] ? iuu_stream_transfers(task->s[k]) : 0;
+      for (i = 0; i < n && status == IUU_OPERATION_OK; i++) {
+         status = iuu_stream_send_range(u->inf, task->s[k], i, 1);
+         if (status != IUU_OPERATION_OK)
+            break;
+         u->done++;
+         if (progress)
+            progress(u, arg);
+      }
+   }
+
+   for (k = 0; k < 2 && status == IUU_OPERATION_OK; k++)
+      if ((job->flags & IUU_JOB_VERIFY) && task->img[k])
+         status = iuu_job_verify(u->inf, job, task->img[k]);
+
+   // power off whatever happened, but keep the first error
+   if (job->flags & IUU_JOB_POWER) {
+      iuu_error off = iuu_job_power(u->inf, job, 0);
+      if (status == IUU_OPERATION_OK)
+         status = off;
+   }
+
+   u->status = status;
+   if (progress)
+      progress(u, arg);
+   return status;
+}
+
+// Programs the card of one reader. Any error stops this reader only.
+static void *iuu_gang_thread(void *arg)
+{
+   struct iuu_gang_worker *w = arg;
+
+   iuu_gang_work(w->unit, w->sh->job, w->task, w->sh->progress,
+                 w->sh->arg);
+   return NULL;
+}
+
+// Opens every IUU attached, up to max of them, for a gang. Returns how
+// many in *n.
+iuu_error iuu_gang_open(iuu * inf, struct iuu_gang_unit *units, int max,
+                        int *n)
+{
+   iuu_error status = IUU_OPERATION_OK;
+
+   for (*n = 0; *n < max; (*n)++) {
+      status = iuu_start(&inf[*n], *n);
+      if (status != IUU_OPERATION_OK)
+         break;
+      memset(&units[*n], 0, sizeof(units[*n]));
+      units[*n].inf = &inf[*n];
+   }
+
+   if (status == IUU_DEVICE_NOT_FOUND && *n)
+      status = IUU_OPERATION_OK;
+   if (status != IUU_OPERATION_OK)
+      iuu_process_error(status, __FILE__, __LINE__);
+   return status;
+}
+
+// Releases the readers of a gang
+iuu_error iuu_gang_close(struct iuu_gang_unit *units, int n)
+{
+   iuu_error status = IUU_OPERATION_OK, st;
+   int i;
+
+   for (i = 0; i < n; i++) {
+      st = iuu_stop(units[i].inf);
+      if (status == IUU_OPERATION_OK)
+         status = st;
+   }
+   return status;
+}
+
+// Runs iuu_gang_work() for each of the n readers of units with the
+// task of the same index, one thread per reader. Returns
+// IUU_OPERATION_OK if every card was programmed, else the error of the
+// first reader that failed.
+iuu_error iuu_gang_run(struct iuu_gang_unit *units, int n,
+                       const struct iuu_job *job,
+                       const struct iuu_gang_task *task,
+                       iuu_gang_progress progress, void *arg)
+{
+   struct iuu_gang_worker *w;
+   struct iuu_gang_shared sh;
+   iuu_error status = IUU_OPERATION_OK;
+   int i;
+
+   w = calloc(n ? n : 1, sizeof(*w));
+   if (!w) {
+      iuu_process_error(IUU_OUT_OF_MEMORY, __FILE__, __LINE__);
+      return IUU_OUT_OF_MEMORY;
+   }
+
+   sh.job = job;
+   sh.progress = progress;
+   sh.arg = arg;
+
+   for (i = 0; i < n; i++) {
+      w[i].unit = &units[i];
+      w[i].task = &task[i];
+      w[i].sh = &sh;
+      w[i].started =
+          !pthread_create(&w[i].thread, NULL, iuu_gang_thread, &w[i]);
+      // no thread, do it here
+      if (!w[i].started)
+         iuu_gang_thread(&w[i]);
+   }
+
+   for (i = 0; i < n; i++) {
+      if (w[i].started)
+         pthread_join(w[i].thread, NULL);
+      if (status == IUU_OPERATION_OK)
+         status = units[i].status;
+   }
+
+   free(w);
+   return status;
+}
+
+// Programs img into the cards of the n readers of units at once, one
+// thread per reader. The commands are encoded a single time, or taken
+// from s if it is not NULL, and every thread sends the same stream.
+// job->flags say whether cards are powered and verified. progress, if
+// not NULL, is called by each thread after every transfer it sends and
+// once it is done, so it must not take long and must be thread safe.
+// The outcome of every reader is left in its unit; a failing card stops
+// its own reader only. Returns IUU_OPERATION_OK if every card was
+// programmed, else the error of the first reader that failed.
+iuu_error iuu_gang_program(struct iuu_gang_unit *units, int n,
+                           const struct iuu_job *job,
+                           const struct iuu_image *img,
+                           const struct iuu_stream *s,
+                           iuu_gang_progress progress, void *arg)
+{
+   struct iuu_gang_task *task;
+   struct iuu_stream own;
+   iuu_error status;
+   int i;
+
+   iuu_stream_init(&own);
+   if (!s) {
+      status = iuu_job_encode(&own, job, img);
+      if (status != IUU_OPERATION_OK) {
+         iuu_stream_free(&own);
+         return status;
+      }
+      s = &own;
+   }
+
+   task = calloc(n ? n : 1, sizeof(*task));
+   if (!task) {
+      iuu_process_error(IUU_OUT_OF_MEMORY, __FILE__, __LINE__);
+      iuu_stream_free(&own);
+      return IUU_OUT_OF_MEMORY;
+   }
+   for (i = 0; i < n; i++) {
+      units[i].record = -1;
+      task[i].s[0] = s;
+      task[i].img[0] = img;
+   }
+
+   status = iuu_gang_run(units, n, job, task, progress, arg);
+
+   free(task);
+   iuu_stream_free(&own);
+   return status;
+}
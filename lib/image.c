@@ -0,0 +1,602 @@
+/*
+ *  iuutool - a port of WBE's Infinity USB Unlimited SDK
+ * 
+ *  Copyright (C) 2006 Juan Carlos Borrs
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as 
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <usb.h>
+
+#include <iuu.h>
+#include "iuu_priv.h"
+
+// Value of every character as a hex digit, 0x80 for the ones that are
+// not. Or-ing the values of a record tells whether any digit was bad.
+static const u_int8_t iuu_hex[256] = {
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+   0x08, 0x09, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+   0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80
+};
+
+// Initializes an empty image, which reads as fill everywhere
+iuu_error iuu_image_init(struct iuu_image *img, u_int8_t fill)
+{
+   memset(img, 0, sizeof(*img));
+   img->fill = fill;
+   return IUU_OPERATION_OK;
+}
+
+// Releases the memory held by an image
+void iuu_image_free(struct iuu_image *img)
+{
+   free(img->seg);
+   free(img->buf);
+   memset(img, 0, sizeof(*img));
+}
+
+// Empties an image but keeps its memory for the next one
+void iuu_image_reset(struct iuu_image *img)
+{
+   img->nseg = 0;
+   img->len = 0;
+   img->entry = 0;
+}
+
+// Makes room in the buffer of img for n more bytes and returns where
+// they go. Segments follow the buffer if it moves.
+static u_int8_t *iuu_image_room(struct iuu_image *img, size_t n)
+{
+   u_int8_t *buf;
+   size_t size;
+   int i;
+
+   if (img->len + n <= img->size)
+      return img->buf + img->len;
+
+   size = img->size ? 2 * img->size : 4096;
+   while (size < img->len + n)
+      size *= 2;
+   buf = realloc(img->buf, size);
+   if (!buf)
+      return NULL;
+
+   for (i = 0; i < img->nseg; i++)
+      img->seg[i].data = buf + (img->seg[i].data - img->buf);
+   img->buf = buf;
+   img->size = size;
+   return img->buf + img->len;
+}
+
+// Adds to img the n bytes at addr already left by the caller where
+// iuu_image_room() said. They extend the last segment when they follow
+// it, which is what records in a file usually do.
+static iuu_error iuu_image_add(struct iuu_image *img, u_int32_t addr,
+                               size_t n)
+{
+   struct iuu_segment *last = img->nseg ? &img->seg[img->nseg - 1] : NULL;
+
+   if ((u_int64_t) addr + n > 0x100000000ULL)
+      return IUU_IMAGE_ERROR;
+
+   if (last && last->addr + last->len == addr &&
+       last->data + last->len == img->buf + img->len) {
+      last->len += n;
+      img->len += n;
+      return IUU_OPERATION_OK;
+   }
+
+   if (img->nseg == img->maxseg) {
+      int max = img->maxseg ? 2 * img->maxseg : 16;
+      struct iuu_segment *seg = realloc(img->seg, max * sizeof(*seg));
+
+      if (!seg)
+         return IUU_OUT_OF_MEMORY;
+      img->seg = seg;
+      img->maxseg = max;
+   }
+
+   img->seg[img->nseg].addr = addr;
+   img->seg[img->nseg].len = n;
+   img->seg[img->nseg].data = img->buf + img->len;
+   img->nseg++;
+   img->len += n;
+   return IUU_OPERATION_OK;
+}
+
+// Decodes into out the n bytes written as 2n hex digits at s. Returns
+// the sum of the bytes, or -1 if any digit was not one.
+int iuu_image_hex(const char *s, u_int8_t * out, size_t n)
+{
+   u_int8_t bad = 0, h, l;
+   unsigned int sum = 0;
+   size_t i;
+
+   for (i = 0; i < n; i++) {
+      h = iuu_hex[(u_int8_t) s[2 * i]];
+      l = iuu_hex[(u_int8_t) s[2 * i + 1]];
+      bad |= h | l;
+      out[i] = (h << 4) | l;
+      sum += out[i];
+   }
+   return bad & 0x80 ? -1 : (int)(sum & 0xFF);
+}
+
+// Sorts segments by address and, for the same address, in the order
+// they were added, which is their order in the buffer
+static int iuu_image_cmp(const void *a, const void *b)
+{
+   const struct iuu_segment *x = a, *y = b;
+
+   if (x->addr != y->addr)
+      return x->addr < y->addr ? -1 : 1;
+   return x->data < y->data ? -1 : (x->data > y->data);
+}
+
+// Same as above but only by the order they were added
+static int iuu_image_cmp_added(const void *a, const void *b)
+{
+   const struct iuu_segment *x = a, *y = b;
+
+   return x->data < y->data ? -1 : (x->data > y->data);
+}
+
+// Leaves the segments of img sorted and merges the ones that touch or
+// overlap, the last one added winning where they overlap. Nothing is
+// moved in the usual case of a file with its records in order.
+static iuu_error iuu_image_normalize(struct iuu_image *img)
+{
+   struct iuu_segment *seg = img->seg;
+   u_int8_t *buf;
+   size_t len = 0;
+   int i, j, k, n = 0;
+
+   for (i = 1; i < img->nseg; i++)
+      if ((u_int64_t) seg[i - 1].addr + seg[i - 1].len >= seg[i].addr)
+         break;
+   if (i >= img->nseg)
+      return IUU_OPERATION_OK;
+
+   qsort(seg, img->nseg, sizeof(*seg), iuu_image_cmp);
+
+   buf = malloc(img->size);
+   if (!buf)
+      return IUU_OUT_OF_MEMORY;
+
+   for (i = 0; i < img->nseg; i = j) {
+      u_int32_t start = seg[i].addr;
+      u_int64_t end = (u_int64_t) seg[i].addr + seg[i].len;
+
+      for (j = i + 1; j < img->nseg && seg[j].addr <= end; j++)
+         if (seg[j].addr + (u_int64_t) seg[j].len > end)
+            end = seg[j].addr + (u_int64_t) seg[j].len;
+
+      qsort(seg + i, j - i, sizeof(*seg), iuu_image_cmp_added);
+      for (k = i; k < j; k++)
+         memcpy(buf + len + (seg[k].addr - start), seg[k].data,
+                seg[k].len);
+
+      seg[n].addr = start;
+      seg[n].len = end - start;
+      seg[n].data = buf + len;
+      len += seg[n++].len;
+   }
+
+   free(img->buf);
+   img->buf = buf;
+   img->len = len;
+   img->nseg = n;
+   return IUU_OPERATION_OK;
+}
+
+// Intel HEX: ":LLAAAATT<data>CC" lines, with extended segment (02) and
+// linear (04) address records for addresses above 64k
+static iuu_error iuu_image_ihex(struct iuu_image *img, const char *p,
+                                const char *end, u_int32_t base)
+{
+   u_int32_t ext = 0;
+   u_int8_t hdr[4], cs, *data;
+   int sum, s2;
+   size_t n;
+
+   for (;;) {
+      while (p < end && isspace((u_int8_t) * p))
+         p++;
+      if (p == end)
+         return IUU_OPERATION_OK;
+      if (*p != ':' || end - p < 11)
+         return IUU_IMAGE_ERROR;
+
+      sum = iuu_image_hex(p + 1, hdr, 4);
+      if (sum < 0)
+         return IUU_IMAGE_ERROR;
+      n = hdr[0];
+      if ((size_t) (end - p) < 11 + 2 * n)
+         return IUU_IMAGE_ERROR;
+
+      data = iuu_image_room(img, n);
+      if (!data)
+         return IUU_OUT_OF_MEMORY;
+      s2 = iuu_image_hex(p + 9, data, n);
+      if (s2 < 0 || iuu_image_hex(p + 9 + 2 * n, &cs, 1) < 0 ||
+          ((sum + s2 + cs) & 0xFF))
+         return IUU_IMAGE_ERROR;
+      p += 11 + 2 * n;
+
+      switch (hdr[3]) {
+      case 0x00:
+         if (iuu_image_add(img, base + ext + ((hdr[1] << 8) | hdr[2]), n))
+            return IUU_IMAGE_ERROR;
+         break;
+      case 0x01:
+         return IUU_OPERATION_OK;
+      case 0x02:
+         if (n != 2)
+            return IUU_IMAGE_ERROR;
+         ext = ((data[0] << 8) | data[1]) << 4;
+         break;
+      case 0x03:
+         if (n != 4)
+            return IUU_IMAGE_ERROR;
+         img->entry = (((data[0] << 8) | data[1]) << 4) +
+             ((data[2] << 8) | data[3]);
+         break;
+      case 0x04:
+         if (n != 2)
+            return IUU_IMAGE_ERROR;
+         ext = (u_int32_t) ((data[0] << 8) | data[1]) << 16;
+         break;
+      case 0x05:
+         if (n != 4)
+            return IUU_IMAGE_ERROR;
+         img->entry = ((u_int32_t) data[0] << 24) | (data[1] << 16) |
+             (data[2] << 8) | data[3];
+         break;
+      default:
+         return IUU_IMAGE_ERROR;
+      }
+   }
+}
+
+// Motorola S-records: "STCC<address><data>CC" lines, S1 to S3 carrying
+// data with 2 to 4 address bytes and S7 to S9 the start address
+static iuu_error iuu_image_srec(struct iuu_image *img, const char *p,
+                                const char *end, u_int32_t base)
+{
+   static const int addrlen[10] = { 2, 2, 3, 4, 2, 2, 3, 4, 3, 2 };
+   u_int8_t cnt, a[4], *data;
+   u_int32_t addr;
+   int t, i, sum, s2;
+
+   for (;;) {
+      while (p < end && isspace((u_int8_t) * p))
+         p++;
+      if (p == end)
+         return IUU_OPERATION_OK;
+      if (*p != 'S' || end - p < 4 || p[1] < '0' || p[1] > '9')
+         return IUU_IMAGE_ERROR;
+
+      t = p[1] - '0';
+      if (t == 4 || iuu_image_hex(p + 2, &cnt, 1) < 0 ||
+          cnt < addrlen[t] + 1 || end - p < 4 + 2 * cnt)
+         return IUU_IMAGE_ERROR;
+
+      sum = iuu_image_hex(p + 4, a, addrlen[t]);
+      data = iuu_image_room(img, cnt);
+      if (!data)
+         return IUU_OUT_OF_MEMORY;
+      // data and checksum, which makes the sum of it all 0xFF
+      s2 = iuu_image_hex(p + 4 + 2 * addrlen[t], data, cnt - addrlen[t]);
+      if (sum < 0 || s2 < 0 || ((cnt + sum + s2) & 0xFF) != 0xFF)
+         return IUU_IMAGE_ERROR;
+      p += 4 + 2 * cnt;
+
+      for (addr = 0, i = 0; i < addrlen[t]; i++)
+         addr = (addr << 8) | a[i];
+
+      if (t >= 1 && t <= 3) {
+         if (iuu_image_add(img, base + addr, cnt - addrlen[t] - 1))
+            return IUU_IMAGE_ERROR;
+      } else if (t >= 7)
+         img->entry = addr;
+   }
+}
+
+// Adds to img the image in the len bytes of text, in format fmt. The
+// data of hex formats is placed base bytes above the addresses of the
+// file, a raw image starts at base. The image ends up with its segments
+// sorted by address and none of them touching another.
+iuu_error iuu_image_parse(struct iuu_image *img, const char *text,
+                          size_t len, iuu_image_format fmt, u_int32_t base)
+{
+   const char *p = text, *end = text + len;
+   iuu_error status;
+   u_int8_t *data;
+
+   if (fmt == IUU_IMAGE_AUTO) {
+      while (p < end && isspace((u_int8_t) * p))
+         p++;
+      if (p < end && *p == ':')
+         fmt = IUU_IMAGE_IHEX;
+      else if (end - p > 1 && *p == 'S' && isdigit((u_int8_t) p[1]))
+         fmt = IUU_IMAGE_SREC;
+      else
+         fmt = IUU_IMAGE_RAW;
+   }
+
+   switch (fmt) {
+   case IUU_IMAGE_IHEX:
+      status = iuu_image_ihex(img, p, end, base);
+      break;
+   case IUU_IMAGE_SREC:
+      status = iuu_image_srec(img, p, end, base);
+      break;
+   case IUU_IMAGE_RAW:
+      // an empty file is an empty image
+      if (!len) {
+         status = IUU_OPERATION_OK;
+         break;
+      }
+      status = IUU_OUT_OF_MEMORY;
+      data = iuu_image_room(img, len);
+      if (data) {
+         memcpy(data, text, len);
+         status = iuu_image_add(img, base, len);
+      }
+      break;
+   default:
+      status = IUU_INVALID_PARAMETER;
+   }
+
+   if (status == IUU_OPERATION_OK)
+      status = iuu_image_normalize(img);
+   if (status != IUU_OPERATION_OK)
+      iuu_process_error(status, __FILE__, __LINE__);
+   return status;
+}
+
+// Maps the file at path to be read from start to end. An empty file
+// gives a NULL *map.
+iuu_error iuu_image_map(const char *path, void **map, size_t *len)
+{
+   struct stat st;
+   int fd;
+
+   *map = NULL;
+   *len = 0;
+   fd = open(path, O_RDONLY);
+   if (fd < 0 || fstat(fd, &st) < 0) {
+      if (fd >= 0)
+         close(fd);
+      iuu_process_error(IUU_FILE_ERROR, __FILE__, __LINE__);
+      return IUU_FILE_ERROR;
+   }
+   if (!st.st_size) {
+      close(fd);
+      return IUU_OPERATION_OK;
+   }
+
+   *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (*map == MAP_FAILED) {
+      *map = NULL;
+      iuu_process_error(IUU_FILE_ERROR, __FILE__, __LINE__);
+      return IUU_FILE_ERROR;
+   }
+   madvise(*map, st.st_size, MADV_SEQUENTIAL);
+   *len = st.st_size;
+
+   return IUU_OPERATION_OK;
+}
+
+// Undoes iuu_image_map()
+void iuu_image_unmap(void *map, size_t len)
+{
+   if (map)
+      munmap(map, len);
+}
+
+// Same as iuu_image_parse() with the contents of the file at path,
+// which is mapped rather than read
+iuu_error iuu_image_load(struct iuu_image *img, const char *path,
+                         iuu_image_format fmt, u_int32_t base)
+{
+   iuu_error status;
+   size_t len;
+   void *map;
+
+   status = iuu_image_map(path, &map, &len);
+   if (status != IUU_OPERATION_OK)
+      return status;
+
+   status = iuu_image_parse(img, map ? map : "", len, fmt, base);
+   iuu_image_unmap(map, len);
+   return status;
+}
+
+// Hashes n bytes of p a word at a time into h. Good enough to tell
+// images apart, not meant to stand against anyone forging them.
+u_int64_t iuu_hash(u_int64_t h, const void *p, size_t n)
+{
+   const u_int8_t *b = p;
+   u_int64_t w;
+
+   for (; n >= 8; b += 8, n -= 8) {
+      memcpy(&w, b, 8);
+      h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+      h ^= h >> 29;
+   }
+   if (n) {
+      w = 0;
+      memcpy(&w, b, n);
+      h = (h ^ w ^ ((u_int64_t) n << 56)) * 0x9E3779B97F4A7C15ULL;
+   }
+
+   h ^= h >> 33;
+   h *= 0xFF51AFD7ED558CCDULL;
+   h ^= h >> 33;
+   return h;
+}
+
+// Hashes the contents of img, which tells images apart whatever file
+// they came from
+u_int64_t iuu_image_hash(const struct iuu_image *img)
+{
+   u_int64_t h = iuu_hash(img->fill, &img->entry, sizeof(img->entry));
+   int i;
+
+   for (i = 0; i < img->nseg; i++) {
+      h = iuu_hash(h, &img->seg[i].addr, sizeof(img->seg[i].addr));
+      h = iuu_hash(h, img->seg[i].data, img->seg[i].len);
+   }
+   return h;
+}
+
+// Appends a segment to the n out of max of seg, growing it if needed
+static int iuu_image_push(struct iuu_segment **seg, int *n, int *max,
+                          u_int32_t addr, size_t len, u_int8_t * data)
+{
+   if (*n == *max) {
+      struct iuu_segment *more = realloc(*seg, 2 * *max * sizeof(**seg));
+
+      if (!more)
+         return -1;
+      *seg = more;
+      *max *= 2;
+   }
+   (*seg)[*n].addr = addr;
+   (*seg)[*n].len = len;
+   (*seg)[(*n)++].data = data;
+   return 0;
+}
+
+// Splits the segments of img around every run of at least minrun fill
+// bytes, so that what reads as fill anyway (e.g. erased memory padding
+// a raw image) is not programmed. Data is not moved.
+iuu_error iuu_image_sparse(struct iuu_image *img, size_t minrun)
+{
+   struct iuu_segment *seg;
+   int i, n = 0, max = img->nseg ? img->nseg : 1, err = 0;
+   size_t j, k, from;
+
+   if (!minrun)
+      minrun = 1;
+   seg = malloc(max * sizeof(*seg));
+   if (!seg) {
+      iuu_process_error(IUU_OUT_OF_MEMORY, __FILE__, __LINE__);
+      return IUU_OUT_OF_MEMORY;
+   }
+
+   for (i = 0; i < img->nseg && !err; i++) {
+      const struct iuu_segment *s = &img->seg[i];
+
+      for (from = j = 0; j < s->len && !err; j = k) {
+         for (k = j; k < s->len && s->data[k] == img->fill; k++);
+         if (k == j) {
+            k++;
+            continue;
+         }
+         if (k - j < minrun)
+            continue;
+         if (j > from)
+            err = iuu_image_push(&seg, &n, &max, s->addr + from, j - from,
+                                 s->data + from);
+         from = k;
+      }
+      if (from < s->len && !err)
+         err = iuu_image_push(&seg, &n, &max, s->addr + from,
+                              s->len - from, s->data + from);
+   }
+
+   if (err) {
+      free(seg);
+      iuu_process_error(IUU_OUT_OF_MEMORY, __FILE__, __LINE__);
+      return IUU_OUT_OF_MEMORY;
+   }
+
+   free(img->seg);
+   img->seg = seg;
+   img->nseg = n;
+   img->maxseg = max;
+   return IUU_OPERATION_OK;
+}
+
+// Copies the len bytes of img at addr to out, with fill where there is
+// no segment
+void iuu_image_flatten(const struct iuu_image *img, u_int32_t addr,
+                       size_t len, u_int8_t * out)
+{
+   u_int64_t end = (u_int64_t) addr + len;
+   int lo = 0, hi = img->nseg;
+
+   memset(out, img->fill, len);
+
+   // first segment ending after addr
+   while (lo < hi) {
+      int mid = (lo + hi) / 2;
+
+      if ((u_int64_t) img->seg[mid].addr + img->seg[mid].len <= addr)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   for (; lo < img->nseg && img->seg[lo].addr < end; lo++) {
+      const struct iuu_segment *s = &img->seg[lo];
+      u_int64_t from = s->addr > addr ? s->addr : addr;
+      u_int64_t to = (u_int64_t) s->addr + s->len;
+
+      if (to > end)
+         to = end;
+      memcpy(out + (from - addr), s->data + (from - s->addr), to - from);
+   }
+}
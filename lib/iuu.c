@@ -18,91 +18,24 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
 #include <errno.h>
 
 #include <stdio.h>
 #include <usb.h>
 
-#include <iuu.h>
-
-enum iuu_usb_params {
-   IUU_USB_VENDOR_ID = 0x104f,
-   IUU_USB_PRODUCT_ID = 0x0004,
-   IUU_USB_OP_TIMEOUT = 0x0200
-};
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
 
-/* Programmer commands */
-enum iuu_command {
-   IUU_NO_OPERATION = 0x00,
-   IUU_GET_FIRMWARE_VERSION = 0x01,
-   IUU_GET_PRODUCT_NAME = 0x02,
-   IUU_GET_STATE_REGISTER = 0x03,
-   IUU_SET_LED = 0x04,
-   IUU_WAIT_MUS = 0x05,
-   IUU_WAIT_MS = 0x06,
-
-   IUU_GET_LOADER_VERSION = 0x50,
-   IUU_RST_SET = 0x52,
-   IUU_RST_CLEAR = 0x53,
-   IUU_SET_VCC = 0x59,
-
-   IUU_UART_ENABLE = 0x49,
-   IUU_UART_DISABLE = 0x4A,
-   IUU_UART_WRITE_I2C = 0x4C,
-   IUU_UART_ESC = 0x5E,
-   IUU_UART_TRAP = 0x54,
-   IUU_UART_TRAP_BREAK = 0x5B,
-   IUU_UART_RX = 0x56,
-
-   IUU_AVR_ON = 0x21,
-   IUU_AVR_OFF = 0x22,
-   IUU_AVR_1CLK = 0x23,
-   IUU_AVR_RESET = 0x24,
-   IUU_AVR_RESET_PC = 0x25,
-   IUU_AVR_INC_PC = 0x26,
-   IUU_AVR_INCN_PC = 0x27,
-   IUU_AVR_PREAD = 0x29,
-   IUU_AVR_PREADN = 0x2A,
-   IUU_AVR_PWRITE = 0x28,
-   IUU_AVR_DREAD = 0x2C,
-   IUU_AVR_DREADN = 0x2D,
-   IUU_AVR_DWRITE = 0x2B,
-   IUU_AVR_PWRITEN = 0x2E,
-
-   IUU_EEPROM_ON = 0x37,
-   IUU_EEPROM_OFF = 0x38,
-   IUU_EEPROM_WRITE = 0x39,
-   IUU_EEPROM_WRITEX = 0x3A,
-   IUU_EEPROM_WRITE8 = 0x3B,
-   IUU_EEPROM_WRITE16 = 0x3C,
-   IUU_EEPROM_WRITEX32 = 0x3D,
-   IUU_EEPROM_WRITEX64 = 0x3E,
-   IUU_EEPROM_READ = 0x3F,
-   IUU_EEPROM_READX = 0x40,
-   IUU_EEPROM_BREAD = 0x41,
-   IUU_EEPROM_BREADX = 0x42,
-
-   IUU_PIC_CMD = 0x0A,
-   IUU_PIC_CMD_LOAD = 0x0B,
-   IUU_PIC_CMD_READ = 0x0C,
-   IUU_PIC_ON = 0x0D,
-   IUU_PIC_OFF = 0x0E,
-   IUU_PIC_RESET = 0x16,
-   IUU_PIC_INC_PC = 0x0F,
-   IUU_PIC_INCN_PC = 0x10,
-   IUU_PIC_PWRITE = 0x11,
-   IUU_PIC_PREAD = 0x12,
-   IUU_PIC_PREADN = 0x13,
-   IUU_PIC_DWRITE = 0x14,
-   IUU_PIC_DREAD = 0x15
-};
+#include <iuu.h>
+#include "iuu_priv.h"
 
-enum iuu_extra_command {
-   IUU_UART_NOP = 0x00,
-   IUU_UART_CHANGE = 0x02,
-   IUU_UART_TX = 0x04,
-   IUU_DELAY_MS = 0x06
-};
+// Phoenix byte as it has to go through the wire for the card convention
+#define IUU_UART_BYTE(inf, b) \
+   ((inf)->conv == IUU_CONVENTION_INVERSE ? inverse2direct[(b)] : (b))
 
 /* 
  Table for Inverse to Direct Convention conversion
@@ -143,8 +76,112 @@ static const u_int8_t inverse2direct[0x100] = {
    0xe0, 0x60, 0xa0, 0x20, 0xc0, 0x40, 0x80, 0x0
 };
 
+#if defined(__SSSE3__)
+/*
+ The same conversion split in nibbles for the pshufb kernels: the
+ complemented and bit reversed low nibble becomes the high nibble and
+ vice versa
+*/
+static const u_int8_t inverse_lo[16] = {
+   0xf0, 0x70, 0xb0, 0x30, 0xd0, 0x50, 0x90, 0x10,
+   0xe0, 0x60, 0xa0, 0x20, 0xc0, 0x40, 0x80, 0x00
+};
+
+static const u_int8_t inverse_hi[16] = {
+   0x0f, 0x07, 0x0b, 0x03, 0x0d, 0x05, 0x09, 0x01,
+   0x0e, 0x06, 0x0a, 0x02, 0x0c, 0x04, 0x08, 0x00
+};
+#endif
+
+/*
+ Clock generator register file as a sequence of I2C writes for
+ CLK = 12MHz * P / (Q * DIV). P = 2 * (PB + 4) + PO and the charge
+ pump is always 4. Every register takes 4 bytes and they go in
+ this order: 0x09, 0x0C, 0x12, 0x13, 0x40, 0x41, 0x42, 0x44 ... 0x47
+*/
+#define IUU_CLK_PO(P) ((P) & 0x01)
+#define IUU_CLK_PB(P) ((((P) - IUU_CLK_PO(P)) / 2) - 4)
+#define IUU_CLK_I2C(reg, val) \
+   IUU_UART_WRITE_I2C, IUU_CLK_I2C_ADDR << 1, (reg), (u_int8_t) (val)
+#define IUU_CLK_REGS(P, Q, DIV, XDRV) {                               \
+   IUU_CLK_I2C(0x09, 0x20),                                            \
+   IUU_CLK_I2C(0x0C, (DIV)),                                           \
+   IUU_CLK_I2C(0x12, (XDRV)),                                          \
+   IUU_CLK_I2C(0x13, 0x6B),                                            \
+   IUU_CLK_I2C(0x40, 0xC0 | (0x04 << 2) | ((IUU_CLK_PB(P) >> 8) & 0x03)), \
+   IUU_CLK_I2C(0x41, IUU_CLK_PB(P) & 0xFF),                            \
+   IUU_CLK_I2C(0x42, (((Q) - 2) & 0x7F) | (IUU_CLK_PO(P) << 7)),       \
+   IUU_CLK_I2C(0x44, 0xFF),                                            \
+   IUU_CLK_I2C(0x45, 0xFE),                                            \
+   IUU_CLK_I2C(0x46, 0x7F),                                            \
+   IUU_CLK_I2C(0x47, 0x84) }
+
+#define IUU_CLK_REGS_LEN (IUU_CLK_NREGS * 4)
+
+struct iuu_clk_preset {
+   u_int32_t freq;
+   u_int16_t P;
+   u_int8_t Q;
+   u_int8_t DIV;
+   u_int8_t XDRV;
+   u_int8_t cmd[IUU_CLK_REGS_LEN];
+};
+
+#define IUU_CLK_PRESET(f, P, Q, DIV, XDRV) \
+   { f, P, Q, DIV, XDRV, IUU_CLK_REGS(P, Q, DIV, XDRV) }
+
+/*
+ Ready made I2C sequences for the usual smart card clocks, sorted by
+ frequency. All of them are exact but 3579545, the NTSC 315/88MHz,
+ which comes out at 3579545.45Hz.
+*/
+static const struct iuu_clk_preset clk_presets[] = {
+   IUU_CLK_PRESET(1000000, 17, 2, 102, 0x00),
+   IUU_CLK_PRESET(1500000, 17, 2, 68, 0x00),
+   IUU_CLK_PRESET(1843200, 96, 5, 125, 0x00),
+   IUU_CLK_PRESET(2000000, 17, 2, 51, 0x00),
+   IUU_CLK_PRESET(2457600, 128, 5, 125, 0x00),
+   IUU_CLK_PRESET(2500000, 20, 2, 48, 0x00),
+   IUU_CLK_PRESET(3000000, 17, 2, 34, 0x00),
+   IUU_CLK_PRESET(3579000, 1193, 40, 100, 0x00),
+   IUU_CLK_PRESET(3579545, 105, 4, 88, 0x00),
+   IUU_CLK_PRESET(3680000, 161, 5, 105, 0x00),
+   IUU_CLK_PRESET(3686400, 384, 25, 50, 0x00),
+   IUU_CLK_PRESET(4000000, 18, 2, 27, 0x00),
+   IUU_CLK_PRESET(4500000, 18, 2, 24, 0x00),
+   IUU_CLK_PRESET(4915200, 256, 25, 25, 0x00),
+   IUU_CLK_PRESET(5000000, 20, 2, 24, 0x00),
+   IUU_CLK_PRESET(5500000, 22, 2, 24, 0x00),
+   IUU_CLK_PRESET(6000000, 66, 2, 66, 0x28),
+   IUU_CLK_PRESET(6144000, 64, 5, 25, 0x00),
+   IUU_CLK_PRESET(7000000, 21, 2, 18, 0x00),
+   IUU_CLK_PRESET(7160000, 179, 6, 50, 0x00),
+   IUU_CLK_PRESET(7372800, 384, 25, 25, 0x00),
+   IUU_CLK_PRESET(7500000, 20, 2, 16, 0x00),
+   IUU_CLK_PRESET(8000000, 20, 2, 15, 0x00),
+   IUU_CLK_PRESET(9000000, 18, 2, 12, 0x00),
+   IUU_CLK_PRESET(9830400, 512, 25, 25, 0x00),
+   IUU_CLK_PRESET(10000000, 20, 2, 12, 0x00),
+   IUU_CLK_PRESET(11059200, 576, 25, 25, 0x00),
+   IUU_CLK_PRESET(12000000, 18, 2, 9, 0x00),
+   IUU_CLK_PRESET(13560000, 113, 4, 25, 0x00),
+   IUU_CLK_PRESET(15000000, 20, 2, 8, 0x00),
+   IUU_CLK_PRESET(16000000, 24, 2, 9, 0x00),
+   IUU_CLK_PRESET(18000000, 18, 2, 6, 0x00),
+   IUU_CLK_PRESET(20000000, 20, 2, 6, 0x00)
+};
+
+#define IUU_CLK_NPRESETS (sizeof(clk_presets) / sizeof(clk_presets[0]))
+
 // Taken from nftytool */
 struct usb_device *iuu_get_device(int device);
+static const struct iuu_clk_preset *iuu_clk_lookup(int freq);
+static iuu_error iuu_clk_write(iuu * inf, const u_int8_t * cmd);
+static u_int32_t iuu_uart_timer(u_int32_t baud, u_int8_t * T1Frekvens,
+                                u_int8_t * T1reload);
+static iuu_error iuu_uart_timer_set(iuu * inf, u_int8_t T1Frekvens,
+                                    u_int8_t T1reload,
+                                    iuu_uart_parity parity);
 struct usb_endpoint_descriptor *iuu_get_ep_desc(iuu * inf,
                                                 u_int8_t direction);
 
@@ -194,6 +231,9 @@ iuu_error iuu_start(iuu * inf, int devnum)
 
    inf->ep_out = iuu_get_ep_desc(inf, USB_ENDPOINT_OUT);
    inf->ep_in = iuu_get_ep_desc(inf, USB_ENDPOINT_IN);
+   inf->conv = IUU_CONVENTION_DIRECT;
+   inf->clk_valid = 0;
+   inf->eeprom = NULL;
 
    return IUU_OPERATION_OK;
 }
@@ -264,7 +304,7 @@ iuu_error iuu_cts(iuu * inf)
 // Reads/gets a stream of data from the IUU through the USB bus
 iuu_error iuu_read(iuu * inf, u_int8_t * buf, int len)
 {
-   iuu_error status;
+   int status;
    status = usb_bulk_read(inf->handle, inf->ep_in->bEndpointAddress,
                           (char *)buf, len, IUU_USB_OP_TIMEOUT);
 
@@ -279,7 +319,7 @@ iuu_error iuu_read(iuu * inf, u_int8_t * buf, int len)
 // Writes/sends a stream of data from the IUU through the USB bus
 iuu_error iuu_write(iuu * inf, u_int8_t * buf, int len)
 {
-   iuu_error status;
+   int status;
    status = usb_bulk_write(inf->handle, inf->ep_out->bEndpointAddress,
                            (char *)buf, len, IUU_USB_OP_TIMEOUT);
 
@@ -291,6 +331,43 @@ iuu_error iuu_write(iuu * inf, u_int8_t * buf, int len)
    return IUU_OPERATION_OK;
 }
 
+// Reads exactly len bytes from the IUU, even if the USB stack hands
+// them over in several pieces
+iuu_error iuu_read_all(iuu * inf, u_int8_t * buf, int len)
+{
+   int status, done = 0;
+
+   while (done < len) {
+      status = usb_bulk_read(inf->handle, inf->ep_in->bEndpointAddress,
+                             (char *)buf + done, len - done,
+                             IUU_USB_OP_TIMEOUT);
+      if (status <= 0) {
+         iuu_process_error(status, __FILE__, __LINE__);
+         return IUU_READ_ERROR;
+      }
+      done += status;
+   }
+
+   return IUU_OPERATION_OK;
+}
+
+// Throws away whatever answers the IUU still holds, e.g. to commands
+// sent before a transfer failed, so they are not taken for the answers
+// to the next ones
+iuu_error iuu_drain(iuu * inf)
+{
+   u_int8_t buf[IUU_USB_MAX_READ];
+   int status;
+
+   do
+      status = usb_bulk_read(inf->handle, inf->ep_in->bEndpointAddress,
+                             (char *)buf, sizeof(buf),
+                             IUU_USB_DRAIN_TIMEOUT);
+   while (status > 0);
+
+   return IUU_OPERATION_OK;
+}
+
 // Sends a NOP command to the IUU. Doesn't do anything but helps to
 // check that messages go through the USB. Use iuu_status() to check
 // the opposite direction
@@ -456,169 +533,239 @@ iuu_error iuu_vcc(iuu * inf, enum iuu_vcc_t vcc)
 // Lots of thanks to WBE for provinding the code to do it
 iuu_error iuu_clk(iuu * inf, int dwFrq)
 {
-   /*
-      if (!CheckSDKInput (hDevice))
-      return SDK_INVALID_HANDLE;
-
-      DWORD dwDevice = ConvertHandleToIndex (hDevice);
-
-      if ((dwFrq < 760000 || dwFrq > 25000000) && dwFrq != 0)
-      return SDK_INVALID_PARAMETER;
-
-      SDK_STATUS sdk_status = SDK_SUCCESS;
-      DWORD dwWritten;
-    */
    int status;
-   char WriteBuffer[255];
+   u_int8_t WriteBuffer[4];
    int Count = 0;
-   unsigned char FrqGenAdr = 0x69;
-   unsigned char DIV = 0;       /* 8bit */
-   unsigned char XDRV = 0;      /* 8bit */
-   /* //0b'110xxxxx' = 0x0C //3 */
-   unsigned char PUMP = 0;      /* 3bit */
-   unsigned char PBmsb = 0;     /* 2bit */
-   unsigned char PBlsb = 0;     /* 8bit */
-   unsigned char PO = 0;        /* 1bit */
-   unsigned char Q = 0;         /* 7bit */
-   /* 24bit = 3bytes */
-   unsigned int P = 0;
-   unsigned int P2 = 0;
+   struct iuu_clk_setting set;
+   const struct iuu_clk_preset *preset;
    int frq = (int)dwFrq;
 
    if (frq == 0) {
       WriteBuffer[Count++] = IUU_UART_WRITE_I2C;        /* //0x4C */
-      WriteBuffer[Count++] = FrqGenAdr << 1;
+      WriteBuffer[Count++] = IUU_CLK_I2C_ADDR << 1;
       WriteBuffer[Count++] = 0x09;
       WriteBuffer[Count++] = 0x00;      /* //Adr = 0x09 */
-      /*
-         EnterCriticalSection (&instances[dwDevice]->IOCriticalSection);
-         sdk_status = INFUNLTD_Write (hDevice, WriteBuffer, Count, &dwWritten);
-         LeaveCriticalSection (&instances[dwDevice]->IOCriticalSection);
-         return sdk_status;
-       */
-      status = iuu_write(inf, (u_int8_t *) WriteBuffer, Count);
-      if (status != 0) {
+
+      status = iuu_write(inf, WriteBuffer, Count);
+      if (status != IUU_OPERATION_OK) {
          iuu_process_error(status, __FILE__, __LINE__);
+         inf->clk_valid = 0;
          return status;
       }
-   } else if (frq == 3579000) {
-      DIV = 100;
-      P = 1193;
-      Q = 40;
-      XDRV = 0;
-   } else if (frq == 3680000) {
-      DIV = 105;
-      P = 161;
-      Q = 5;
-      XDRV = 0;
-   } else if (frq == 6000000) {
-      DIV = 66;
-      P = 66;
-      Q = 2;
-      XDRV = 0x28;
-   } else {
-      unsigned int result = 0;
-      unsigned int tmp = 0;
-      unsigned int check;
-      unsigned int check2;
-      char found = 0x00;
-
-      unsigned int lQ = 2;
-      unsigned int lP = 2055;
-      unsigned int lDiv = 4;
-      /*for (unsigned int lQ = 2; lQ <= 47 && !found; lQ++)
-         for (unsigned int lP = 2055; lP >= 8 && !found; lP--)
-         for (unsigned int lDiv = 4; lDiv <= 127 && !found; lDiv++) */
-      for (lQ = 2; lQ <= 47 && !found; lQ++)
-         for (lP = 2055; lP >= 8 && !found; lP--)
-            for (lDiv = 4; lDiv <= 127 && !found; lDiv++) {
-               /* tmp = ((12000000*lP)/(lQ*lDiv)); */
-               tmp = (12000000 / lDiv) * (lP / lQ);
-               if (abs((int)(tmp - frq)) < abs((int)(frq - result))) {
-                  check2 = (12000000 / lQ);
-                  if (check2 < 250000)
-                     continue;
-                  check = (12000000 / lQ) * lP;
-                  if (check > 400000000)
-                     continue;
-                  if (check < 100000000)
-                     continue;
-                  if (lDiv < 4 || lDiv > 127)
-                     continue;
-                  result = tmp;
-                  P = lP;
-                  DIV = lDiv;
-                  Q = lQ;
-                  if (result == frq)
-                     found = 0x01;      /* true */
-               }
+      inf->clk_regs[0] = 0x00;
+      return status;
+   }
+
+   // The usual clocks need no computing at all
+   preset = iuu_clk_lookup(frq);
+   if (preset)
+      return iuu_clk_write(inf, preset->cmd);
+
+   status = iuu_clk_solve(frq, &set);
+   if (status != IUU_OPERATION_OK) {
+      iuu_process_error(status, __FILE__, __LINE__);
+      return status;
+   }
+
+   return iuu_clk_set(inf, &set);
+}
+
+// Returns the ready made register set for freq, if any
+static const struct iuu_clk_preset *iuu_clk_lookup(int freq)
+{
+   int lo = 0, hi = IUU_CLK_NPRESETS - 1, mid;
+
+   while (lo <= hi) {
+      mid = (lo + hi) / 2;
+      if (clk_presets[mid].freq == (u_int32_t) freq)
+         return &clk_presets[mid];
+      if (clk_presets[mid].freq < (u_int32_t) freq)
+         lo = mid + 1;
+      else
+         hi = mid - 1;
+   }
+   return NULL;
+}
+
+// Finds the clock generator settings that get the closest to freq
+// Hz. The generator gives 12MHz * P / (Q * DIV), so instead of trying
+// every P we try every Q and DIV pair whose VCO (12MHz * P / Q, which
+// must stay within 100MHz and 400MHz) can yield freq and take the P
+// nearest to the ideal one. All arithmetic is exact. The frequency
+// actually achieved and its error are returned in set.
+iuu_error iuu_clk_solve(int freq, struct iuu_clk_setting *set)
+{
+   u_int64_t f = (u_int64_t) freq;
+   u_int64_t best_num = 0, best_den = 0;
+   u_int64_t ref, vco_min, vco_max;
+   unsigned int lQ, lDiv, divmin, divmax;
+   unsigned int lP, P, pmin, pmax, i;
+
+   if (freq < IUU_CLK_MIN || freq > IUU_CLK_MAX)
+      return IUU_INVALID_PARAMETER;
+
+   ref = IUU_CLK_REF;
+   vco_min = 100000000;
+   vco_max = 400000000;
+
+   // VCO = freq * DIV, although at the ends of the range we can only
+   // get as close as possible
+   divmin = (vco_min + f - 1) / f;
+   divmax = vco_max / f;
+   if (divmin < 4)
+      divmin = 4;
+   if (divmax > 127)
+      divmax = 127;
+   if (divmin > divmax)
+      divmin = divmax = (divmin > 127) ? 127 : 4;
+
+   // The phase detector needs at least 250kHz, i.e. Q <= 48
+   for (lQ = 2; lQ <= 47; lQ++) {
+      // P range keeping the VCO within its limits
+      pmin = (vco_min * lQ + ref - 1) / ref;
+      pmax = (vco_max * lQ) / ref;
+      if (pmin < 8)
+         pmin = 8;
+      if (pmax > 2055)
+         pmax = 2055;
+      if (pmin > pmax)
+         continue;
+
+      for (lDiv = divmin; lDiv <= divmax; lDiv++) {
+         u_int64_t den = (u_int64_t) lQ * lDiv;
+
+         // The P giving freq would be freq * Q * DIV / 12MHz, so check
+         // both integers around it
+         P = (unsigned int)((f * den) / ref);
+         for (i = 0; i < 2; i++) {
+            u_int64_t num, out;
+
+            lP = P + i;
+            if (lP < pmin)
+               lP = pmin;
+            if (lP > pmax)
+               lP = pmax;
+
+            // |12MHz * P / (Q * DIV) - freq| == num / den
+            out = ref * lP;
+            num = out > f * den ? out - f * den : f * den - out;
+            if (best_den == 0 || num * best_den < best_num * den) {
+               best_num = num;
+               best_den = den;
+               set->P = lP;
+               set->Q = lQ;
+               set->DIV = lDiv;
             }
+         }
+         if (best_den != 0 && best_num == 0)
+            goto found;
+      }
+   }
+
+   if (best_den == 0)
+      return IUU_INVALID_PARAMETER;
+
+ found:
+   set->XDRV = 0;
+   set->freq = (u_int32_t) ((ref * set->P + (set->Q * set->DIV) / 2) /
+                            (set->Q * set->DIV));
+   set->error = (int)set->freq - freq;
+
+   return IUU_OPERATION_OK;
+}
+
+// Programs the clock generator with the settings in set, as returned
+// by iuu_clk_solve(), and enables its output
+iuu_error iuu_clk_set(iuu * inf, const struct iuu_clk_setting *set)
+{
+   int status;
+
+   if (set->P < 8 || set->P > 2055 || set->Q < 2 || set->Q > 129 ||
+       set->DIV < 4 || set->DIV > 127) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+
+   u_int8_t WriteBuffer[IUU_CLK_REGS_LEN] =
+       IUU_CLK_REGS(set->P, set->Q, set->DIV, set->XDRV);
+
+   status = iuu_clk_write(inf, WriteBuffer);
+   if (status != IUU_OPERATION_OK)
+      iuu_process_error(status, __FILE__, __LINE__);
+
+   return status;
+}
+
+// Adds to s the writes of every clock generator register for the
+// settings in set, so the clock can change in the middle of a stream.
+// The device's copy of the registers can not be kept up to date this
+// way, so call iuu_clk_invalidate() once the stream has been sent.
+iuu_error iuu_clk_encode(struct iuu_stream *s,
+                         const struct iuu_clk_setting *set)
+{
+   iuu_error status;
+
+   if (set->P < 8 || set->P > 2055 || set->Q < 2 || set->Q > 129 ||
+       set->DIV < 4 || set->DIV > 127) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
    }
-   P2 = ((P - PO) / 2) - 4;
-   DIV = DIV;
-   PUMP = 0x04;
-   PBmsb = (P2 >> 8 & 0x03);
-   PBlsb = P2 & 0xFF;
-   PO = (P >> 10) & 0x01;
-   Q = Q - 2;
-
-   WriteBuffer[Count++] = IUU_UART_WRITE_I2C;   /* 0x4C */
-   WriteBuffer[Count++] = FrqGenAdr << 1;
-   WriteBuffer[Count++] = 0x09;
-   WriteBuffer[Count++] = 0x20; /* Adr = 0x09 */
-   WriteBuffer[Count++] = IUU_UART_WRITE_I2C;   /* 0x4C */
-   WriteBuffer[Count++] = FrqGenAdr << 1;
-   WriteBuffer[Count++] = 0x0C;
-   WriteBuffer[Count++] = DIV;  /* Adr = 0x0C */
-   WriteBuffer[Count++] = IUU_UART_WRITE_I2C;   /* 0x4C */
-   WriteBuffer[Count++] = FrqGenAdr << 1;
-   WriteBuffer[Count++] = 0x12;
-   WriteBuffer[Count++] = XDRV; /* Adr = 0x12 */
-   WriteBuffer[Count++] = IUU_UART_WRITE_I2C;   /*  0x4C */
-   WriteBuffer[Count++] = FrqGenAdr << 1;
-   WriteBuffer[Count++] = 0x13;
-   WriteBuffer[Count++] = 0x6B; /* Adr = 0x13 */
-   WriteBuffer[Count++] = IUU_UART_WRITE_I2C;   /*  0x4C */
-   WriteBuffer[Count++] = FrqGenAdr << 1;
-   WriteBuffer[Count++] = 0x40;
-   WriteBuffer[Count++] = (0xC0 | ((PUMP & 0x07) << 2)) | (PBmsb & 0x03);       /* Adr = 0x40 */
-   WriteBuffer[Count++] = IUU_UART_WRITE_I2C;   /*  0x4C */
-   WriteBuffer[Count++] = FrqGenAdr << 1;
-   WriteBuffer[Count++] = 0x41;
-   WriteBuffer[Count++] = PBlsb;        /* Adr = 0x41 */
-   WriteBuffer[Count++] = IUU_UART_WRITE_I2C;   /*  0x4C */
-   WriteBuffer[Count++] = FrqGenAdr << 1;
-   WriteBuffer[Count++] = 0x42;
-   WriteBuffer[Count++] = Q | (((PO & 0x01) << 7));     /* Adr = 0x42 */
-   WriteBuffer[Count++] = IUU_UART_WRITE_I2C;   /*  0x4C */
-   WriteBuffer[Count++] = FrqGenAdr << 1;
-   WriteBuffer[Count++] = 0x44;
-   WriteBuffer[Count++] = (char)0xFF;   /* Adr = 0x44 */
-   WriteBuffer[Count++] = IUU_UART_WRITE_I2C;   /*  0x4C */
-   WriteBuffer[Count++] = FrqGenAdr << 1;
-   WriteBuffer[Count++] = 0x45;
-   WriteBuffer[Count++] = (char)0xFE;   /* Adr = 0x45 */
-   WriteBuffer[Count++] = IUU_UART_WRITE_I2C;   /*  0x4C */
-   WriteBuffer[Count++] = FrqGenAdr << 1;
-   WriteBuffer[Count++] = 0x46;
-   WriteBuffer[Count++] = 0x7F; /* Adr = 0x46 */
-   WriteBuffer[Count++] = IUU_UART_WRITE_I2C;   /*  0x4C */
-   WriteBuffer[Count++] = FrqGenAdr << 1;
-   WriteBuffer[Count++] = 0x47;
-   WriteBuffer[Count++] = (char)0x84;   /* Adr = 0x47 */
-   /*
-      EnterCriticalSection (&instances[dwDevice]->IOCriticalSection);
-      sdk_status = INFUNLTD_Write (hDevice, WriteBuffer, Count, &dwWritten);
-      LeaveCriticalSection (&instances[dwDevice]->IOCriticalSection);
-    */
-
-   status = iuu_write(inf, (u_int8_t *) WriteBuffer, Count);
+
+   u_int8_t cmd[IUU_CLK_REGS_LEN] =
+       IUU_CLK_REGS(set->P, set->Q, set->DIV, set->XDRV);
+
+   status = iuu_stream_add(s, cmd, IUU_CLK_REGS_LEN);
    if (status != IUU_OPERATION_OK)
       iuu_process_error(status, __FILE__, __LINE__);
 
    return status;
 }
 
+// Forgets what the clock generator registers hold, so the next
+// iuu_clk() writes all of them again. Call it if the generator might
+// have been touched behind the library's back (e.g. an IUU_UART_WRITE_I2C
+// sent with iuu_write()) or lost its settings.
+void iuu_clk_invalidate(iuu * inf)
+{
+   inf->clk_valid = 0;
+}
+
+// Sends a full register sequence built with IUU_CLK_REGS() to the
+// clock generator, skipping the registers that already hold the right
+// value. Registers still go in the same order as a full write.
+static iuu_error iuu_clk_write(iuu * inf, const u_int8_t * cmd)
+{
+   iuu_error status;
+   u_int8_t buf[IUU_CLK_REGS_LEN];
+   int i, len = 0;
+
+   if (!inf->clk_valid) {
+      memcpy(buf, cmd, IUU_CLK_REGS_LEN);
+      len = IUU_CLK_REGS_LEN;
+   } else {
+      for (i = 0; i < IUU_CLK_NREGS; i++)
+         if (inf->clk_regs[i] != cmd[4 * i + 3]) {
+            memcpy(&buf[len], &cmd[4 * i], 4);
+            len += 4;
+         }
+      if (len == 0)
+         return IUU_OPERATION_OK;
+   }
+
+   status = iuu_write(inf, buf, len);
+   if (status != IUU_OPERATION_OK) {
+      iuu_process_error(status, __FILE__, __LINE__);
+      inf->clk_valid = 0;
+      return status;
+   }
+
+   for (i = 0; i < IUU_CLK_NREGS; i++)
+      inf->clk_regs[i] = cmd[4 * i + 3];
+   inf->clk_valid = 1;
+
+   return IUU_OPERATION_OK;
+}
+
 // Sets the RST signal for a total of wt milliseconds 
 //
 // According to ISO7816, for asynchronous transmissions, the ATR
@@ -717,61 +864,72 @@ iuu_error iuu_uart_set(iuu * inf, iuu_uart_baudrate br,
 iuu_error iuu_uart_baud(iuu * inf, u_int32_t baud, u_int32_t * actual,
                         iuu_uart_parity parity)
 {
-
-   //SDK_STATUS sdk_status = SDK_SUCCESS;
-   //unsigned char dataout[10];
-   //DWORD dwWritten = 0;
-   //unsigned int DataCount = 0;
-
-   iuu_error status;
-   u_int8_t dataout[5];
-   u_int8_t DataCount = 0;
+   u_int8_t T1Frekvens, T1reload;
 
    if (baud < 1200 || baud > 230400)
       return IUU_INVALID_PARAMETER;
 
-   unsigned char T1Frekvens = 0;
-   unsigned char T1reload = 0;
-   unsigned int T1FrekvensHZ = 0;
+   *actual = iuu_uart_timer(baud, &T1Frekvens, &T1reload);
 
-   if (baud > 977) {
-      T1Frekvens = 3;
-      T1FrekvensHZ = 500000;
-   }
+   return iuu_uart_timer_set(inf, T1Frekvens, T1reload, parity);
+}
 
-   if (baud > 3906) {
-      T1Frekvens = 2;
-      T1FrekvensHZ = 2000000;
-   }
+// UART timer 1 clock sources, indexed by T1Frekvens
+static const u_int32_t uart_t1_hz[4] = {
+   24000000, 6000000, 2000000, 500000
+};
 
-   if (baud > 11718) {
-      T1Frekvens = 1;
-      T1FrekvensHZ = 6000000;
+// Picks the timer 1 source and reload value which get the closest to
+// baud and returns the baud rate they actually give, which is
+// T1FrekvensHZ / (2 * (256 - T1reload))
+static u_int32_t iuu_uart_timer(u_int32_t baud, u_int8_t * T1Frekvens,
+                                u_int8_t * T1reload)
+{
+   u_int64_t best_num = 0, best_den = 0;
+   u_int32_t hz;
+   u_int32_t div;
+   int src;
+
+   for (src = 0; src < 4; src++) {
+      u_int64_t num, den;
+
+      hz = uart_t1_hz[src];
+      div = (hz + baud) / (2 * baud);   // rounded hz / (2 * baud)
+      if (div < 1)
+         div = 1;
+      if (div > 256)
+         div = 256;
+
+      // |hz / (2 * div) - baud| == num / den
+      den = 2 * (u_int64_t) div;
+      num = hz > den * baud ? hz - den * baud : den * baud - hz;
+      if (best_den == 0 || num * best_den < best_num * den) {
+         best_num = num;
+         best_den = den;
+         *T1Frekvens = src;
+         *T1reload = (u_int8_t) (256 - div);
+      }
    }
 
-   if (baud > 46875) {
-      T1Frekvens = 0;
-      T1FrekvensHZ = 24000000;
-   }
+   div = 256 - *T1reload;
+   hz = uart_t1_hz[*T1Frekvens];
+   return (hz + div) / (2 * div);
+}
 
-   T1reload =
-       256 -
-       (unsigned
-        char)(((float)
-               ((float)T1FrekvensHZ /
-                (float)((float)2.0 * (float)baud))));
+// Sends the UART timer settings and the character format
+static iuu_error iuu_uart_timer_set(iuu * inf, u_int8_t T1Frekvens,
+                                    u_int8_t T1reload,
+                                    iuu_uart_parity parity)
+{
+   iuu_error status;
+   u_int8_t dataout[5];
+   u_int8_t DataCount = 0;
 
    dataout[DataCount++] = IUU_UART_ESC; // magic number here:  ENTER_FIRMWARE_UPDATE;
    dataout[DataCount++] = IUU_UART_CHANGE;      // magic number here:  CHANGE_BAUD; 
    dataout[DataCount++] = T1Frekvens;
    dataout[DataCount++] = T1reload;
 
-   /* *actual = (unsigned int)(((float)T1FrekvensHZ / (float)((float)256 - (float)T1reload)) / (float)2.0); */
-   *actual =
-       (u_int32_t) (((float)T1FrekvensHZ /
-                     (float)((float)256 -
-                             (float)T1reload)) / (float)2.0);
-
    switch (parity & 0x0F) {
    case IUU_PARITY_NONE:
       dataout[DataCount++] = 0x00;
@@ -806,10 +964,144 @@ iuu_error iuu_uart_baud(iuu * inf, u_int32_t baud, u_int32_t * actual,
       break;
    }
 
-   //sdk_status = INFUNLTD_Write(hDevice,dataout,DataCount,&dwWritten);
    status = iuu_write(inf, dataout, DataCount);
-   //if(dwWritten != DataCount) 
-   //return SDK_INVALID_HANDLE;
+   if (status != IUU_OPERATION_OK)
+      iuu_process_error(status, __FILE__, __LINE__);
+
+   return status;
+}
+
+/*
+ ISO7816-3 clock rate conversion factor F and maximum clock frequency
+ (kHz) indexed by FI, and baud rate adjustment factor D indexed by DI.
+ Zero means RFU.
+*/
+static const u_int16_t iso_fi[16] = {
+   372, 372, 558, 744, 1116, 1488, 1860, 0,
+   0, 512, 768, 1024, 1536, 2048, 0, 0
+};
+
+static const u_int16_t iso_fmax[16] = {
+   4000, 5000, 6000, 8000, 12000, 16000, 20000, 0,
+   0, 5000, 7500, 10000, 15000, 20000, 0, 0
+};
+
+static const u_int8_t iso_di[16] = {
+   0, 1, 2, 4, 8, 16, 32, 64,
+   12, 20, 0, 0, 0, 0, 0, 0
+};
+
+// A UART baud rate, T1FrekvensHZ / (2 * div)
+struct iuu_uart_rate {
+   u_int32_t hz;
+   u_int16_t div;
+   u_int8_t src;
+};
+
+static int iuu_uart_rate_cmp(const void *a, const void *b)
+{
+   const struct iuu_uart_rate *x = a, *y = b;
+   u_int64_t l = (u_int64_t) x->hz * y->div;
+   u_int64_t r = (u_int64_t) y->hz * x->div;
+
+   // highest rate first
+   return l < r ? 1 : (l > r ? -1 : 0);
+}
+
+// Finds the card clock and UART settings giving the fastest
+// communication with a card whose TA1 (FI in the high nibble and DI in
+// the low one) is ta1. The card clock is kept under both the maximum
+// allowed by FI and fmax (in Hz, 0 for no limit of our own) and the
+// card baud rate, clock * D / F, within IUU_LINK_TOLERANCE per mille of
+// the UART one. Use ta1 = 0x11 for a card running with default values.
+// Everything is done with integers, the result is left in link and
+// can be applied with iuu_link_set().
+iuu_error iuu_link_optimize(u_int8_t ta1, u_int32_t fmax,
+                            struct iuu_link *link)
+{
+   struct iuu_uart_rate rates[4 * 256];
+   u_int32_t F = iso_fi[ta1 >> 4];
+   u_int32_t D = iso_di[ta1 & 0x0F];
+   u_int32_t limit = 1000 * iso_fmax[ta1 >> 4];
+   int n = 0, i, src, div;
+
+   if (F == 0 || D == 0)
+      return IUU_INVALID_PARAMETER;
+
+   if (fmax != 0 && fmax < limit)
+      limit = fmax;
+   if (limit > IUU_CLK_MAX)
+      limit = IUU_CLK_MAX;
+
+   // Every rate the phoenix UART can do
+   for (src = 0; src < 4; src++)
+      for (div = 1; div <= 256; div++) {
+         u_int32_t hz = uart_t1_hz[src];
+
+         if (hz > 2 * 230400 * (u_int32_t) div)
+            continue;
+         if (hz < 2 * 1200 * (u_int32_t) div)
+            break;
+         rates[n].hz = hz;
+         rates[n].div = div;
+         rates[n].src = src;
+         n++;
+      }
+   qsort(rates, n, sizeof(rates[0]), iuu_uart_rate_cmp);
+
+   for (i = 0; i < n; i++) {
+      u_int64_t uart_den = 2 * (u_int64_t) rates[i].div;
+      u_int64_t want, card, uart, diff;
+      struct iuu_clk_setting clk;
+
+      // Card clock needed for this rate, hz * F / (2 * div * D)
+      want = ((u_int64_t) rates[i].hz * F + uart_den * D / 2) /
+          (uart_den * D);
+      if (want > limit)
+         continue;
+      if (want < IUU_CLK_MIN)
+         break;
+
+      if (iuu_clk_solve((int)want, &clk) != IUU_OPERATION_OK)
+         continue;
+      if (clk.freq > limit)
+         continue;
+
+      // Both rates scaled by 2 * div * F
+      card = (u_int64_t) clk.freq * D * uart_den;
+      uart = (u_int64_t) rates[i].hz * F;
+      diff = card > uart ? card - uart : uart - card;
+      if (diff * 1000 > IUU_LINK_TOLERANCE * card)
+         continue;
+
+      link->clk = clk;
+      link->F = F;
+      link->D = D;
+      link->t1src = rates[i].src;
+      link->t1reload = (u_int8_t) (256 - rates[i].div);
+      link->baud = (rates[i].hz + rates[i].div) / uart_den;
+      link->card_baud = (u_int32_t) (((u_int64_t) clk.freq * D + F / 2) / F);
+      return IUU_OPERATION_OK;
+   }
+
+   return IUU_INVALID_PARAMETER;
+}
+
+// Applies the settings found by iuu_link_optimize(): the card clock
+// and the phoenix UART timer, with the parity and stop bits given as
+// in iuu_uart_baud()
+iuu_error iuu_link_set(iuu * inf, const struct iuu_link *link,
+                       iuu_uart_parity parity)
+{
+   iuu_error status;
+
+   status = iuu_clk_set(inf, &link->clk);
+   if (status != IUU_OPERATION_OK) {
+      iuu_process_error(status, __FILE__, __LINE__);
+      return status;
+   }
+
+   status = iuu_uart_timer_set(inf, link->t1src, link->t1reload, parity);
    if (status != IUU_OPERATION_OK)
       iuu_process_error(status, __FILE__, __LINE__);
 
@@ -838,8 +1130,13 @@ iuu_error iuu_uart_rx(iuu * inf, u_int8_t * addr, u_int8_t * len)
    }
 
    status = iuu_read(inf, addr, *len);
-   if (status != IUU_OPERATION_OK)
+   if (status != IUU_OPERATION_OK) {
       iuu_process_error(status, __FILE__, __LINE__);
+      return status;
+   }
+
+   if (inf->conv == IUU_CONVENTION_INVERSE)
+      iuu_inverse(addr, *len);
 
    return status;
 }
@@ -861,6 +1158,8 @@ iuu_error iuu_uart_tx(iuu * inf, u_int8_t * addr, u_int8_t len)
    buf[1] = IUU_UART_TX;
    buf[2] = len;
    memcpy(&buf[3], addr, len);
+   if (inf->conv == IUU_CONVENTION_INVERSE)
+      iuu_inverse(&buf[3], len);
 
    status = iuu_write(inf, buf, len + 3);
    if (status != IUU_OPERATION_OK)
@@ -892,7 +1191,7 @@ iuu_error iuu_uart_txnops(iuu * inf, u_int8_t * data, u_int8_t len,
       buf[i * K + 0] = IUU_UART_ESC;
       buf[i * K + 1] = IUU_UART_TX;
       buf[i * K + 2] = 0x01;
-      buf[i * K + 3] = data[i];
+      buf[i * K + 3] = IUU_UART_BYTE(inf, data[i]);
       memset(&buf[i * K + 4], IUU_NO_OPERATION, nops);
    }
 
@@ -927,7 +1226,7 @@ iuu_error iuu_uart_txm(iuu * inf, u_int8_t * data, u_int8_t len,
       buf[i * K + 0] = IUU_UART_ESC;
       buf[i * K + 1] = IUU_UART_TX;
       buf[i * K + 2] = 0x01;
-      buf[i * K + 3] = data[i];
+      buf[i * K + 3] = IUU_UART_BYTE(inf, data[i]);
       buf[i * K + 4] = IUU_WAIT_MS;
       buf[i * K + 5] = ms;
    }
@@ -963,7 +1262,7 @@ iuu_error iuu_uart_txmu(iuu * inf, u_int8_t * data, u_int8_t len,
       buf[i * K + 0] = IUU_UART_ESC;
       buf[i * K + 1] = IUU_UART_TX;
       buf[i * K + 2] = 0x01;
-      buf[i * K + 3] = data[i];
+      buf[i * K + 3] = IUU_UART_BYTE(inf, data[i]);
       buf[i * K + 4] = IUU_WAIT_MUS;
       buf[i * K + 5] = mus;     /* 10 times mus actually */
    }
@@ -1052,6 +1351,65 @@ iuu_error iuu_uart_flush(iuu * inf)
    return status;
 }
 
+// Sets the data convention of the card in the phoenix interface.
+// From then on every byte received with iuu_uart_rx() and sent with
+// the iuu_uart_tx*() family is transcoded, so the application always
+// deals with direct convention data. iuu_get_atr() sets it on its own
+// from the TS byte of the card.
+iuu_error iuu_uart_convention(iuu * inf, iuu_convention conv)
+{
+   if (conv != IUU_CONVENTION_DIRECT && conv != IUU_CONVENTION_INVERSE) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+
+   inf->conv = conv;
+   return IUU_OPERATION_OK;
+}
+
+// Converts len bytes from inverse to direct convention (or the other
+// way round, since it is the same operation) in place. Large buffers
+// like traces or personalization data go 16 or 32 bytes at a time
+// when the library is built with -mssse3 or -mavx2.
+void iuu_inverse(u_int8_t * data, int len)
+{
+   int i = 0;
+
+#if defined(__AVX2__)
+   const __m256i lo = _mm256_broadcastsi128_si256(
+       _mm_loadu_si128((const __m128i *)inverse_lo));
+   const __m256i hi = _mm256_broadcastsi128_si256(
+       _mm_loadu_si128((const __m128i *)inverse_hi));
+   const __m256i mask = _mm256_set1_epi8(0x0F);
+
+   for (; i + 32 <= len; i += 32) {
+      __m256i v = _mm256_loadu_si256((__m256i *) (data + i));
+      __m256i l = _mm256_and_si256(v, mask);
+      __m256i h = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+      v = _mm256_or_si256(_mm256_shuffle_epi8(lo, l),
+                          _mm256_shuffle_epi8(hi, h));
+      _mm256_storeu_si256((__m256i *) (data + i), v);
+   }
+#endif
+#if defined(__SSSE3__)
+   const __m128i lo16 = _mm_loadu_si128((const __m128i *)inverse_lo);
+   const __m128i hi16 = _mm_loadu_si128((const __m128i *)inverse_hi);
+   const __m128i mask16 = _mm_set1_epi8(0x0F);
+
+   for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128((__m128i *) (data + i));
+      __m128i l = _mm_and_si128(v, mask16);
+      __m128i h = _mm_and_si128(_mm_srli_epi16(v, 4), mask16);
+      v = _mm_or_si128(_mm_shuffle_epi8(lo16, l),
+                       _mm_shuffle_epi8(hi16, h));
+      _mm_storeu_si128((__m128i *) (data + i), v);
+   }
+#endif
+
+   for (; i < len; i++)
+      data[i] = inverse2direct[data[i]];
+}
+
 // EEPROM through device related commands
 
 // Power on
@@ -1060,6 +1418,7 @@ iuu_error iuu_eeprom_on(iuu * inf)
    int status;
    u_int8_t buf = IUU_EEPROM_ON;
 
+   inf->eeprom = NULL;
    status = iuu_write(inf, &buf, 1);
    if (status != IUU_OPERATION_OK)
       iuu_process_error(status, __FILE__, __LINE__);
@@ -1072,6 +1431,7 @@ iuu_error iuu_eeprom_off(iuu * inf)
    int status;
    u_int8_t buf = IUU_EEPROM_OFF;
 
+   inf->eeprom = NULL;
    status = iuu_write(inf, &buf, 1);
    if (status != IUU_OPERATION_OK)
       iuu_process_error(status, __FILE__, __LINE__);
@@ -1108,7 +1468,7 @@ iuu_error iuu_eeprom_writex(iuu * inf, u_int8_t ctrl, u_int16_t addr,
    buf[0] = IUU_EEPROM_WRITEX;
    buf[1] = ctrl;
    buf[2] = (u_int8_t) (addr & 0x00FF);
-   buf[3] = (u_int8_t) ((addr >> 8) & 0xFF00);
+   buf[3] = (u_int8_t) ((addr >> 8) & 0x00FF);
    buf[4] = data;
 
    status = iuu_write(inf, buf, 5);
@@ -1165,7 +1525,7 @@ iuu_error iuu_eeprom_writex32(iuu * inf, u_int8_t ctrl, u_int16_t addr,
    buf[0] = IUU_EEPROM_WRITEX32;
    buf[1] = ctrl;
    buf[2] = (u_int8_t) (addr & 0x00FF);
-   buf[3] = (u_int8_t) ((addr >> 8) & 0xFF00);
+   buf[3] = (u_int8_t) ((addr >> 8) & 0x00FF);
    memcpy(&buf[4], data, 32);
 
    status = iuu_write(inf, buf, 36);
@@ -1184,7 +1544,7 @@ iuu_error iuu_eeprom_writex64(iuu * inf, u_int8_t ctrl, u_int16_t addr,
    buf[0] = IUU_EEPROM_WRITEX64;
    buf[1] = ctrl;
    buf[2] = (u_int8_t) (addr & 0x00FF);
-   buf[3] = (u_int8_t) ((addr >> 8) & 0xFF00);
+   buf[3] = (u_int8_t) ((addr >> 8) & 0x00FF);
    memcpy(&buf[4], data, 64);
 
    status = iuu_write(inf, buf, 68);
@@ -1223,10 +1583,10 @@ iuu_error iuu_eeprom_readx(iuu * inf, u_int8_t ctrl, u_int16_t addr,
    int status;
    u_int8_t buf[4];
 
-   buf[0] = IUU_EEPROM_READ;
+   buf[0] = IUU_EEPROM_READX;
    buf[1] = ctrl;
    buf[2] = (u_int8_t) (addr & 0x00FF);
-   buf[3] = (u_int8_t) ((addr >> 8) & 0xFF00);
+   buf[3] = (u_int8_t) ((addr >> 8) & 0x00FF);
 
    status = iuu_write(inf, buf, 4);
    if (status != IUU_OPERATION_OK) {
@@ -1290,6 +1650,102 @@ iuu_error iuu_eeprom_breadx(iuu * inf, u_int8_t ctrl, u_int16_t addr,
    return status;
 }
 
+// Builds in cmd as many block read commands as fit in a transfer to
+// read at most max of the len bytes at addr, and returns how many bytes
+// they read. The length of the commands goes to n. With addr16 the chip
+// takes 16 bit addresses, otherwise 8 bit ones. Address bits above
+// those go into the block select bits of ctrl like in the 24C04-16 and
+// 24C1024.
+size_t iuu_eeprom_read_cmd(u_int8_t * cmd, int *n, u_int8_t ctrl,
+                           u_int32_t addr, size_t len, size_t max,
+                           int addr16)
+{
+   size_t want = 0;
+
+   *n = 0;
+   while (want < len && *n + 5 <= IUU_USB_MAX_PAYLOAD &&
+          want + IUU_EEPROM_CHUNK <= max) {
+      u_int32_t a = addr + want;
+      size_t chunk = len - want;
+
+      if (chunk > IUU_EEPROM_CHUNK)
+         chunk = IUU_EEPROM_CHUNK;
+      // Addresses can not run over a block, which is 256 bytes for
+      // 8 bit addresses and 64k for 16 bit ones
+      if (!addr16 && chunk > 0x100 - (a & 0xFF))
+         chunk = 0x100 - (a & 0xFF);
+      if (addr16 && chunk > 0x10000 - (a & 0xFFFF))
+         chunk = 0x10000 - (a & 0xFFFF);
+
+      if (addr16) {
+         cmd[(*n)++] = IUU_EEPROM_BREADX;
+         cmd[(*n)++] = ctrl | (((a >> 16) & 0x07) << 1);
+         cmd[(*n)++] = (u_int8_t) (a & 0x00FF);
+         cmd[(*n)++] = (u_int8_t) ((a >> 8) & 0x00FF);
+      } else {
+         cmd[(*n)++] = IUU_EEPROM_BREAD;
+         cmd[(*n)++] = ctrl | (((a >> 8) & 0x07) << 1);
+         cmd[(*n)++] = (u_int8_t) (a & 0x00FF);
+      }
+      cmd[(*n)++] = (u_int8_t) chunk;
+      want += chunk;
+   }
+
+   return want;
+}
+
+// Reads len bytes starting at addr with as few USB round trips as
+// possible: as many block read commands as fit go in a single write
+// and all their answers are drained with a single read. See
+// iuu_eeprom_read_cmd() for ctrl and addr16.
+iuu_error iuu_eeprom_read_batch(iuu * inf, u_int8_t ctrl, u_int32_t addr,
+                                size_t len, u_int8_t * data, int addr16)
+{
+   iuu_error status;
+   u_int8_t cmd[IUU_USB_MAX_PAYLOAD];
+   size_t done = 0;
+
+   while (done < len) {
+      size_t want;
+      int n;
+
+      want = iuu_eeprom_read_cmd(cmd, &n, ctrl, addr + done, len - done,
+                                 IUU_USB_MAX_READ, addr16);
+
+      status = iuu_write(inf, cmd, n);
+      if (status != IUU_OPERATION_OK) {
+         iuu_process_error(status, __FILE__, __LINE__);
+         return status;
+      }
+
+      status = iuu_read_all(inf, data + done, want);
+      if (status != IUU_OPERATION_OK) {
+         iuu_process_error(status, __FILE__, __LINE__);
+         return status;
+      }
+      done += want;
+   }
+
+   return IUU_OPERATION_OK;
+}
+
+// read len bytes, 16bit address, anywhere in the 64k address space
+iuu_error iuu_eeprom_read_range(iuu * inf, u_int8_t ctrl, u_int16_t addr,
+                                size_t len, u_int8_t * data)
+{
+   iuu_error status;
+
+   if (len > 0x10000 || addr > 0x10000 - len) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+
+   status = iuu_eeprom_read_batch(inf, ctrl, addr, len, data, 1);
+   if (status != IUU_OPERATION_OK)
+      iuu_process_error(status, __FILE__, __LINE__);
+   return status;
+}
+
 // turns power supply on
 iuu_error iuu_avr_on(iuu * inf)
 {
@@ -1436,29 +1892,27 @@ iuu_error iuu_avr_pwrite(iuu * inf, u_int8_t * data)
    return status;
 }
 
-// writes len words from data to prog mem
+// writes len words from data to prog mem, at most IUU_AVR_PWRITEN_MAX
+// so that the command fits in a transfer
 // increments the internal program counter by len
-// PENDING: PLEASE DO REVIEW THIS CODE!!!
 iuu_error iuu_avr_pwriten(iuu * inf, u_int8_t * data, u_int8_t len)
 {
    int status;
-   unsigned char *buf;
+   u_int8_t buf[IUU_USB_MAX_PAYLOAD];
 
-   buf = (unsigned char *)malloc(len * 2) + 1;
-   if (!buf) {
-      iuu_process_error(-1, __FILE__, __LINE__);
-      return -1;
+   if (len > IUU_AVR_PWRITEN_MAX) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
    }
 
    buf[0] = IUU_AVR_PWRITEN;
-   memcpy(buf + 1, data, len * 2);
-
-   status = iuu_write(inf, buf, len * 2 + 1);
+   buf[1] = len;
+   memcpy(buf + 2, data, len * 2);
 
+   status = iuu_write(inf, buf, len * 2 + 2);
    if (status != IUU_OPERATION_OK)
       iuu_process_error(status, __FILE__, __LINE__);
 
-   free(buf);
    return status;
 }
 
@@ -1729,10 +2183,10 @@ iuu_error iuu_pic_dread(iuu * inf, u_int8_t * data)
 // an Answer To Reset.
 iuu_error iuu_get_atr(iuu * inf, u_int8_t * atr, u_int8_t * len)
 {
-   int i;
-   unsigned char tmp;
    iuu_error status;
 
+   // The TS byte tells the convention, so read it raw
+   inf->conv = IUU_CONVENTION_DIRECT;
    status = iuu_uart_rx(inf, atr, len);
    if (status != IUU_OPERATION_OK)
       iuu_process_error(status, __FILE__, __LINE__);
@@ -1740,11 +2194,10 @@ iuu_error iuu_get_atr(iuu * inf, u_int8_t * atr, u_int8_t * len)
    atr[*len] = '\0';
 
    // If the card uses Inverse Convention, gotta recode the bytes
-   if (atr[0] == 0x03) {
-      for (i = 0; i < *len; i++) {
-         tmp = inverse2direct[atr[i]];
-         atr[i] = tmp;
-      }
+   // and everything that comes after them through the phoenix
+   if (*len > 0 && atr[0] == 0x03) {
+      inf->conv = IUU_CONVENTION_INVERSE;
+      iuu_inverse(atr, *len);
    }
 
    return status;
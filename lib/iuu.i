@@ -71,6 +71,7 @@ iuu_error iuu_uart_tx(iuu *inf, u_int8_t *data, u_int8_t len);
 iuu_error iuu_uart_trap(iuu *inf, u_int8_t wt, u_int8_t cmdbyte);
 iuu_error iuu_uart_break(iuu *inf, u_int8_t wt, u_int8_t cmdbyte);
 iuu_error iuu_uart_flush(iuu *inf);
+iuu_error iuu_uart_convention(iuu *inf, iuu_convention conv);
 
 
 
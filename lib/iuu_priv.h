@@ -0,0 +1,227 @@
+/*
+ *  iuutool - a port of WBE's Infinity USB Unlimited SDK
+ * 
+ *  Copyright (C) 2006 Juan Carlos Borrs
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as 
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _IUU_PRIV_H_
+#define _IUU_PRIV_H_
+
+// Definitions shared by the library modules but not by applications
+
+enum iuu_usb_params {
+   IUU_USB_VENDOR_ID = 0x104f,
+   IUU_USB_PRODUCT_ID = 0x0004,
+   IUU_USB_OP_TIMEOUT = 0x0200,
+   IUU_USB_MAX_PAYLOAD = 0x00FF,        // largest write the IUU accepts
+   IUU_USB_MAX_READ = 0x1000,   // largest read we drain in one go
+   IUU_USB_DRAIN_TIMEOUT = 0x0020       // ms to wait for stale answers
+};
+
+/* Programmer commands */
+enum iuu_command {
+   IUU_NO_OPERATION = 0x00,
+   IUU_GET_FIRMWARE_VERSION = 0x01,
+   IUU_GET_PRODUCT_NAME = 0x02,
+   IUU_GET_STATE_REGISTER = 0x03,
+   IUU_SET_LED = 0x04,
+   IUU_WAIT_MUS = 0x05,
+   IUU_WAIT_MS = 0x06,
+
+   IUU_GET_LOADER_VERSION = 0x50,
+   IUU_RST_SET = 0x52,
+   IUU_RST_CLEAR = 0x53,
+   IUU_SET_VCC = 0x59,
+
+   IUU_UART_ENABLE = 0x49,
+   IUU_UART_DISABLE = 0x4A,
+   IUU_UART_WRITE_I2C = 0x4C,
+   IUU_UART_ESC = 0x5E,
+   IUU_UART_TRAP = 0x54,
+   IUU_UART_TRAP_BREAK = 0x5B,
+   IUU_UART_RX = 0x56,
+
+   IUU_AVR_ON = 0x21,
+   IUU_AVR_OFF = 0x22,
+   IUU_AVR_1CLK = 0x23,
+   IUU_AVR_RESET = 0x24,
+   IUU_AVR_RESET_PC = 0x25,
+   IUU_AVR_INC_PC = 0x26,
+   IUU_AVR_INCN_PC = 0x27,
+   IUU_AVR_PREAD = 0x29,
+   IUU_AVR_PREADN = 0x2A,
+   IUU_AVR_PWRITE = 0x28,
+   IUU_AVR_DREAD = 0x2C,
+   IUU_AVR_DREADN = 0x2D,
+   IUU_AVR_DWRITE = 0x2B,
+   IUU_AVR_PWRITEN = 0x2E,
+
+   IUU_EEPROM_ON = 0x37,
+   IUU_EEPROM_OFF = 0x38,
+   IUU_EEPROM_WRITE = 0x39,
+   IUU_EEPROM_WRITEX = 0x3A,
+   IUU_EEPROM_WRITE8 = 0x3B,
+   IUU_EEPROM_WRITE16 = 0x3C,
+   IUU_EEPROM_WRITEX32 = 0x3D,
+   IUU_EEPROM_WRITEX64 = 0x3E,
+   IUU_EEPROM_READ = 0x3F,
+   IUU_EEPROM_READX = 0x40,
+   IUU_EEPROM_BREAD = 0x41,
+   IUU_EEPROM_BREADX = 0x42,
+
+   IUU_PIC_CMD = 0x0A,
+   IUU_PIC_CMD_LOAD = 0x0B,
+   IUU_PIC_CMD_READ = 0x0C,
+   IUU_PIC_ON = 0x0D,
+   IUU_PIC_OFF = 0x0E,
+   IUU_PIC_RESET = 0x16,
+   IUU_PIC_INC_PC = 0x0F,
+   IUU_PIC_INCN_PC = 0x10,
+   IUU_PIC_PWRITE = 0x11,
+   IUU_PIC_PREAD = 0x12,
+   IUU_PIC_PREADN = 0x13,
+   IUU_PIC_DWRITE = 0x14,
+   IUU_PIC_DREAD = 0x15
+};
+
+// The on board clock generator and its 12MHz reference
+enum iuu_clk_params {
+   IUU_CLK_I2C_ADDR = 0x69,
+   IUU_CLK_REF = 12000000
+};
+
+// Bytes asked for by every IUU_EEPROM_BREAD(X) of a batched read and
+// wait between write completion probes (in units of 10us)
+enum iuu_eeprom_params {
+   IUU_EEPROM_CHUNK = 0x80,
+   IUU_EEPROM_POLL_STEP = 25
+};
+
+// Most words an IUU_AVR_PWRITEN can carry in a transfer and most
+// separate runs of words read back in a batch
+enum iuu_avr_params {
+   IUU_AVR_PWRITEN_MAX = (IUU_USB_MAX_PAYLOAD - 2) / 2,
+   IUU_PROG_PIECES = 64
+};
+
+// Personalization: bytes around a field written again for every card
+// when the chip has no page of its own (AVR and PIC), cards prepared
+// ahead of use and columns of a CSV record
+enum iuu_perso_params {
+   IUU_PERSO_PAGE = 64,
+   IUU_PERSO_AHEAD = 32,
+   IUU_PERSO_COLUMNS = 64
+};
+
+// Bytes of image programmed between two checkpoints of a resumable
+// job, a multiple of every EEPROM page. PIC data memory takes two
+// bytes of image per byte.
+enum iuu_resume_params {
+   IUU_RESUME_CHUNK = 1024
+};
+
+// ICSP commands of the PIC16F8x cards, as sent with IUU_PIC_CMD and
+// IUU_PIC_CMD_LOAD
+enum iuu_icsp_command {
+   IUU_ICSP_LOAD_CONFIG = 0x00,
+   IUU_ICSP_LOAD_PROG = 0x02,
+   IUU_ICSP_LOAD_DATA = 0x03,
+   IUU_ICSP_INC = 0x06,
+   IUU_ICSP_ERASE_PROG = 0x08,
+   IUU_ICSP_BULK_ERASE_PROG = 0x09,
+   IUU_ICSP_BULK_ERASE_DATA = 0x0B,
+   IUU_ICSP_PROG = 0x18
+};
+
+// Where the memories of a PIC16F8x are in words, as in its hex files
+// (which give byte addresses, twice these)
+enum iuu_pic_params {
+   IUU_PIC_CONFIG_ADDR = 0x2000,
+   IUU_PIC_CONFIG_WORDS = 8,
+   IUU_PIC_DATA_ADDR = 0x2100,
+   IUU_PIC_ERASED = 0x3FFF
+};
+
+enum iuu_extra_command {
+   IUU_UART_NOP = 0x00,
+   IUU_UART_CHANGE = 0x02,
+   IUU_UART_TX = 0x04,
+   IUU_DELAY_MS = 0x06
+};
+
+// ISO7816 timings of a card reset, see iuu_seq_atr(), and largest
+// answer of a command of a sequence
+enum iuu_seq_params {
+   IUU_SEQ_RST_CLK = 40000,     // clock cycles RST is held and the ATR
+                                // may take to start
+   IUU_SEQ_ATR_CHARS = 33,      // longest ATR
+   IUU_SEQ_CHAR_ETU = 12,       // etus a character takes, guard time included
+   IUU_SEQ_F0 = 372,            // F and D during the ATR
+   IUU_SEQ_D0 = 1,
+   IUU_SEQ_MAX_ANSWER = 2 * IUU_USB_MAX_PAYLOAD  // of a command
+};
+
+// Command scripts: bytes a line can carry, parameters a script can
+// declare and version of the compiled scripts kept in a cache
+enum iuu_script_params {
+   IUU_SCRIPT_LINE = 1024,
+   IUU_SCRIPT_PARAMS = 64,
+   IUU_SCRIPT_UNROLLED = 1 << 20,       // statements and loop turns
+   IUU_SCRIPT_VERSION = 1
+};
+
+// Runs of differing bytes being collected by iuu_mismatch_scan()
+struct iuu_mismatch_map {
+   struct iuu_mismatch *map;
+   int max;                     // entries in map
+   int n;                       // entries used
+   int open;                    // the last one may go on
+   int full;                    // a run did not fit
+   u_int32_t next;              // address following the last compared
+};
+
+// Library internals
+iuu_error iuu_read_all(iuu * inf, u_int8_t * buf, int len);
+iuu_error iuu_drain(iuu * inf);
+size_t iuu_eeprom_read_cmd(u_int8_t * cmd, int *n, u_int8_t ctrl,
+                           u_int32_t addr, size_t len, size_t max,
+                           int addr16);
+iuu_error iuu_eeprom_read_batch(iuu * inf, u_int8_t ctrl, u_int32_t addr,
+                                size_t len, u_int8_t * data, int addr16);
+void iuu_mismatch_init(struct iuu_mismatch_map *m, struct iuu_mismatch *map,
+                       int max);
+int iuu_mismatch_scan(struct iuu_mismatch_map *m, u_int32_t addr,
+                      const u_int8_t * got, const u_int8_t * want, size_t n);
+// What a reader of a gang sends and checks, see iuu_gang_work()
+struct iuu_gang_task {
+   const struct iuu_stream *s[2];       // sent one after the other
+   const struct iuu_image *img[2];      // verified once all is sent
+};
+
+iuu_error iuu_gang_work(struct iuu_gang_unit *u, const struct iuu_job *job,
+                        const struct iuu_gang_task *task,
+                        iuu_gang_progress progress, void *arg);
+iuu_error iuu_gang_run(struct iuu_gang_unit *units, int n,
+                       const struct iuu_job *job,
+                       const struct iuu_gang_task *task,
+                       iuu_gang_progress progress, void *arg);
+int iuu_image_hex(const char *s, u_int8_t * out, size_t n);
+u_int64_t iuu_hash(u_int64_t h, const void *p, size_t n);
+u_int64_t iuu_image_hash(const struct iuu_image *img);
+iuu_error iuu_image_map(const char *path, void **map, size_t *len);
+void iuu_image_unmap(void *map, size_t len);
+
+#endif
@@ -0,0 +1,338 @@
+/*
+ *  iuutool - a port of WBE's Infinity USB Unlimited SDK
+ * 
+ *  Copyright (C) 2006 Juan Carlos Borrs
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as 
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <usb.h>
+
+#include <iuu.h>
+#include "iuu_priv.h"
+
+// Builds in s every command that programs img into a card of the kind
+// job is for. The stream does not depend on the IUU it goes to, so it
+// can be built once and sent to as many cards as needed.
+iuu_error iuu_job_encode(struct iuu_stream *s, const struct iuu_job *job,
+                         const struct iuu_image *img)
+{
+   struct iuu_cursor c;
+   iuu_error status = IUU_OPERATION_OK;
+   int i;
+
+   switch (job->target) {
+   case IUU_TARGET_EEPROM:
+      if (!job->eeprom) {
+         status = IUU_INVALID_PARAMETER;
+         break;
+      }
+      for (i = 0; i < img->nseg && status == IUU_OPERATION_OK; i++)
+         status = iuu_eeprom_encode(s, job->ctrl, job->eeprom,
+                                    img->seg[i].addr, img->seg[i].data,
+                                    img->seg[i].len);
+      break;
+   case IUU_TARGET_AVR:
+      iuu_cursor_init(&c, IUU_CURSOR_AVR);
+      status = iuu_avr_encode(s, &c, img);
+      break;
+   case IUU_TARGET_PIC:
+      if (!job->pic) {
+         status = IUU_INVALID_PARAMETER;
+         break;
+      }
+      status = iuu_pic_encode(s, job->pic, img,
+                              IUU_PIC_MEMORY | IUU_PIC_CONFIG);
+      break;
+   default:
+      status = IUU_INVALID_PARAMETER;
+   }
+
+   if (status != IUU_OPERATION_OK)
+      iuu_process_error(status, __FILE__, __LINE__);
+   return status;
+}
+
+// Reads back a card programmed as job says and checks that it holds
+// img. Returns IUU_VERIFY_FAILED if it does not.
+iuu_error iuu_job_verify(iuu * inf, const struct iuu_job *job,
+                         const struct iuu_image *img)
+{
+   struct iuu_cursor c;
+   iuu_error status = IUU_OPERATION_OK;
+   int i;
+
+   switch (job->target) {
+   case IUU_TARGET_EEPROM:
+      for (i = 0; i < img->nseg && status == IUU_OPERATION_OK; i++)
+         status = iuu_eeprom_verify(inf, job->ctrl, job->eeprom,
+                                    img->seg[i].addr, img->seg[i].data,
+                                    img->seg[i].len, NULL, 0, NULL);
+      break;
+   case IUU_TARGET_AVR:
+      iuu_cursor_init(&c, IUU_CURSOR_AVR);
+      status = iuu_prog_verify(inf, &c, IUU_SPACE_PROGRAM, img, NULL, 0,
+                               NULL);
+      break;
+   case IUU_TARGET_PIC:
+      status = iuu_pic_verify(inf, job->pic, img,
+                              IUU_PIC_MEMORY | IUU_PIC_CONFIG);
+      break;
+   default:
+      status = IUU_INVALID_PARAMETER;
+   }
+
+   if (status != IUU_OPERATION_OK && status != IUU_VERIFY_FAILED)
+      iuu_process_error(status, __FILE__, __LINE__);
+   return status;
+}
+
+// Powers the card job is for on or off
+iuu_error iuu_job_power(iuu * inf, const struct iuu_job *job, int on)
+{
+   switch (job->target) {
+   case IUU_TARGET_EEPROM:
+      return on ? iuu_eeprom_on(inf) : iuu_eeprom_off(inf);
+   case IUU_TARGET_AVR:
+      return on ? iuu_avr_on(inf) : iuu_avr_off(inf);
+   case IUU_TARGET_PIC:
+      return on ? iuu_pic_on(inf) : iuu_pic_off(inf);
+   default:
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+}
+
+// Hashes what a journal is for, so that it is not taken for another
+// image or card
+static u_int64_t iuu_job_hash(const struct iuu_job *job,
+                              const struct iuu_image *img)
+{
+   u_int64_t h = iuu_image_hash(img);
+   const char *name = NULL;
+
+   h = iuu_hash(h, &job->target, sizeof(job->target));
+   if (job->target == IUU_TARGET_EEPROM && job->eeprom) {
+      name = job->eeprom->name;
+      h = iuu_hash(h, &job->ctrl, 1);
+   } else if (job->target == IUU_TARGET_PIC && job->pic)
+      name = job->pic->name;
+   if (name)
+      h = iuu_hash(h, name, strlen(name));
+   return h;
+}
+
+// Reads where the job of hash h got to from journal, 0 if it is not
+// there or is about something else
+static u_int32_t iuu_job_journal_read(const char *journal, u_int64_t h)
+{
+   unsigned long long jh;
+   unsigned long next;
+   FILE *f;
+   int n;
+
+   f = fopen(journal, "r");
+   if (!f)
+      return 0;
+   n = fscanf(f, "iuu-journal %llx %lx", &jh, &next);
+   fclose(f);
+   return n == 2 && jh == h ? next : 0;
+}
+
+// Records in journal that the job of hash h is done below next. The
+// journal is written aside and renamed over, so it is never left half
+// written.
+static iuu_error iuu_job_journal_write(const char *journal, u_int64_t h,
+                                       u_int32_t next)
+{
+   char tmp[1024];
+   FILE *f;
+   int ok;
+
+   if (snprintf(tmp, sizeof(tmp), "%s.tmp", journal) >= (int)sizeof(tmp))
+      return IUU_FILE_ERROR;
+   f = fopen(tmp, "w");
+   if (!f)
+      return IUU_FILE_ERROR;
+   ok = fprintf(f, "iuu-journal %016llx %08lx\n", (unsigned long long)h,
+                (unsigned long)next) > 0;
+   ok = !fclose(f) && ok;
+   if (!ok || rename(tmp, journal)) {
+      unlink(tmp);
+      return IUU_FILE_ERROR;
+   }
+   return IUU_OPERATION_OK;
+}
+
+// Start of the first chunk of img at or after addr, 0 if none is left
+// (and *more is 0)
+static u_int32_t iuu_job_chunk(const struct iuu_image *img, u_int64_t addr,
+                               int *more)
+{
+   int i;
+
+   for (i = 0; i < img->nseg; i++)
+      if ((u_int64_t) img->seg[i].addr + img->seg[i].len > addr) {
+         *more = 1;
+         if (img->seg[i].addr > addr)
+            addr = img->seg[i].addr;
+         return addr / IUU_RESUME_CHUNK * IUU_RESUME_CHUNK;
+      }
+   *more = 0;
+   return 0;
+}
+
+// Leaves in part what img holds from lo to lo + IUU_RESUME_CHUNK
+static iuu_error iuu_job_part(const struct iuu_image *img, u_int32_t lo,
+                              struct iuu_image *part)
+{
+   u_int64_t hi = (u_int64_t) lo + IUU_RESUME_CHUNK;
+   iuu_error status = IUU_OPERATION_OK;
+   int i;
+
+   iuu_image_reset(part);
+   for (i = 0; i < img->nseg && status == IUU_OPERATION_OK; i++) {
+      u_int64_t a = img->seg[i].addr, b = a + img->seg[i].len;
+
+      if (a < lo)
+         a = lo;
+      if (b > hi)
+         b = hi;
+      if (a < b)
+         status = iuu_image_parse(part, (const char *)img->seg[i].data +
+                                  (a - img->seg[i].addr), b - a,
+                                  IUU_IMAGE_RAW, a);
+   }
+   return status;
+}
+
+// Programs a chunk. A PIC is bulk erased with the first chunk of a job
+// started afresh, and its configuration is left for the very end.
+static iuu_error iuu_job_send_part(iuu * inf, const struct iuu_job *job,
+                                   const struct iuu_image *part,
+                                   struct iuu_stream *s, int erase)
+{
+   iuu_error status;
+
+   iuu_stream_reset(s);
+   if (job->target == IUU_TARGET_PIC)
+      status = iuu_pic_encode(s, job->pic, part, IUU_PIC_MEMORY |
+                              (erase ? 0 : IUU_PIC_NOERASE));
+   else
+      status = iuu_job_encode(s, job, part);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_stream_send(inf, s);
+   return status;
+}
+
+static iuu_error iuu_job_verify_part(iuu * inf, const struct iuu_job *job,
+                                     const struct iuu_image *part)
+{
+   if (job->target == IUU_TARGET_PIC)
+      return iuu_pic_verify(inf, job->pic, part, IUU_PIC_MEMORY);
+   return iuu_job_verify(inf, job, part);
+}
+
+// Programs img into a card as job says, IUU_RESUME_CHUNK bytes at a
+// time, recording in the file journal how far it got after every
+// chunk. If the job is run again after failing, e.g. on a USB error, it
+// checks the last chunk recorded and goes on from there, or from the
+// chunk before if that one does not verify. The journal is removed once
+// the job is done; a journal left from another image or card is
+// ignored.
+iuu_error iuu_job_resume(iuu * inf, const struct iuu_job *job,
+                         const struct iuu_image *img, const char *journal)
+{
+   struct iuu_image part;
+   struct iuu_stream s;
+   iuu_error status = IUU_OPERATION_OK;
+   u_int64_t h = iuu_job_hash(job, img);
+   u_int32_t next, lo, last = 0;
+   int more, fresh, found;
+
+   if ((job->target == IUU_TARGET_EEPROM && !job->eeprom) ||
+       (job->target == IUU_TARGET_PIC && !job->pic)) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+
+   iuu_image_init(&part, img->fill);
+   iuu_stream_init(&s);
+   if (job->flags & IUU_JOB_POWER)
+      status = iuu_job_power(inf, job, 1);
+
+   // step back over the chunks that do not verify, with nothing left
+   // over from the failed run in the way
+   next = iuu_job_journal_read(journal, h);
+   if (next && status == IUU_OPERATION_OK)
+      status = iuu_drain(inf);
+   while (next && status == IUU_OPERATION_OK) {
+      for (found = 0, lo = iuu_job_chunk(img, 0, &more);
+           more && lo < next;
+           lo = iuu_job_chunk(img, (u_int64_t) lo + IUU_RESUME_CHUNK, &more))
+         last = lo, found = 1;
+      if (!found) {
+         next = 0;
+         break;
+      }
+      status = iuu_job_part(img, last, &part);
+      if (status == IUU_OPERATION_OK)
+         status = iuu_job_verify_part(inf, job, &part);
+      if (status == IUU_OPERATION_OK)
+         break;
+      if (status == IUU_VERIFY_FAILED)
+         status = IUU_OPERATION_OK;
+      next = last;
+   }
+   fresh = !next;
+
+   for (lo = iuu_job_chunk(img, next, &more);
+        more && status == IUU_OPERATION_OK;
+        lo = iuu_job_chunk(img, (u_int64_t) lo + IUU_RESUME_CHUNK, &more)) {
+      status = iuu_job_part(img, lo, &part);
+      if (status == IUU_OPERATION_OK)
+         status = iuu_job_send_part(inf, job, &part, &s, fresh);
+      fresh = 0;
+      if (status == IUU_OPERATION_OK)
+         status = iuu_job_journal_write(journal, h, lo + IUU_RESUME_CHUNK);
+   }
+
+   if (status == IUU_OPERATION_OK && job->target == IUU_TARGET_PIC) {
+      iuu_stream_reset(&s);
+      status = iuu_pic_encode(&s, job->pic, img, IUU_PIC_CONFIG);
+      if (status == IUU_OPERATION_OK)
+         status = iuu_stream_send(inf, &s);
+   }
+   if (status == IUU_OPERATION_OK && (job->flags & IUU_JOB_VERIFY))
+      status = iuu_job_verify(inf, job, img);
+   if (status == IUU_OPERATION_OK)
+      unlink(journal);
+
+   if (job->flags & IUU_JOB_POWER) {
+      iuu_error off = iuu_job_power(inf, job, 0);
+      if (status == IUU_OPERATION_OK)
+         status = off;
+   }
+
+   if (status != IUU_OPERATION_OK && status != IUU_VERIFY_FAILED)
+      iuu_process_error(status, __FILE__, __LINE__);
+   iuu_image_free(&part);
+   iuu_stream_free(&s);
+   return status;
+}
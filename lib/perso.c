@@ -0,0 +1,587 @@
+/*
+ *  iuutool - a port of WBE's Infinity USB Unlimited SDK
+ * 
+ *  Copyright (C) 2006 Juan Carlos Borrs
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as 
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <stdio.h>
+#include <usb.h>
+
+#include <iuu.h>
+#include "iuu_priv.h"
+
+struct iuu_perso {
+   struct iuu_job job;
+   struct iuu_field *field;
+   int nfield;
+   size_t maxlen;               // longest field
+   struct iuu_image base;       // template but the pages with fields
+   struct iuu_image pages;      // template in the pages with fields
+   struct iuu_stream s;         // commands programming base
+
+   // record file, only looked at by the prefetch thread
+   char *map;
+   size_t len;
+   size_t off;                  // next record starts here
+   long next;                   // and is this one
+   int flags;
+   size_t reclen;               // binary records are this long
+   u_int8_t *buf;               // a field being decoded
+
+   // cards ready, taken and free
+   pthread_mutex_t lock;
+   pthread_cond_t more, room;
+   pthread_t thread;
+   int started;
+   struct iuu_perso_card card[IUU_PERSO_AHEAD];
+   int ready[IUU_PERSO_AHEAD], rhead, nready;
+   int spare[IUU_PERSO_AHEAD], nspare;
+   int end;                     // no more records
+   int stop;                    // being closed
+   iuu_error status;            // why there are no more records
+};
+
+// Orders ranges by address
+static int iuu_perso_cmp(const void *a, const void *b)
+{
+   const struct iuu_segment *x = a, *y = b;
+
+   return x->addr < y->addr ? -1 : (x->addr > y->addr);
+}
+
+// Rounds the field of p out to pages of page bytes and merges the ones
+// that touch in p->pages, as ranges with no data yet
+static iuu_error iuu_perso_runs(struct iuu_perso *p, u_int32_t page,
+                                struct iuu_segment **run, int *nrun)
+{
+   struct iuu_segment *r;
+   int i, n = 0;
+
+   r = malloc(p->nfield * sizeof(*r));
+   if (!r)
+      return IUU_OUT_OF_MEMORY;
+
+   for (i = 0; i < p->nfield; i++) {
+      u_int64_t lo = p->field[i].addr / page * page;
+      u_int64_t hi = (u_int64_t) p->field[i].addr + p->field[i].len;
+
+      hi = (hi + page - 1) / page * page;
+      if (hi > 0x100000000ULL)
+         hi = 0x100000000ULL;
+      r[i].addr = lo;
+      r[i].len = hi - lo;
+      r[i].data = NULL;
+   }
+   qsort(r, p->nfield, sizeof(*r), iuu_perso_cmp);
+
+   for (i = 0; i < p->nfield; i++) {
+      if (n && (u_int64_t) r[n - 1].addr + r[n - 1].len >= r[i].addr) {
+         u_int64_t end = (u_int64_t) r[i].addr + r[i].len;
+
+         if (end > (u_int64_t) r[n - 1].addr + r[n - 1].len)
+            r[n - 1].len = end - r[n - 1].addr;
+      } else
+         r[n++] = r[i];
+   }
+
+   *run = r;
+   *nrun = n;
+   return IUU_OPERATION_OK;
+}
+
+// Splits the template between p->base and p->pages, the latter taking
+// whatever falls in the runs of pages holding fields
+static iuu_error iuu_perso_split(struct iuu_perso *p,
+                                 const struct iuu_image *tmpl,
+                                 const struct iuu_segment *run, int nrun)
+{
+   iuu_error status = IUU_OPERATION_OK;
+   int i, j;
+
+   for (i = 0; i < tmpl->nseg && status == IUU_OPERATION_OK; i++) {
+      const struct iuu_segment *s = &tmpl->seg[i];
+      u_int64_t at = s->addr, end = at + s->len;
+
+      for (j = 0; j < nrun && at < end && status == IUU_OPERATION_OK; j++) {
+         u_int64_t lo = run[j].addr, hi = lo + run[j].len;
+
+         if (hi <= at || lo >= end)
+            continue;
+         if (lo > at)
+            status = iuu_image_parse(&p->base,
+                                     (const char *)s->data + (at - s->addr),
+                                     lo - at, IUU_IMAGE_RAW, at);
+         if (lo < at)
+            lo = at;
+         if (hi > end)
+            hi = end;
+         if (status == IUU_OPERATION_OK)
+            status = iuu_image_parse(&p->pages,
+                                     (const char *)s->data + (lo - s->addr),
+                                     hi - lo, IUU_IMAGE_RAW, lo);
+         at = hi;
+      }
+      if (at < end && status == IUU_OPERATION_OK)
+         status = iuu_image_parse(&p->base,
+                                  (const char *)s->data + (at - s->addr),
+                                  end - at, IUU_IMAGE_RAW, at);
+   }
+   return status;
+}
+
+// Encodes the commands for the bytes of img. PIC memory has been erased
+// by the base stream and its configuration goes last of all, after the
+// fields, so it is sent with every card.
+static iuu_error iuu_perso_encode(struct iuu_perso *p, struct iuu_stream *s,
+                                  const struct iuu_image *img, int base)
+{
+   iuu_error status;
+
+   if (p->job.target != IUU_TARGET_PIC)
+      return iuu_job_encode(s, &p->job, img);
+
+   if (base)
+      return iuu_pic_encode(s, p->job.pic, img, IUU_PIC_MEMORY);
+
+   status = iuu_pic_encode(s, p->job.pic, img,
+                           IUU_PIC_MEMORY | IUU_PIC_NOERASE);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_pic_encode(s, p->job.pic, &p->base, IUU_PIC_CONFIG);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_pic_encode(s, p->job.pic, img, IUU_PIC_CONFIG);
+   return status;
+}
+
+// Decodes the text of field f, from at to end, into p->buf
+static iuu_error iuu_perso_decode(struct iuu_perso *p,
+                                  const struct iuu_field *f,
+                                  const char *at, const char *end)
+{
+   size_t n = end - at, i;
+   u_int64_t v = 0;
+
+   memset(p->buf, 0, f->len);
+   switch (f->kind) {
+   case IUU_FIELD_HEX:
+      if (n != 2 * f->len || iuu_image_hex(at, p->buf, f->len) < 0)
+         return IUU_IMAGE_ERROR;
+      break;
+   case IUU_FIELD_TEXT:
+      if (n > f->len)
+         return IUU_IMAGE_ERROR;
+      memcpy(p->buf, at, n);
+      break;
+   case IUU_FIELD_DEC:
+      if (!n)
+         return IUU_IMAGE_ERROR;
+      for (i = 0; i < n; i++) {
+         if (at[i] < '0' || at[i] > '9' || v > (~0ULL - 9) / 10)
+            return IUU_IMAGE_ERROR;
+         v = 10 * v + (at[i] - '0');
+      }
+      if (f->len < 8 && v >> (8 * f->len))
+         return IUU_IMAGE_ERROR;
+      for (i = 0; i < f->len; i++)
+         p->buf[f->len - 1 - i] = v >> (8 * i);
+      break;
+   default:
+      return IUU_IMAGE_ERROR;
+   }
+   return IUU_OPERATION_OK;
+}
+
+// Lays the fields of the next record over the template pages in c->img
+// and encodes them. Sets *got to 0 when there are no records left.
+static iuu_error iuu_perso_build(struct iuu_perso *p,
+                                 struct iuu_perso_card *c, int *got)
+{
+   const char *col[IUU_PERSO_COLUMNS + 1], *at, *eol;
+   iuu_error status;
+   int i, ncol;
+   size_t off;
+
+   *got = 0;
+   iuu_image_reset(&c->img);
+   iuu_stream_reset(&c->s);
+   for (i = 0, status = IUU_OPERATION_OK;
+        i < p->pages.nseg && status == IUU_OPERATION_OK; i++)
+      status = iuu_image_parse(&c->img, (const char *)p->pages.seg[i].data,
+                               p->pages.seg[i].len, IUU_IMAGE_RAW,
+                               p->pages.seg[i].addr);
+   if (status != IUU_OPERATION_OK)
+      return status;
+
+   if (p->flags & IUU_PERSO_BINARY) {
+      if (p->off == p->len)
+         return IUU_OPERATION_OK;
+      if (p->len - p->off < p->reclen)
+         return IUU_IMAGE_ERROR;
+      for (i = 0, off = p->off; i < p->nfield && status == IUU_OPERATION_OK;
+           off += p->field[i++].len)
+         status = iuu_image_parse(&c->img, p->map + off, p->field[i].len,
+                                  IUU_IMAGE_RAW, p->field[i].addr);
+      p->off += p->reclen;
+   } else {
+      // skip blank lines, the last one may lack its newline
+      for (at = p->map + p->off;
+           at < p->map + p->len && (*at == '\n' || *at == '\r'); at++);
+      if (at == p->map + p->len) {
+         p->off = p->len;
+         return IUU_OPERATION_OK;
+      }
+      eol = memchr(at, '\n', p->map + p->len - at);
+      if (!eol)
+         eol = p->map + p->len;
+      p->off = eol - p->map;
+      if (eol > at && eol[-1] == '\r')
+         eol--;
+
+      for (ncol = 0, col[0] = at; ncol < IUU_PERSO_COLUMNS;) {
+         const char *comma = memchr(col[ncol], ',', eol - col[ncol]);
+
+         ncol++;
+         if (!comma)
+            break;
+         col[ncol] = comma + 1;
+      }
+      col[ncol] = eol + 1;
+
+      for (i = 0; i < p->nfield && status == IUU_OPERATION_OK; i++) {
+         const struct iuu_field *f = &p->field[i];
+
+         if (f->column >= ncol)
+            status = IUU_IMAGE_ERROR;
+         else
+            status = iuu_perso_decode(p, f, col[f->column],
+                                      col[f->column + 1] - 1);
+         if (status == IUU_OPERATION_OK)
+            status = iuu_image_parse(&c->img, (const char *)p->buf, f->len,
+                                     IUU_IMAGE_RAW, f->addr);
+      }
+   }
+
+   if (status == IUU_OPERATION_OK)
+      status = iuu_perso_encode(p, &c->s, &c->img, 0);
+   if (status == IUU_OPERATION_OK) {
+      c->record = p->next++;
+      *got = 1;
+   }
+   return status;
+}
+
+// Prepares the cards of the records ahead of their use, going through
+// the record file as it does, so that neither the parsing nor the page
+// faults fall on the readers
+static void *iuu_perso_thread(void *arg)
+{
+   struct iuu_perso *p = arg;
+   iuu_error status;
+   int slot, got;
+
+   pthread_mutex_lock(&p->lock);
+   while (!p->stop && !p->end) {
+      if (!p->nspare) {
+         pthread_cond_wait(&p->room, &p->lock);
+         continue;
+      }
+      slot = p->spare[--p->nspare];
+      pthread_mutex_unlock(&p->lock);
+
+      status = iuu_perso_build(p, &p->card[slot], &got);
+
+      pthread_mutex_lock(&p->lock);
+      if (status != IUU_OPERATION_OK || !got) {
+         if (status != IUU_OPERATION_OK)
+            iuu_process_error(status, __FILE__, __LINE__);
+         p->spare[p->nspare++] = slot;
+         p->status = status;
+         p->end = 1;
+      } else
+         p->ready[(p->rhead + p->nready++) % IUU_PERSO_AHEAD] = slot;
+      pthread_cond_broadcast(&p->more);
+   }
+   pthread_mutex_unlock(&p->lock);
+   return NULL;
+}
+
+// Sets up the personalization of cards programmed as job says with the
+// template image tmpl and the nfield fields of every record of the file
+// at path. Records are the lines of a CSV file, each field taken from
+// its column, or with IUU_PERSO_BINARY back to back records of every
+// field in turn, each len bytes as they are. IUU_PERSO_HEADER skips
+// the first line of a CSV file.
+//
+// The template is encoded once without the pages holding fields (chip
+// pages for EEPROMs, IUU_PERSO_PAGE bytes otherwise). For every card
+// only those pages are encoded again, with its record laid over the
+// template, by a thread working ahead of the readers.
+iuu_error iuu_perso_open(struct iuu_perso **pp, const struct iuu_job *job,
+                         const struct iuu_image *tmpl,
+                         const struct iuu_field *field, int nfield,
+                         const char *path, int flags)
+{
+   struct iuu_segment *run = NULL;
+   struct iuu_perso *p;
+   iuu_error status;
+   u_int32_t page = IUU_PERSO_PAGE;
+   int i, nrun = 0;
+   void *map;
+
+   *pp = NULL;
+   if (nfield < 1) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+   if (job->target == IUU_TARGET_EEPROM && job->eeprom)
+      page = job->eeprom->page;
+   for (i = 0; i < nfield; i++)
+      if (!field[i].len ||
+          (!(flags & IUU_PERSO_BINARY) &&
+           (field[i].column >= IUU_PERSO_COLUMNS ||
+            (field[i].kind == IUU_FIELD_DEC && field[i].len > 8)))) {
+         iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+         return IUU_INVALID_PARAMETER;
+      }
+
+   p = calloc(1, sizeof(*p));
+   if (!p) {
+      iuu_process_error(IUU_OUT_OF_MEMORY, __FILE__, __LINE__);
+      return IUU_OUT_OF_MEMORY;
+   }
+   p->job = *job;
+   p->flags = flags;
+   p->nfield = nfield;
+   iuu_image_init(&p->base, tmpl->fill);
+   iuu_image_init(&p->pages, tmpl->fill);
+   iuu_stream_init(&p->s);
+   pthread_mutex_init(&p->lock, NULL);
+   pthread_cond_init(&p->more, NULL);
+   pthread_cond_init(&p->room, NULL);
+   for (i = 0; i < IUU_PERSO_AHEAD; i++) {
+      iuu_image_init(&p->card[i].img, tmpl->fill);
+      iuu_stream_init(&p->card[i].s);
+      p->spare[p->nspare++] = i;
+   }
+
+   p->field = malloc(nfield * sizeof(*field));
+   status = p->field ? IUU_OPERATION_OK : IUU_OUT_OF_MEMORY;
+   if (status == IUU_OPERATION_OK) {
+      memcpy(p->field, field, nfield * sizeof(*field));
+      for (i = 0; i < nfield; i++) {
+         p->reclen += field[i].len;
+         if (field[i].len > p->maxlen)
+            p->maxlen = field[i].len;
+      }
+      p->buf = malloc(p->maxlen ? p->maxlen : 1);
+      if (!p->buf)
+         status = IUU_OUT_OF_MEMORY;
+   }
+   if (status == IUU_OPERATION_OK)
+      status = iuu_perso_runs(p, page, &run, &nrun);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_perso_split(p, tmpl, run, nrun);
+   free(run);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_perso_encode(p, &p->s, &p->base, 1);
+
+   if (status == IUU_OPERATION_OK)
+      status = iuu_image_map(path, &map, &p->len);
+   if (status == IUU_OPERATION_OK) {
+      p->map = map;
+      if ((flags & IUU_PERSO_HEADER) && !(flags & IUU_PERSO_BINARY)) {
+         char *eol = memchr(p->map, '\n', p->len);
+
+         p->off = eol ? eol + 1 - p->map : p->len;
+      }
+      p->started = !pthread_create(&p->thread, NULL, iuu_perso_thread, p);
+      if (!p->started)
+         status = IUU_OUT_OF_MEMORY;
+   }
+
+   if (status != IUU_OPERATION_OK) {
+      iuu_process_error(status, __FILE__, __LINE__);
+      iuu_perso_close(p);
+      return status;
+   }
+   *pp = p;
+   return IUU_OPERATION_OK;
+}
+
+// Stops the prefetch thread and frees everything. No card may be in
+// use any more.
+void iuu_perso_close(struct iuu_perso *p)
+{
+   int i;
+
+   if (!p)
+      return;
+   if (p->started) {
+      pthread_mutex_lock(&p->lock);
+      p->stop = 1;
+      pthread_cond_broadcast(&p->room);
+      pthread_mutex_unlock(&p->lock);
+      pthread_join(p->thread, NULL);
+   }
+   for (i = 0; i < IUU_PERSO_AHEAD; i++) {
+      iuu_image_free(&p->card[i].img);
+      iuu_stream_free(&p->card[i].s);
+   }
+   iuu_image_unmap(p->map, p->len);
+   iuu_image_free(&p->base);
+   iuu_image_free(&p->pages);
+   iuu_stream_free(&p->s);
+   pthread_cond_destroy(&p->more);
+   pthread_cond_destroy(&p->room);
+   pthread_mutex_destroy(&p->lock);
+   free(p->field);
+   free(p->buf);
+   free(p);
+}
+
+// The template without the pages of the fields and the commands that
+// program it, the same for every card
+const struct iuu_image *iuu_perso_image(const struct iuu_perso *p)
+{
+   return &p->base;
+}
+
+const struct iuu_stream *iuu_perso_stream(const struct iuu_perso *p)
+{
+   return &p->s;
+}
+
+// Takes the next card in record order, waiting for it if it is not
+// ready yet. *card is NULL once there are no records left, or if a
+// record could not be decoded, which is what is returned then.
+iuu_error iuu_perso_next(struct iuu_perso *p, struct iuu_perso_card **card)
+{
+   iuu_error status = IUU_OPERATION_OK;
+
+   pthread_mutex_lock(&p->lock);
+   while (!p->nready && !p->end)
+      pthread_cond_wait(&p->more, &p->lock);
+   if (p->nready) {
+      *card = &p->card[p->ready[p->rhead]];
+      p->rhead = (p->rhead + 1) % IUU_PERSO_AHEAD;
+      p->nready--;
+   } else {
+      *card = NULL;
+      status = p->status;
+   }
+   pthread_mutex_unlock(&p->lock);
+   return status;
+}
+
+// Hands back a card taken with iuu_perso_next()
+void iuu_perso_release(struct iuu_perso *p, struct iuu_perso_card *card)
+{
+   pthread_mutex_lock(&p->lock);
+   p->spare[p->nspare++] = card - p->card;
+   pthread_cond_signal(&p->room);
+   pthread_mutex_unlock(&p->lock);
+}
+
+// Programs the card in the reader of u with the next record: the
+// template stream first, then the pages with its fields. u->record
+// tells which record went in, -1 if there were none left.
+iuu_error iuu_perso_program(struct iuu_gang_unit *u, struct iuu_perso *p,
+                            iuu_gang_progress progress, void *arg)
+{
+   struct iuu_perso_card *card;
+   struct iuu_gang_task task;
+   iuu_error status;
+
+   u->record = -1;
+   u->done = u->total = 0;
+   u->status = iuu_perso_next(p, &card);
+   if (!card)
+      return u->status;
+
+   u->record = card->record;
+   task.s[0] = &p->s;
+   task.s[1] = &card->s;
+   task.img[0] = &p->base;
+   task.img[1] = &card->img;
+   status = iuu_gang_work(u, &p->job, &task, progress, arg);
+   iuu_perso_release(p, card);
+   return status;
+}
+
+// Same as iuu_perso_program() for the n readers of units at once, each
+// with a record of its own, see iuu_gang_program(). Only
+// IUU_PERSO_AHEAD cards are ever encoded, so more readers than that go
+// in batches of that many, one after the other. Readers left without a
+// record get -1 in their record.
+iuu_error iuu_perso_gang(struct iuu_gang_unit *units, int n,
+                         struct iuu_perso *p, iuu_gang_progress progress,
+                         void *arg)
+{
+   struct iuu_perso_card **card;
+   struct iuu_gang_task *task;
+   iuu_error status = IUU_OPERATION_OK;
+   int first, m, i, k;
+
+   card = calloc(IUU_PERSO_AHEAD, sizeof(*card));
+   task = calloc(IUU_PERSO_AHEAD, sizeof(*task));
+   if (!card || !task) {
+      free(card);
+      free(task);
+      iuu_process_error(IUU_OUT_OF_MEMORY, __FILE__, __LINE__);
+      return IUU_OUT_OF_MEMORY;
+   }
+
+   for (k = 0; k < n; k++) {
+      units[k].record = -1;
+      units[k].done = units[k].total = 0;
+      units[k].status = IUU_OPERATION_OK;
+   }
+
+   for (first = 0; first < n && status == IUU_OPERATION_OK; first += m) {
+      m = n - first < IUU_PERSO_AHEAD ? n - first : IUU_PERSO_AHEAD;
+      for (k = 0; k < m; k++) {
+         status = iuu_perso_next(p, &card[k]);
+         if (!card[k])
+            break;
+         units[first + k].record = card[k]->record;
+         task[k].s[0] = &p->s;
+         task[k].s[1] = &card[k]->s;
+         task[k].img[0] = &p->base;
+         task[k].img[1] = &card[k]->img;
+      }
+
+      if (k) {
+         iuu_error st = iuu_gang_run(units + first, k, &p->job, task,
+                                     progress, arg);
+
+         if (status == IUU_OPERATION_OK)
+            status = st;
+      }
+
+      for (i = 0; i < k; i++)
+         iuu_perso_release(p, card[i]);
+      // out of records
+      if (k < m)
+         break;
+   }
+
+   free(card);
+   free(task);
+   return status;
+}
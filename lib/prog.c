@@ -0,0 +1,748 @@
+/*
+ *  iuutool - a port of WBE's Infinity USB Unlimited SDK
+ * 
+ *  Copyright (C) 2006 Juan Carlos Borrs
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as 
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+
+#include <stdio.h>
+#include <usb.h>
+
+#include <iuu.h>
+#include "iuu_priv.h"
+
+// 14 bit PIC16F8x. Cards using the A parts (16F87xA) program rows of
+// 8 words and are not supported.
+const struct iuu_pic_chip iuu_pic_chips[] = {
+   {"16F84", 1024, 64, IUU_ICSP_ERASE_PROG, 10000, 10},
+   {"16F84A", 1024, 64, IUU_ICSP_ERASE_PROG, 4000, 10},
+   {"16F628", 2048, 128, IUU_ICSP_ERASE_PROG, 8000, 10},
+   {"16F873", 4096, 128, IUU_ICSP_PROG, 4000, 8},
+   {"16F874", 4096, 128, IUU_ICSP_PROG, 4000, 8},
+   {"16F876", 8192, 256, IUU_ICSP_PROG, 4000, 8},
+   {"16F877", 8192, 256, IUU_ICSP_PROG, 4000, 8},
+   {NULL, 0, 0, 0, 0, 0}
+};
+
+// Returns the profile of the PIC called name (e.g. "16F84"), or NULL
+// if we do not know about it
+const struct iuu_pic_chip *iuu_pic_chip(const char *name)
+{
+   const struct iuu_pic_chip *chip;
+
+   for (chip = iuu_pic_chips; chip->name; chip++)
+      if (!strcasecmp(chip->name, name))
+         return chip;
+   return NULL;
+}
+
+// Starts tracking the program counter of an AVR or PIC card, which is
+// unknown until the first seek resets it
+void iuu_cursor_init(struct iuu_cursor *c, iuu_cursor_target target)
+{
+   if (target == IUU_CURSOR_PIC) {
+      c->reset = IUU_PIC_RESET;
+      c->inc = IUU_PIC_INC_PC;
+      c->incn = IUU_PIC_INCN_PC;
+   } else {
+      c->reset = IUU_AVR_RESET_PC;
+      c->inc = IUU_AVR_INC_PC;
+      c->incn = IUU_AVR_INCN_PC;
+   }
+   c->target = target;
+   c->valid = 0;
+   c->pc = 0;
+}
+
+// Tells the cursor that the program counter has moved n words on, as
+// reads and writes do
+void iuu_cursor_advance(struct iuu_cursor *c, u_int32_t n)
+{
+   c->pc += n;
+}
+
+// Bytes of commands it takes to move the counter forward d words
+static u_int32_t iuu_cursor_steps(u_int32_t d)
+{
+   return 2 * (d / 0xFF) + (d % 0xFF > 1 ? 2 : d % 0xFF);
+}
+
+// Bytes of commands iuu_cursor_encode() needs to get to word to
+u_int32_t iuu_cursor_cost(const struct iuu_cursor *c, u_int32_t to)
+{
+   if (c->valid && to >= c->pc)
+      return iuu_cursor_steps(to - c->pc);
+   return 1 + iuu_cursor_steps(to);
+}
+
+// Adds to s the shortest sequence of commands that takes the program
+// counter to word to. The counter can only be reset or incremented so
+// going back, or anywhere when it is not known, takes a reset first.
+// Whatever is added to s next goes in the same transfer if it fits.
+iuu_error iuu_cursor_encode(struct iuu_stream *s, struct iuu_cursor *c,
+                            u_int32_t to)
+{
+   u_int8_t cmd[2];
+   iuu_error status = IUU_OPERATION_OK;
+
+   if (!c->valid || to < c->pc) {
+      status = iuu_stream_add(s, &c->reset, 1);
+      c->valid = 1;
+      c->pc = 0;
+   }
+   while (c->pc < to && status == IUU_OPERATION_OK) {
+      u_int32_t n = to - c->pc > 0xFF ? 0xFF : to - c->pc;
+
+      if (n == 1)
+         status = iuu_stream_add(s, &c->inc, 1);
+      else {
+         cmd[0] = c->incn;
+         cmd[1] = n;
+         status = iuu_stream_add(s, cmd, 2);
+      }
+      c->pc += n;
+   }
+
+   if (status != IUU_OPERATION_OK)
+      c->valid = 0;
+   return status;
+}
+
+// Sends s, then frees it, and reads len bytes of answer to data
+static iuu_error iuu_cursor_send(iuu * inf, struct iuu_stream *s,
+                                 struct iuu_cursor *c, u_int8_t * data,
+                                 int len)
+{
+   iuu_error status;
+
+   status = iuu_stream_send(inf, s);
+   if (status == IUU_OPERATION_OK && len)
+      status = iuu_read_all(inf, data, len);
+   if (status != IUU_OPERATION_OK) {
+      c->valid = 0;
+      iuu_process_error(status, __FILE__, __LINE__);
+   }
+
+   iuu_stream_free(s);
+   return status;
+}
+
+// Reads n words of program memory of an AVR card starting at word addr,
+// seeking there in the same transfer
+iuu_error iuu_avr_read_at(iuu * inf, struct iuu_cursor *c, u_int32_t addr,
+                          u_int8_t * data, u_int8_t n)
+{
+   struct iuu_stream s;
+   iuu_error status;
+   u_int8_t cmd[2] = { IUU_AVR_PREADN, n };
+
+   iuu_stream_init(&s);
+   status = iuu_cursor_encode(&s, c, addr);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_stream_add(&s, cmd, 2);
+   if (status != IUU_OPERATION_OK) {
+      iuu_stream_free(&s);
+      iuu_process_error(status, __FILE__, __LINE__);
+      return status;
+   }
+   iuu_cursor_advance(c, n);
+   return iuu_cursor_send(inf, &s, c, data, 2 * n);
+}
+
+// Writes n words (at most IUU_AVR_PWRITEN_MAX) to program memory of an
+// AVR card starting at word addr, seeking there in the same transfer
+iuu_error iuu_avr_write_at(iuu * inf, struct iuu_cursor *c, u_int32_t addr,
+                           const u_int8_t * data, u_int8_t n)
+{
+   struct iuu_stream s;
+   iuu_error status;
+   u_int8_t cmd[IUU_USB_MAX_PAYLOAD];
+
+   if (n > IUU_AVR_PWRITEN_MAX) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+
+   cmd[0] = IUU_AVR_PWRITEN;
+   cmd[1] = n;
+   memcpy(cmd + 2, data, 2 * n);
+
+   iuu_stream_init(&s);
+   status = iuu_cursor_encode(&s, c, addr);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_stream_add(&s, cmd, 2 + 2 * n);
+   if (status != IUU_OPERATION_OK) {
+      iuu_stream_free(&s);
+      iuu_process_error(status, __FILE__, __LINE__);
+      return status;
+   }
+   iuu_cursor_advance(c, n);
+   return iuu_cursor_send(inf, &s, c, NULL, 0);
+}
+
+// Reads n words of program memory of a PIC card starting at word addr,
+// seeking there in the same transfer
+iuu_error iuu_pic_read_at(iuu * inf, struct iuu_cursor *c, u_int32_t addr,
+                          u_int8_t * data, u_int8_t n)
+{
+   struct iuu_stream s;
+   iuu_error status;
+   u_int8_t cmd[2] = { IUU_PIC_PREADN, n };
+
+   iuu_stream_init(&s);
+   status = iuu_cursor_encode(&s, c, addr);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_stream_add(&s, cmd, 2);
+   if (status != IUU_OPERATION_OK) {
+      iuu_stream_free(&s);
+      iuu_process_error(status, __FILE__, __LINE__);
+      return status;
+   }
+   iuu_cursor_advance(c, n);
+   return iuu_cursor_send(inf, &s, c, data, 2 * n);
+}
+
+// Writes n words to program memory of a PIC card starting at word
+// addr, seeking there first. There is no multiple word write for PICs
+// so every word takes an IUU_PIC_PWRITE, as many as fit per transfer.
+iuu_error iuu_pic_write_at(iuu * inf, struct iuu_cursor *c, u_int32_t addr,
+                           const u_int8_t * data, u_int8_t n)
+{
+   struct iuu_stream s;
+   iuu_error status;
+   u_int8_t cmd[3];
+   int i;
+
+   iuu_stream_init(&s);
+   status = iuu_cursor_encode(&s, c, addr);
+   for (i = 0; i < n && status == IUU_OPERATION_OK; i++) {
+      cmd[0] = IUU_PIC_PWRITE;
+      cmd[1] = data[2 * i];
+      cmd[2] = data[2 * i + 1];
+      status = iuu_stream_add(&s, cmd, 3);
+   }
+   if (status != IUU_OPERATION_OK) {
+      iuu_stream_free(&s);
+      iuu_process_error(status, __FILE__, __LINE__);
+      return status;
+   }
+   iuu_cursor_advance(c, n);
+   return iuu_cursor_send(inf, &s, c, NULL, 0);
+}
+
+// Builds in s the commands that program the flash of an AVR card with
+// img, whose addresses are in bytes as in the usual hex files. Words go
+// in IUU_AVR_PWRITEN commands as long as a transfer allows and gaps
+// between segments are skipped by moving the program counter with c.
+// The other byte of a word only half covered by img reads as its fill.
+iuu_error iuu_avr_encode(struct iuu_stream *s, struct iuu_cursor *c,
+                         const struct iuu_image *img)
+{
+   u_int8_t cmd[IUU_USB_MAX_PAYLOAD];
+   iuu_error status = IUU_OPERATION_OK;
+   u_int32_t w, end;
+   int i;
+
+   for (i = 0; i < img->nseg && status == IUU_OPERATION_OK; i++) {
+      w = img->seg[i].addr / 2;
+      end = ((u_int64_t) img->seg[i].addr + img->seg[i].len + 1) / 2;
+
+      status = iuu_cursor_encode(s, c, w);
+      while (w < end && status == IUU_OPERATION_OK) {
+         u_int32_t n = end - w;
+
+         if (n > IUU_AVR_PWRITEN_MAX)
+            n = IUU_AVR_PWRITEN_MAX;
+         cmd[0] = IUU_AVR_PWRITEN;
+         cmd[1] = n;
+         iuu_image_flatten(img, 2 * w, 2 * n, cmd + 2);
+         status = iuu_stream_add(s, cmd, 2 + 2 * n);
+         iuu_cursor_advance(c, n);
+         w += n;
+      }
+   }
+   return status;
+}
+
+// Programs the flash of an AVR card with img, see iuu_avr_encode().
+// The card is expected to be powered and in programming mode.
+iuu_error iuu_avr_program(iuu * inf, const struct iuu_image *img)
+{
+   struct iuu_stream s;
+   struct iuu_cursor c;
+   iuu_error status;
+
+   iuu_cursor_init(&c, IUU_CURSOR_AVR);
+   iuu_stream_init(&s);
+   status = iuu_avr_encode(&s, &c, img);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_stream_send(inf, &s);
+   if (status != IUU_OPERATION_OK)
+      iuu_process_error(status, __FILE__, __LINE__);
+
+   iuu_stream_free(&s);
+   return status;
+}
+
+// Reads of program or data memory queued in a transfer, see
+// iuu_prog_pipe()
+struct iuu_prog_batch {
+   struct {
+      int seg;                  // segment the words are for
+      u_int32_t unit;           // first one, in words or bytes
+      u_int32_t n;              // how many
+   } piece[IUU_PROG_PIECES];
+   int npiece;
+   size_t reply;                // bytes the IUU will answer
+};
+
+// Queues in the IUU reads for the next units of seg from *si and *su
+// on, as many as make half the read size, which with some seeks in
+// between still take a transfer or two
+static iuu_error iuu_prog_queue(iuu * inf, struct iuu_cursor *c,
+                                iuu_space space,
+                                const struct iuu_segment *seg, int nseg,
+                                int *si, u_int32_t * su,
+                                struct iuu_prog_batch *b)
+{
+   struct iuu_stream s;
+   iuu_error status = IUU_OPERATION_OK;
+   u_int8_t cmd[2];
+   size_t unit = (space == IUU_SPACE_DATA && c->target == IUU_CURSOR_AVR)
+       ? 1 : 2;
+   u_int32_t end, n, i;
+
+   b->npiece = 0;
+   b->reply = 0;
+   iuu_stream_init(&s);
+
+   while (*si < nseg && b->npiece < IUU_PROG_PIECES &&
+          status == IUU_OPERATION_OK) {
+      end = ((u_int64_t) seg[*si].addr + seg[*si].len + unit - 1) / unit;
+      n = end - *su;
+      if (n > 0xFF)
+         n = 0xFF;
+      if (n > (IUU_USB_MAX_READ / 2 - b->reply) / unit)
+         n = (IUU_USB_MAX_READ / 2 - b->reply) / unit;
+      if (!n)
+         break;
+
+      status = iuu_cursor_encode(&s, c, *su);
+      if (space == IUU_SPACE_PROGRAM || c->target == IUU_CURSOR_AVR) {
+         cmd[0] = space == IUU_SPACE_DATA ? IUU_AVR_DREADN :
+             (c->target == IUU_CURSOR_PIC ? IUU_PIC_PREADN :
+              IUU_AVR_PREADN);
+         cmd[1] = n;
+         if (status == IUU_OPERATION_OK)
+            status = iuu_stream_add(&s, cmd, 2);
+      } else {
+         // PIC data memory has to be read a word at a time
+         cmd[0] = IUU_PIC_DREAD;
+         for (i = 0; i < n && status == IUU_OPERATION_OK; i++)
+            status = iuu_stream_add(&s, cmd, 1);
+      }
+      iuu_cursor_advance(c, n);
+
+      b->piece[b->npiece].seg = *si;
+      b->piece[b->npiece].unit = *su;
+      b->piece[b->npiece++].n = n;
+      b->reply += n * unit;
+
+      *su += n;
+      if (*su == end && ++*si < nseg)
+         *su = seg[*si].addr / unit;
+   }
+
+   if (status == IUU_OPERATION_OK)
+      status = iuu_stream_send(inf, &s);
+   if (status != IUU_OPERATION_OK)
+      c->valid = 0;
+   iuu_stream_free(&s);
+   return status;
+}
+
+// Reads back the nseg segments of seg from program or data memory of
+// the card c points to. With out set, what is read is laid out there
+// as in a single segment; otherwise it is compared with the segments
+// and mismatches go to m. Two batches of reads are kept queued in the
+// IUU so that the card is being read while the host copies or compares.
+// Addresses are in bytes and hold words except for AVR data memory.
+static iuu_error iuu_prog_pipe(iuu * inf, struct iuu_cursor *c,
+                               iuu_space space,
+                               const struct iuu_segment *seg, int nseg,
+                               u_int8_t * out, struct iuu_mismatch_map *m)
+{
+   struct iuu_prog_batch b[2];
+   u_int8_t buf[IUU_USB_MAX_READ / 2];
+   iuu_error status = IUU_OPERATION_OK;
+   size_t unit = (space == IUU_SPACE_DATA && c->target == IUU_CURSOR_AVR)
+       ? 1 : 2;
+   u_int32_t su = nseg ? seg[0].addr / unit : 0;
+   size_t off;
+   int si = 0, q = 0, i;
+
+   for (;;) {
+      while (q < 2 && si < nseg && !(m && m->full)) {
+         status = iuu_prog_queue(inf, c, space, seg, nseg, &si, &su,
+                                 &b[q]);
+         if (status != IUU_OPERATION_OK)
+            return status;
+         q++;
+      }
+      if (!q)
+         return IUU_OPERATION_OK;
+
+      status = iuu_read_all(inf, buf, b[0].reply);
+      if (status != IUU_OPERATION_OK) {
+         c->valid = 0;
+         return status;
+      }
+      // only the bytes of a word that are in a segment count
+      for (i = 0, off = 0; i < b[0].npiece; i++) {
+         const struct iuu_segment *sg = &seg[b[0].piece[i].seg];
+         u_int64_t from = (u_int64_t) b[0].piece[i].unit * unit;
+         u_int64_t lo = from > sg->addr ? from : sg->addr;
+         u_int64_t hi = from + b[0].piece[i].n * unit;
+
+         if (hi > (u_int64_t) sg->addr + sg->len)
+            hi = (u_int64_t) sg->addr + sg->len;
+         if (out)
+            memcpy(out + (lo - seg[0].addr), buf + off + (lo - from),
+                   hi - lo);
+         else
+            iuu_mismatch_scan(m, lo, buf + off + (lo - from),
+                              sg->data + (lo - sg->addr), hi - lo);
+         off += b[0].piece[i].n * unit;
+      }
+
+      b[0] = b[1];
+      q--;
+      // once stopped just drain what is left queued
+      if (m && m->full && q) {
+         status = iuu_read_all(inf, buf, b[0].reply);
+         if (status != IUU_OPERATION_OK)
+            c->valid = 0;
+         return status;
+      }
+   }
+}
+
+// Reads len bytes of program or data memory of the card c points to,
+// starting at byte addr, with reads for what comes next already queued
+// while the previous ones are copied. See iuu_prog_pipe() for addresses.
+iuu_error iuu_prog_read(iuu * inf, struct iuu_cursor *c, iuu_space space,
+                        u_int32_t addr, size_t len, u_int8_t * data)
+{
+   struct iuu_segment seg;
+   iuu_error status;
+
+   seg.addr = addr;
+   seg.len = len;
+   seg.data = NULL;
+   status = iuu_prog_pipe(inf, c, space, &seg, len ? 1 : 0, data, NULL);
+   if (status != IUU_OPERATION_OK)
+      iuu_process_error(status, __FILE__, __LINE__);
+   return status;
+}
+
+// Checks that program or data memory of the card c points to holds img,
+// reading it back as iuu_prog_read() does and comparing it while the
+// next reads are on their way. Runs of differing bytes go to map, up to
+// maxmap of them, and their number to nmap. It stops at the first
+// mismatch that does not fit in map. Returns IUU_VERIFY_FAILED on any
+// mismatch.
+iuu_error iuu_prog_verify(iuu * inf, struct iuu_cursor *c, iuu_space space,
+                          const struct iuu_image *img,
+                          struct iuu_mismatch *map, int maxmap, int *nmap)
+{
+   struct iuu_mismatch_map m;
+   iuu_error status;
+
+   iuu_mismatch_init(&m, map, maxmap);
+   status = iuu_prog_pipe(inf, c, space, img->seg, img->nseg, NULL, &m);
+   if (nmap)
+      *nmap = m.n;
+   if (status != IUU_OPERATION_OK) {
+      iuu_process_error(status, __FILE__, __LINE__);
+      return status;
+   }
+   return m.n || m.full ? IUU_VERIFY_FAILED : IUU_OPERATION_OK;
+}
+
+// Adds to s an ICSP load of word with command load followed by command
+// cmd, leaving out either of them if it is 0xFF
+static iuu_error iuu_pic_icsp(struct iuu_stream *s, u_int8_t load,
+                              u_int16_t word, u_int8_t cmd)
+{
+   u_int8_t buf[6];
+   int len = 0;
+
+   if (load != 0xFF) {
+      buf[len++] = IUU_PIC_CMD_LOAD;
+      buf[len++] = load;
+      buf[len++] = (u_int8_t) (word & 0x00FF);
+      buf[len++] = (u_int8_t) ((word >> 8) & 0x00FF);
+   }
+   if (cmd != 0xFF) {
+      buf[len++] = IUU_PIC_CMD;
+      buf[len++] = cmd;
+   }
+   return iuu_stream_add(s, buf, len);
+}
+
+// Adds to s a reset and a load configuration, which is the only way to
+// the configuration memory. From then on c counts from its first word.
+static iuu_error iuu_pic_enter_config(struct iuu_stream *s,
+                                      struct iuu_cursor *c)
+{
+   iuu_error status;
+
+   c->valid = 0;
+   status = iuu_cursor_encode(s, c, 0);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_pic_icsp(s, IUU_ICSP_LOAD_CONFIG, IUU_PIC_ERASED, 0xFF);
+   return status;
+}
+
+// Adds to s the program cycles that write the words of view, in units
+// of unit bytes, with ICSP load command load. Words left erased by a
+// bulk erase are skipped with the program counter. The cycle and the
+// increment after it go in the same command burst, so a transfer
+// carries a couple dozen words.
+static iuu_error iuu_pic_words(struct iuu_stream *s, struct iuu_cursor *c,
+                               const struct iuu_pic_chip *chip,
+                               const struct iuu_image *view, u_int8_t load,
+                               u_int16_t erased)
+{
+   iuu_error status = IUU_OPERATION_OK;
+   u_int32_t w, end;
+   u_int8_t b[2];
+   u_int16_t word;
+   int i;
+
+   for (i = 0; i < view->nseg && status == IUU_OPERATION_OK; i++) {
+      w = view->seg[i].addr / 2;
+      end = ((u_int64_t) view->seg[i].addr + view->seg[i].len + 1) / 2;
+
+      for (; w < end && status == IUU_OPERATION_OK; w++) {
+         iuu_image_flatten(view, 2 * w, 2, b);
+         word = b[0] | (b[1] << 8);
+         if ((word & erased) == erased)
+            continue;
+
+         status = iuu_cursor_encode(s, c, w);
+         if (status == IUU_OPERATION_OK)
+            status = iuu_pic_icsp(s, load, word, chip->prog);
+         if (status == IUU_OPERATION_OK)
+            status = iuu_stream_wait(s, chip->tprog);
+         if (status == IUU_OPERATION_OK)
+            status = iuu_pic_icsp(s, 0xFF, 0, IUU_ICSP_INC);
+         iuu_cursor_advance(c, 1);
+      }
+   }
+   return status;
+}
+
+// Makes view hold the segments of img between byte addresses from and
+// to, moved down by from. It shares the data of img.
+static iuu_error iuu_pic_view(const struct iuu_image *img, u_int32_t from,
+                              u_int32_t to, struct iuu_image *view)
+{
+   int i;
+
+   iuu_image_init(view, img->fill);
+   view->seg = malloc((img->nseg ? img->nseg : 1) * sizeof(*view->seg));
+   if (!view->seg)
+      return IUU_OUT_OF_MEMORY;
+   view->maxseg = img->nseg;
+
+   for (i = 0; i < img->nseg; i++) {
+      u_int64_t lo = img->seg[i].addr, hi = lo + img->seg[i].len;
+
+      if (lo < from)
+         lo = from;
+      if (hi > to)
+         hi = to;
+      if (lo >= hi)
+         continue;
+      view->seg[view->nseg].addr = lo - from;
+      view->seg[view->nseg].len = hi - lo;
+      view->seg[view->nseg++].data = img->seg[i].data +
+          (lo - img->seg[i].addr);
+   }
+   return IUU_OPERATION_OK;
+}
+
+// Splits img, as given by an INHX8M hex file, in views of program
+// memory from 0, IDs and configuration word at 0x4000 and data EEPROM
+// at 0x4200 (every byte of it in a word of its own), each starting at 0
+static iuu_error iuu_pic_split(const struct iuu_pic_chip *chip,
+                               const struct iuu_image *img,
+                               struct iuu_image *view)
+{
+   iuu_error status;
+
+   memset(view, 0, 3 * sizeof(*view));
+   status = iuu_pic_view(img, 0, 2 * chip->psize, &view[0]);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_pic_view(img, 2 * IUU_PIC_DATA_ADDR,
+                            2 * (IUU_PIC_DATA_ADDR + chip->dsize), &view[1]);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_pic_view(img, 2 * IUU_PIC_CONFIG_ADDR,
+                            2 * (IUU_PIC_CONFIG_ADDR +
+                                 IUU_PIC_CONFIG_WORDS), &view[2]);
+   return status;
+}
+
+// Bulk erases program and data memory
+static iuu_error iuu_pic_erase(struct iuu_stream *s,
+                               const struct iuu_pic_chip *chip)
+{
+   iuu_error status;
+
+   status = iuu_pic_icsp(s, IUU_ICSP_LOAD_PROG, IUU_PIC_ERASED,
+                         IUU_ICSP_BULK_ERASE_PROG);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_pic_icsp(s, 0xFF, 0, IUU_ICSP_ERASE_PROG);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_stream_wait(s, chip->terase * 1000);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_pic_icsp(s, IUU_ICSP_LOAD_DATA, 0x00FF,
+                            IUU_ICSP_BULK_ERASE_DATA);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_pic_icsp(s, 0xFF, 0, IUU_ICSP_ERASE_PROG);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_stream_wait(s, chip->terase * 1000);
+   return status;
+}
+
+// Builds in s the commands that program a PIC16F8x card with img, see
+// iuu_pic_split(). With IUU_PIC_MEMORY both memories are bulk erased,
+// unless IUU_PIC_NOERASE is also given, and written with bursts of
+// ICSP commands timed by the IUU as chip says. With IUU_PIC_CONFIG the
+// IDs and configuration word are written, which should go last so that
+// code protection does not get in the way of anything else.
+iuu_error iuu_pic_encode(struct iuu_stream *s, const struct iuu_pic_chip *chip,
+                         const struct iuu_image *img, int what)
+{
+   struct iuu_image view[3];
+   struct iuu_cursor c;
+   iuu_error status;
+
+   iuu_cursor_init(&c, IUU_CURSOR_PIC);
+   status = iuu_pic_split(chip, img, view);
+
+   if (status == IUU_OPERATION_OK && (what & IUU_PIC_MEMORY)) {
+      status = iuu_cursor_encode(s, &c, 0);
+      if (status == IUU_OPERATION_OK && !(what & IUU_PIC_NOERASE))
+         status = iuu_pic_erase(s, chip);
+      if (status == IUU_OPERATION_OK)
+         status = iuu_pic_words(s, &c, chip, &view[0], IUU_ICSP_LOAD_PROG,
+                                IUU_PIC_ERASED);
+      // data memory is addressed by the low bits of the counter
+      c.valid = 0;
+      if (status == IUU_OPERATION_OK)
+         status = iuu_pic_words(s, &c, chip, &view[1], IUU_ICSP_LOAD_DATA,
+                                0x00FF);
+   }
+
+   if (status == IUU_OPERATION_OK && (what & IUU_PIC_CONFIG) &&
+       view[2].nseg) {
+      status = iuu_pic_enter_config(s, &c);
+      if (status == IUU_OPERATION_OK)
+         status = iuu_pic_words(s, &c, chip, &view[2], IUU_ICSP_LOAD_PROG,
+                                IUU_PIC_ERASED);
+   }
+
+   free(view[0].seg);
+   free(view[1].seg);
+   free(view[2].seg);
+   return status;
+}
+
+// Reads back the memories of a PIC16F8x card chosen by what, as in
+// iuu_pic_encode(), and checks that they hold img. Returns
+// IUU_VERIFY_FAILED if they do not.
+iuu_error iuu_pic_verify(iuu * inf, const struct iuu_pic_chip *chip,
+                         const struct iuu_image *img, int what)
+{
+   struct iuu_image view[3];
+   struct iuu_stream s;
+   struct iuu_cursor c;
+   iuu_error status;
+
+   iuu_cursor_init(&c, IUU_CURSOR_PIC);
+   iuu_stream_init(&s);
+   status = iuu_pic_split(chip, img, view);
+
+   if (status == IUU_OPERATION_OK && (what & IUU_PIC_MEMORY)) {
+      status = iuu_prog_verify(inf, &c, IUU_SPACE_PROGRAM, &view[0], NULL,
+                               0, NULL);
+      c.valid = 0;
+      if (status == IUU_OPERATION_OK)
+         status = iuu_prog_verify(inf, &c, IUU_SPACE_DATA, &view[1], NULL,
+                                  0, NULL);
+   }
+
+   if (status == IUU_OPERATION_OK && (what & IUU_PIC_CONFIG) &&
+       view[2].nseg) {
+      status = iuu_pic_enter_config(&s, &c);
+      if (status == IUU_OPERATION_OK)
+         status = iuu_stream_send(inf, &s);
+      if (status == IUU_OPERATION_OK)
+         status = iuu_prog_verify(inf, &c, IUU_SPACE_PROGRAM, &view[2],
+                                  NULL, 0, NULL);
+   }
+
+   if (status != IUU_OPERATION_OK && status != IUU_VERIFY_FAILED)
+      iuu_process_error(status, __FILE__, __LINE__);
+   free(view[0].seg);
+   free(view[1].seg);
+   free(view[2].seg);
+   iuu_stream_free(&s);
+   return status;
+}
+
+// Programs a PIC16F8x card with img, as iuu_pic_encode() does, the
+// configuration only once the rest is written and, with
+// IUU_PIC_VERIFY, verified. The card is expected to be on, see
+// iuu_pic_on().
+iuu_error iuu_pic_program(iuu * inf, const struct iuu_pic_chip *chip,
+                          const struct iuu_image *img, int flags)
+{
+   struct iuu_stream s;
+   iuu_error status;
+   int part, parts[2] = { IUU_PIC_MEMORY, IUU_PIC_CONFIG };
+
+   iuu_stream_init(&s);
+   for (part = 0, status = IUU_OPERATION_OK;
+        part < 2 && status == IUU_OPERATION_OK; part++) {
+      iuu_stream_reset(&s);
+      status = iuu_pic_encode(&s, chip, img, parts[part]);
+      if (status == IUU_OPERATION_OK)
+         status = iuu_stream_send(inf, &s);
+      if (status == IUU_OPERATION_OK && (flags & IUU_PIC_VERIFY))
+         status = iuu_pic_verify(inf, chip, img, parts[part]);
+   }
+
+   if (status != IUU_OPERATION_OK && status != IUU_VERIFY_FAILED)
+      iuu_process_error(status, __FILE__, __LINE__);
+   iuu_stream_free(&s);
+   return status;
+}
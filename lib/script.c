@@ -0,0 +1,1027 @@
+/*
+ *  iuutool - a port of WBE's Infinity USB Unlimited SDK
+ * 
+ *  Copyright (C) 2006 Juan Carlos Borrs
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as 
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <usb.h>
+
+#include <iuu.h>
+#include "iuu_priv.h"
+
+/*
+ Command scripts: a line based language for reader recipes, compiled
+ into a card sequence (see seq.c) so that they run in as few transfers
+ as their answers allow. Blank lines and anything after a '#' are
+ ignored, keywords and command names go in any case.
+
+   param NAME VALUE     default of $NAME, which callers can override
+   write XX XX ...      raw IUU commands, as typed in iuuterm
+   NAME XX ...          a command of enum iuu_command by its name
+                        (e.g. RST_SET, set_led 00 00 ...) and its
+                        argument bytes
+   vcc 5 | 3            card supply
+   clk HZ               programs the card clock
+   clock HZ             card clock waits are worked out from
+   etu F D              ISO7816 F and D of the etu
+   rst on | off
+   atr [MS]             card reset and ATR, MS more milliseconds for slow
+                        cards, see iuu_seq_atr()
+   wait N [us|ms|clk|etu]
+   egt N                etus to wait after every byte of the next tx
+   tx XX XX ...         bytes sent to the card
+   rx                   what the card sent so far
+   repeat N ... end     the lines in between N times
+
+ Bytes are hex, one or more per word ("00 a4", "00a4", "0x00a4");
+ other numbers are decimal unless they start with 0x. A word $NAME
+ stands for the value of a parameter. Commands that answer get their
+ answers read, in script order, see iuu_script_answer().
+
+ A compiled script is kept in the cache directory, if any, under the
+ hash of its text and parameters, so it is only compiled once.
+*/
+
+// A command of enum iuu_command as scripts know it. Commands taking a
+// run of items have its count in argument byte count (from 1), every
+// item taking more argument bytes and each bytes of answer.
+struct iuu_script_op {
+   const char *name;
+   u_int8_t code;
+   u_int8_t args;               // argument bytes
+   u_int8_t answer;             // answer bytes
+   u_int8_t count;
+   u_int8_t more;
+   u_int8_t each;
+};
+
+#define IUU_SCRIPT_OP(name, args, answer, count, more, each) \
+   { #name, IUU_ ## name, args, answer, count, more, each }
+
+static const struct iuu_script_op script_ops[] = {
+   IUU_SCRIPT_OP(NO_OPERATION, 0, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(GET_FIRMWARE_VERSION, 0, 4, 0, 0, 0),
+   IUU_SCRIPT_OP(GET_PRODUCT_NAME, 0, 16, 0, 0, 0),
+   IUU_SCRIPT_OP(GET_STATE_REGISTER, 0, 1, 0, 0, 0),
+   IUU_SCRIPT_OP(SET_LED, 7, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(WAIT_MUS, 1, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(WAIT_MS, 1, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(GET_LOADER_VERSION, 0, 4, 0, 0, 0),
+   IUU_SCRIPT_OP(RST_SET, 0, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(RST_CLEAR, 0, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(SET_VCC, 1, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(UART_ENABLE, 3, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(UART_DISABLE, 0, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(UART_WRITE_I2C, 3, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(UART_ESC, 0, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(UART_TRAP, 2, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(UART_TRAP_BREAK, 2, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(UART_RX, 0, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(AVR_ON, 0, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(AVR_OFF, 0, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(AVR_1CLK, 0, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(AVR_RESET, 0, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(AVR_RESET_PC, 0, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(AVR_INC_PC, 0, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(AVR_INCN_PC, 1, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(AVR_PREAD, 0, 2, 0, 0, 0),
+   IUU_SCRIPT_OP(AVR_PREADN, 1, 0, 1, 0, 2),
+   IUU_SCRIPT_OP(AVR_PWRITE, 2, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(AVR_DREAD, 0, 1, 0, 0, 0),
+   IUU_SCRIPT_OP(AVR_DREADN, 1, 0, 1, 0, 1),
+   IUU_SCRIPT_OP(AVR_DWRITE, 1, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(AVR_PWRITEN, 1, 0, 1, 2, 0),
+   IUU_SCRIPT_OP(EEPROM_ON, 0, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(EEPROM_OFF, 0, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(EEPROM_WRITE, 3, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(EEPROM_WRITEX, 4, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(EEPROM_WRITE8, 10, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(EEPROM_WRITE16, 18, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(EEPROM_WRITEX32, 35, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(EEPROM_WRITEX64, 67, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(EEPROM_READ, 2, 1, 0, 0, 0),
+   IUU_SCRIPT_OP(EEPROM_READX, 3, 1, 0, 0, 0),
+   IUU_SCRIPT_OP(EEPROM_BREAD, 3, 0, 3, 0, 1),
+   IUU_SCRIPT_OP(EEPROM_BREADX, 4, 0, 4, 0, 1),
+   IUU_SCRIPT_OP(PIC_CMD, 1, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(PIC_CMD_LOAD, 3, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(PIC_CMD_READ, 1, 1, 0, 0, 0),
+   IUU_SCRIPT_OP(PIC_ON, 0, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(PIC_OFF, 0, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(PIC_RESET, 0, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(PIC_INC_PC, 0, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(PIC_INCN_PC, 1, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(PIC_PWRITE, 2, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(PIC_PREAD, 0, 2, 0, 0, 0),
+   IUU_SCRIPT_OP(PIC_PREADN, 1, 0, 1, 0, 2),
+   IUU_SCRIPT_OP(PIC_DWRITE, 2, 0, 0, 0, 0),
+   IUU_SCRIPT_OP(PIC_DREAD, 0, 2, 0, 0, 0),
+   {NULL, 0, 0, 0, 0, 0, 0}
+};
+
+// Where the answer of a command of a script goes
+struct iuu_script_answer {
+   int mark;                    // of the sequence
+   size_t off;                  // in the answer memory
+   int len;                     // bytes, the most for an RX
+   int rx;                      // an RX or ATR, of varying length
+   u_int8_t rxlen;              // bytes it got
+};
+
+// A parameter declared by a script
+struct iuu_script_param {
+   const char *name, *value;
+   int nlen, vlen;
+};
+
+// A line of a script with something on it
+struct iuu_script_line {
+   const char *p, *end;
+   int no;
+};
+
+struct iuu_script {
+   struct iuu_seq q;
+   struct iuu_script_answer *ans;
+   int nans, maxans;
+   u_int8_t *mem;               // answers
+   size_t size;
+   // While compiling
+   const char *const *params;   // "NAME=VALUE" given by the caller
+   struct iuu_script_param decl[IUU_SCRIPT_PARAMS];
+   int ndecl;
+   u_int8_t egt;
+   int line;
+   long unrolled;               // statements run so far, repeats counted
+};
+
+// A cached script file starts with IUU_SCRIPT_HEADER words, followed by
+// the stream, its cuts, the marks and the answers
+enum iuu_script_header {
+   IUU_SCRIPT_H_MAGIC, IUU_SCRIPT_H_VERSION, IUU_SCRIPT_H_HASHLO,
+   IUU_SCRIPT_H_HASHHI, IUU_SCRIPT_H_LEN, IUU_SCRIPT_H_NCUT,
+   IUU_SCRIPT_H_NMARK, IUU_SCRIPT_H_NANS, IUU_SCRIPT_H_CLKSET,
+   IUU_SCRIPT_H_CLK, IUU_SCRIPT_H_F, IUU_SCRIPT_H_D, IUU_SCRIPT_H_SIZE,
+   IUU_SCRIPT_HEADER
+};
+
+#define IUU_SCRIPT_MAGIC 0x53555549     // "IUUS"
+#define IUU_SCRIPT_MARK_WORDS 5
+#define IUU_SCRIPT_ANSWER_WORDS 4
+
+// Next word of a line, 0 at its end or at a comment
+static int iuu_script_word(const char **p, const char *end, const char **w)
+{
+   const char *s = *p;
+
+   while (s < end && isspace((u_int8_t) * s))
+      s++;
+   *w = s;
+   while (s < end && !isspace((u_int8_t) * s) && *s != '#')
+      s++;
+   *p = s;
+   return s - *w;
+}
+
+static int iuu_script_is(const char *w, int n, const char *word)
+{
+   return (int)strlen(word) == n && !strncasecmp(w, word, n);
+}
+
+// Value of parameter name, those given by the caller go first
+static int iuu_script_param(const struct iuu_script *sc, const char *name,
+                            int n, const char **value)
+{
+   const char *const *p;
+   int i;
+
+   for (p = sc->params; p && *p; p++)
+      if (!strncmp(*p, name, n) && (*p)[n] == '=') {
+         *value = *p + n + 1;
+         return strlen(*value);
+      }
+   for (i = 0; i < sc->ndecl; i++)
+      if (sc->decl[i].nlen == n && !strncmp(sc->decl[i].name, name, n)) {
+         *value = sc->decl[i].value;
+         return sc->decl[i].vlen;
+      }
+   return -1;
+}
+
+// Next word of a line with parameters replaced, -1 for an unknown one
+static int iuu_script_arg(const struct iuu_script *sc, const char **p,
+                          const char *end, const char **w)
+{
+   int n = iuu_script_word(p, end, w);
+
+   if (n > 1 && **w == '$')
+      n = iuu_script_param(sc, *w + 1, n - 1, w);
+   return n;
+}
+
+// Number at the start of w, decimal or 0x hex. The rest of w (a unit)
+// is left in *unit.
+static iuu_error iuu_script_num(const char *w, int n, u_int64_t * v,
+                                const char **unit)
+{
+   const char *end = w + n;
+   int hex = n > 2 && w[0] == '0' && (w[1] == 'x' || w[1] == 'X');
+   int digits = 0;
+
+   *v = 0;
+   for (w += hex ? 2 : 0; w < end; w++, digits++) {
+      if (isdigit((u_int8_t) * w))
+         *v = *v * (hex ? 16 : 10) + *w - '0';
+      else if (hex && isxdigit((u_int8_t) * w))
+         *v = *v * 16 + (tolower((u_int8_t) * w) - 'a' + 10);
+      else
+         break;
+      if (*v > 0xFFFFFFFF)
+         return IUU_SCRIPT_ERROR;
+   }
+   *unit = w;
+   return digits ? IUU_OPERATION_OK : IUU_SCRIPT_ERROR;
+}
+
+// A whole word of a number no larger than max
+static iuu_error iuu_script_int(const char *w, int n, u_int64_t max,
+                                u_int64_t * v)
+{
+   const char *unit;
+
+   if (n <= 0 || iuu_script_num(w, n, v, &unit) != IUU_OPERATION_OK ||
+       unit != w + n || *v > max)
+      return IUU_SCRIPT_ERROR;
+   return IUU_OPERATION_OK;
+}
+
+// Bytes of the rest of a line, as hex words, into out
+static iuu_error iuu_script_bytes(const struct iuu_script *sc,
+                                  const char *p, const char *end,
+                                  u_int8_t * out, int *len)
+{
+   const char *w;
+   int n;
+
+   *len = 0;
+   while ((n = iuu_script_arg(sc, &p, end, &w)) != 0) {
+      if (n > 2 && w[0] == '0' && (w[1] == 'x' || w[1] == 'X')) {
+         w += 2;
+         n -= 2;
+      }
+      if (n < 0 || n % 2 || *len + n / 2 > IUU_SCRIPT_LINE ||
+          iuu_image_hex(w, out + *len, n / 2) < 0)
+         return IUU_SCRIPT_ERROR;
+      *len += n / 2;
+   }
+   return IUU_OPERATION_OK;
+}
+
+// Notes that the last mark of the sequence is an answer of len bytes
+static iuu_error iuu_script_answer_add(struct iuu_script *sc, int len,
+                                       int rx)
+{
+   struct iuu_script_answer *a;
+
+   if (sc->nans == sc->maxans) {
+      int n = sc->maxans ? 2 * sc->maxans : 16;
+
+      a = realloc(sc->ans, n * sizeof(*a));
+      if (!a)
+         return IUU_OUT_OF_MEMORY;
+      sc->ans = a;
+      sc->maxans = n;
+   }
+
+   a = &sc->ans[sc->nans++];
+   a->mark = sc->q.nmark - 1;
+   a->off = sc->size;
+   a->len = len;
+   a->rx = rx;
+   a->rxlen = 0;
+   sc->size += len;
+   return IUU_OPERATION_OK;
+}
+
+static const struct iuu_script_op *iuu_script_op_code(u_int8_t code)
+{
+   const struct iuu_script_op *op;
+
+   for (op = script_ops; op->name; op++)
+      if (op->code == code)
+         return op;
+   return NULL;
+}
+
+static const struct iuu_script_op *iuu_script_op_name(const char *w, int n)
+{
+   const struct iuu_script_op *op;
+
+   if (n > 4 && !strncasecmp(w, "IUU_", 4)) {
+      w += 4;
+      n -= 4;
+   }
+   for (op = script_ops; op->name; op++)
+      if (iuu_script_is(w, n, op->name))
+         return op;
+   return NULL;
+}
+
+// Adds the n bytes of IUU commands in b, checking that every command
+// is complete and noting the answers to read
+static iuu_error iuu_script_emit(struct iuu_script *sc, const u_int8_t * b,
+                                 int n)
+{
+   const struct iuu_script_op *op;
+   iuu_error status;
+   int i, len, answer;
+
+   for (i = 0; i < n; i += len) {
+      op = iuu_script_op_code(b[i]);
+      if (!op)
+         return IUU_SCRIPT_ERROR;
+
+      len = 1 + op->args;
+      answer = op->answer;
+      if (op->code == IUU_UART_ESC) {
+         if (i + 1 >= n)
+            return IUU_SCRIPT_ERROR;
+         switch (b[i + 1]) {
+         case IUU_UART_NOP:
+            len = 2;
+            break;
+         case IUU_UART_CHANGE:
+            len = 5;
+            break;
+         case IUU_UART_TX:
+            len = i + 2 < n ? 3 + b[i + 2] : n + 1;
+            break;
+         case IUU_DELAY_MS:
+            len = 3;
+            break;
+         default:
+            return IUU_SCRIPT_ERROR;
+         }
+      } else if (op->count && i + op->count < n) {
+         len += op->more * b[i + op->count];
+         answer += op->each * b[i + op->count];
+      }
+      if (i + len > n)
+         return IUU_SCRIPT_ERROR;
+
+      if (op->code == IUU_UART_RX) {
+         status = iuu_seq_rx(&sc->q, NULL, NULL);
+         if (status == IUU_OPERATION_OK)
+            status = iuu_script_answer_add(sc, IUU_USB_MAX_PAYLOAD, 1);
+      } else {
+         status = iuu_seq_cmd(&sc->q, b + i, len, answer, NULL);
+         if (status == IUU_OPERATION_OK && answer)
+            status = iuu_script_answer_add(sc, answer, 0);
+      }
+      if (status != IUU_OPERATION_OK)
+         return status;
+   }
+   return IUU_OPERATION_OK;
+}
+
+// wait N [us|ms|clk|etu], in milliseconds when no unit is given
+static iuu_error iuu_script_wait(struct iuu_script *sc, const char *p,
+                                 const char *end)
+{
+   const char *w, *unit;
+   u_int64_t v;
+   int n;
+
+   n = iuu_script_arg(sc, &p, end, &w);
+   if (n <= 0 || iuu_script_num(w, n, &v, &unit) != IUU_OPERATION_OK)
+      return IUU_SCRIPT_ERROR;
+   n -= unit - w;
+   if (!n)
+      n = iuu_script_word(&p, end, &unit);
+   if (iuu_script_word(&p, end, &w))
+      return IUU_SCRIPT_ERROR;
+
+   if (!n || iuu_script_is(unit, n, "ms"))
+      v *= 1000;
+   else if (iuu_script_is(unit, n, "clk"))
+      return iuu_seq_wait_clk(&sc->q, v);
+   else if (iuu_script_is(unit, n, "etu"))
+      return iuu_seq_wait_etu(&sc->q, v);
+   else if (!iuu_script_is(unit, n, "us"))
+      return IUU_SCRIPT_ERROR;
+
+   if (v > 0xFFFFFFFF)
+      return IUU_SCRIPT_ERROR;
+   return iuu_seq_wait(&sc->q, v);
+}
+
+// The one argument of a statement, a number no larger than max
+static iuu_error iuu_script_one(const struct iuu_script *sc, const char *p,
+                                const char *end, u_int64_t max,
+                                u_int64_t * v)
+{
+   const char *w;
+   int n = iuu_script_arg(sc, &p, end, &w);
+
+   if (iuu_script_int(w, n, max, v) != IUU_OPERATION_OK ||
+       iuu_script_word(&p, end, &w))
+      return IUU_SCRIPT_ERROR;
+   return IUU_OPERATION_OK;
+}
+
+// Compiles a statement other than repeat and end
+static iuu_error iuu_script_statement(struct iuu_script *sc,
+                                      const char *w, int n,
+                                      const char *p, const char *end)
+{
+   u_int8_t b[IUU_SCRIPT_LINE + 1];
+   const struct iuu_script_op *op;
+   struct iuu_clk_setting set;
+   iuu_error status;
+   u_int64_t v, v2;
+   const char *a;
+   int len;
+
+   if (iuu_script_is(w, n, "write")) {
+      status = iuu_script_bytes(sc, p, end, b, &len);
+      if (status == IUU_OPERATION_OK)
+         status = len ? iuu_script_emit(sc, b, len) : IUU_SCRIPT_ERROR;
+      return status;
+   }
+   if (iuu_script_is(w, n, "tx")) {
+      status = iuu_script_bytes(sc, p, end, b, &len);
+      if (status == IUU_OPERATION_OK)
+         status = iuu_seq_tx(&sc->q, b, len, sc->egt);
+      sc->egt = 0;
+      return status;
+   }
+   if (iuu_script_is(w, n, "rx")) {
+      if (iuu_script_word(&p, end, &a))
+         return IUU_SCRIPT_ERROR;
+      status = iuu_seq_rx(&sc->q, NULL, NULL);
+      if (status == IUU_OPERATION_OK)
+         status = iuu_script_answer_add(sc, IUU_USB_MAX_PAYLOAD, 1);
+      return status;
+   }
+   if (iuu_script_is(w, n, "atr")) {
+      a = p;
+      v = 0;
+      status = IUU_OPERATION_OK;
+      if (iuu_script_word(&a, end, &w))
+         status = iuu_script_one(sc, p, end, 0xFFFFFFFF / 1000, &v);
+      if (status == IUU_OPERATION_OK)
+         status = iuu_seq_atr(&sc->q, v * 1000, NULL, NULL);
+      if (status == IUU_OPERATION_OK)
+         status = iuu_script_answer_add(sc, IUU_USB_MAX_PAYLOAD, 1);
+      return status;
+   }
+   if (iuu_script_is(w, n, "wait"))
+      return iuu_script_wait(sc, p, end);
+   if (iuu_script_is(w, n, "egt")) {
+      status = iuu_script_one(sc, p, end, 0xFF, &v);
+      sc->egt = v;
+      return status;
+   }
+   if (iuu_script_is(w, n, "clk")) {
+      status = iuu_script_one(sc, p, end, 0x7FFFFFFF, &v);
+      if (status == IUU_OPERATION_OK)
+         status = iuu_clk_solve(v, &set);
+      if (status == IUU_OPERATION_OK)
+         status = iuu_seq_clk(&sc->q, &set);
+      return status;
+   }
+   if (iuu_script_is(w, n, "clock")) {
+      status = iuu_script_one(sc, p, end, 0xFFFFFFFF, &v);
+      if (status == IUU_OPERATION_OK)
+         status = iuu_seq_timing(&sc->q, v, sc->q.F, sc->q.D);
+      return status;
+   }
+   if (iuu_script_is(w, n, "etu")) {
+      len = iuu_script_arg(sc, &p, end, &a);
+      status = iuu_script_int(a, len, 0xFFFF, &v);
+      if (status == IUU_OPERATION_OK)
+         status = iuu_script_one(sc, p, end, 0xFF, &v2);
+      if (status == IUU_OPERATION_OK)
+         status = iuu_seq_timing(&sc->q, sc->q.clk, v, v2);
+      return status;
+   }
+   if (iuu_script_is(w, n, "vcc")) {
+      len = iuu_script_arg(sc, &p, end, &a);
+      if (iuu_script_word(&p, end, &w))
+         return IUU_SCRIPT_ERROR;
+      if (iuu_script_is(a, len, "5") || iuu_script_is(a, len, "5v"))
+         return iuu_seq_vcc(&sc->q, IUU_VCC_5V);
+      if (iuu_script_is(a, len, "3") || iuu_script_is(a, len, "3v") ||
+          iuu_script_is(a, len, "3.3") || iuu_script_is(a, len, "3.3v"))
+         return iuu_seq_vcc(&sc->q, IUU_VCC_3V);
+      return IUU_SCRIPT_ERROR;
+   }
+   if (iuu_script_is(w, n, "rst")) {
+      len = iuu_script_arg(sc, &p, end, &a);
+      if (iuu_script_word(&p, end, &w))
+         return IUU_SCRIPT_ERROR;
+      if (iuu_script_is(a, len, "on"))
+         return iuu_seq_rst(&sc->q, 1);
+      if (iuu_script_is(a, len, "off"))
+         return iuu_seq_rst(&sc->q, 0);
+      return IUU_SCRIPT_ERROR;
+   }
+   if (iuu_script_is(w, n, "param")) {
+      struct iuu_script_param d;
+
+      d.nlen = iuu_script_word(&p, end, &d.name);
+      d.vlen = iuu_script_word(&p, end, &d.value);
+      if (!d.nlen || !d.vlen || iuu_script_word(&p, end, &a))
+         return IUU_SCRIPT_ERROR;
+      // the first value given wins
+      if (iuu_script_param(sc, d.name, d.nlen, &a) >= 0)
+         return IUU_OPERATION_OK;
+      if (sc->ndecl == IUU_SCRIPT_PARAMS)
+         return IUU_SCRIPT_ERROR;
+      sc->decl[sc->ndecl++] = d;
+      return IUU_OPERATION_OK;
+   }
+
+   op = iuu_script_op_name(w, n);
+   if (!op)
+      return IUU_SCRIPT_ERROR;
+   b[0] = op->code;
+   status = iuu_script_bytes(sc, p, end, b + 1, &len);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_script_emit(sc, b, len + 1);
+   return status;
+}
+
+// Compiles lines from to to, unrolling repeat ... end blocks. Nested
+// repeats multiply, so past IUU_SCRIPT_UNROLLED statements and loop
+// turns the script is refused rather than compiled into gigabytes.
+static iuu_error iuu_script_lines(struct iuu_script *sc,
+                                  const struct iuu_script_line *line,
+                                  int from, int to)
+{
+   iuu_error status;
+   const char *p, *w;
+   u_int64_t times, k;
+   int i, j, n, depth;
+
+   for (i = from; i < to; i++) {
+      sc->line = line[i].no;
+      p = line[i].p;
+      n = iuu_script_word(&p, line[i].end, &w);
+
+      if (iuu_script_is(w, n, "end"))
+         return IUU_SCRIPT_ERROR;
+      if (++sc->unrolled > IUU_SCRIPT_UNROLLED)
+         return IUU_SCRIPT_ERROR;
+      if (!iuu_script_is(w, n, "repeat")) {
+         status = iuu_script_statement(sc, w, n, p, line[i].end);
+         if (status != IUU_OPERATION_OK)
+            return status;
+         continue;
+      }
+
+      status = iuu_script_one(sc, p, line[i].end, 0xFFFF, &times);
+      if (status != IUU_OPERATION_OK)
+         return status;
+      for (j = i + 1, depth = 1; j < to; j++) {
+         p = line[j].p;
+         n = iuu_script_word(&p, line[j].end, &w);
+         if (iuu_script_is(w, n, "repeat"))
+            depth++;
+         else if (iuu_script_is(w, n, "end") && !--depth)
+            break;
+      }
+      if (j == to)
+         return IUU_SCRIPT_ERROR;
+      for (k = 0; k < times; k++) {
+         if (++sc->unrolled > IUU_SCRIPT_UNROLLED)
+            return IUU_SCRIPT_ERROR;
+         status = iuu_script_lines(sc, line, i + 1, j);
+         if (status != IUU_OPERATION_OK)
+            return status;
+      }
+      i = j;
+   }
+   return IUU_OPERATION_OK;
+}
+
+// Splits text in the lines that have something on them
+static iuu_error iuu_script_split(const char *text, size_t len,
+                                  struct iuu_script_line **line, int *n)
+{
+   const char *p = text, *end = text + len, *eol, *s, *w;
+   int no, max = 0;
+
+   *line = NULL;
+   *n = 0;
+   for (no = 1; p < end; no++, p = eol + 1) {
+      eol = memchr(p, '\n', end - p);
+      if (!eol)
+         eol = end;
+      s = p;
+      if (!iuu_script_word(&s, eol, &w))
+         continue;
+
+      if (*n == max) {
+         struct iuu_script_line *l;
+
+         max = max ? 2 * max : 64;
+         l = realloc(*line, max * sizeof(*l));
+         if (!l) {
+            free(*line);
+            *line = NULL;
+            return IUU_OUT_OF_MEMORY;
+         }
+         *line = l;
+      }
+      (*line)[*n].p = p;
+      (*line)[*n].end = eol;
+      (*line)[*n].no = no;
+      (*n)++;
+   }
+   return IUU_OPERATION_OK;
+}
+
+// Points the marks of the sequence at the answer memory
+static iuu_error iuu_script_bind(struct iuu_script *sc)
+{
+   int i;
+
+   sc->mem = malloc(sc->size ? sc->size : 1);
+   if (!sc->mem)
+      return IUU_OUT_OF_MEMORY;
+   for (i = 0; i < sc->nans; i++) {
+      struct iuu_seq_mark *m = &sc->q.mark[sc->ans[i].mark];
+
+      m->buf = sc->mem + sc->ans[i].off;
+      m->rxlen = sc->ans[i].rx ? &sc->ans[i].rxlen : NULL;
+   }
+   return IUU_OPERATION_OK;
+}
+
+static u_int32_t iuu_script_get(const u_int8_t ** p)
+{
+   u_int32_t v;
+
+   memcpy(&v, *p, 4);
+   *p += 4;
+   return v;
+}
+
+static void iuu_script_put(u_int32_t * w, int *n, u_int32_t v)
+{
+   w[(*n)++] = v;
+}
+
+// Checks a script read back from the cache before it is trusted to
+// run: the hash in the file only tells which text it was compiled from.
+// Transfers must follow each other and fit the IUU, marks must come in
+// transfer order with their data inside their transfer, and answers
+// must fit where they are stored.
+static iuu_error iuu_script_valid(const struct iuu_script *sc)
+{
+   const struct iuu_stream *s = &sc->q.s;
+   const struct iuu_seq_mark *m;
+   const struct iuu_script_answer *a;
+   size_t from, to;
+   int i;
+
+   for (i = 0, from = 0; i < s->ncut; from = s->cut[i++])
+      if (s->cut[i] <= from || s->cut[i] > s->len ||
+          s->cut[i] - from > IUU_USB_MAX_PAYLOAD)
+         return IUU_FILE_ERROR;
+   if (s->len - from > IUU_USB_MAX_PAYLOAD)
+      return IUU_FILE_ERROR;
+
+   for (i = 0; i < sc->q.nmark; i++) {
+      m = &sc->q.mark[i];
+      if (m->transfer < 0 || m->transfer > s->ncut ||
+          (i && m->transfer < sc->q.mark[i - 1].transfer) ||
+          m->answer > IUU_SEQ_MAX_ANSWER)
+         return IUU_FILE_ERROR;
+      from = m->transfer ? s->cut[m->transfer - 1] : 0;
+      to = m->transfer < s->ncut ? s->cut[m->transfer] : s->len;
+      if (m->off < from || m->off > to || m->len > to - m->off)
+         return IUU_FILE_ERROR;
+   }
+
+   for (i = 0; i < sc->nans; i++) {
+      a = &sc->ans[i];
+      if (a->mark < 0 || a->mark >= sc->q.nmark || a->len < 0 ||
+          a->off > sc->size || a->len > sc->size - a->off)
+         return IUU_FILE_ERROR;
+      m = &sc->q.mark[a->mark];
+      if (a->len < (m->answer ? m->answer : IUU_USB_MAX_PAYLOAD))
+         return IUU_FILE_ERROR;
+   }
+   return IUU_OPERATION_OK;
+}
+
+// Reads back the script of hash h cached in file path, if it is there
+static iuu_error iuu_script_cached(struct iuu_script *sc, const char *path,
+                                   u_int64_t h)
+{
+   u_int32_t hd[IUU_SCRIPT_HEADER];
+   const u_int8_t *p;
+   size_t len, need;
+   u_int32_t v;
+   void *map;
+   int i, bad = 0;
+
+   if (access(path, R_OK) ||
+       iuu_image_map(path, &map, &len) != IUU_OPERATION_OK)
+      return IUU_FILE_ERROR;
+   if (len < sizeof(hd)) {
+      iuu_image_unmap(map, len);
+      return IUU_FILE_ERROR;
+   }
+   memcpy(hd, map, sizeof(hd));
+   p = (const u_int8_t *)map + sizeof(hd);
+   need = sizeof(hd) + hd[IUU_SCRIPT_H_LEN] + 4 * hd[IUU_SCRIPT_H_NCUT] +
+       4 * IUU_SCRIPT_MARK_WORDS * (size_t)hd[IUU_SCRIPT_H_NMARK] +
+       4 * IUU_SCRIPT_ANSWER_WORDS * (size_t)hd[IUU_SCRIPT_H_NANS];
+   if (hd[IUU_SCRIPT_H_MAGIC] != IUU_SCRIPT_MAGIC ||
+       hd[IUU_SCRIPT_H_VERSION] != IUU_SCRIPT_VERSION ||
+       hd[IUU_SCRIPT_H_HASHLO] != (u_int32_t) h ||
+       hd[IUU_SCRIPT_H_HASHHI] != (u_int32_t) (h >> 32) || len != need) {
+      iuu_image_unmap(map, len);
+      return IUU_FILE_ERROR;
+   }
+
+   sc->q.s.buf = malloc(hd[IUU_SCRIPT_H_LEN] + 1);
+   sc->q.s.cut = malloc((hd[IUU_SCRIPT_H_NCUT] + 1) * sizeof(size_t));
+   sc->q.mark = malloc((hd[IUU_SCRIPT_H_NMARK] + 1) *
+                       sizeof(struct iuu_seq_mark));
+   sc->ans = malloc((hd[IUU_SCRIPT_H_NANS] + 1) *
+                    sizeof(struct iuu_script_answer));
+   if (!sc->q.s.buf || !sc->q.s.cut || !sc->q.mark || !sc->ans) {
+      iuu_image_unmap(map, len);
+      return IUU_OUT_OF_MEMORY;
+   }
+
+   sc->q.s.len = sc->q.s.size = hd[IUU_SCRIPT_H_LEN];
+   sc->q.s.ncut = sc->q.s.maxcut = hd[IUU_SCRIPT_H_NCUT];
+   sc->q.nmark = sc->q.maxmark = hd[IUU_SCRIPT_H_NMARK];
+   sc->nans = sc->maxans = hd[IUU_SCRIPT_H_NANS];
+   sc->q.clk_set = hd[IUU_SCRIPT_H_CLKSET];
+   sc->q.clk = hd[IUU_SCRIPT_H_CLK];
+   sc->q.F = hd[IUU_SCRIPT_H_F];
+   sc->q.D = hd[IUU_SCRIPT_H_D];
+   sc->size = hd[IUU_SCRIPT_H_SIZE];
+
+   memcpy(sc->q.s.buf, p, sc->q.s.len);
+   p += sc->q.s.len;
+   for (i = 0; i < sc->q.s.ncut; i++)
+      sc->q.s.cut[i] = iuu_script_get(&p);
+   for (i = 0; i < sc->q.nmark; i++) {
+      struct iuu_seq_mark *m = &sc->q.mark[i];
+
+      memset(m, 0, sizeof(*m));
+      m->transfer = iuu_script_get(&p);
+      m->off = iuu_script_get(&p);
+      v = iuu_script_get(&p);
+      m->len = v;
+      bad |= v != m->len;
+      v = iuu_script_get(&p);
+      m->answer = v;
+      bad |= v != m->answer;
+      m->atr = iuu_script_get(&p);
+   }
+   for (i = 0; i < sc->nans; i++) {
+      struct iuu_script_answer *a = &sc->ans[i];
+
+      a->mark = iuu_script_get(&p);
+      a->off = iuu_script_get(&p);
+      a->len = iuu_script_get(&p);
+      a->rx = iuu_script_get(&p);
+      a->rxlen = 0;
+   }
+   iuu_image_unmap(map, len);
+
+   if (bad)
+      return IUU_FILE_ERROR;
+   return iuu_script_valid(sc);
+}
+
+// Keeps a compiled script in file path. It is written aside and
+// renamed over, so readers never see it half written.
+static iuu_error iuu_script_keep(const struct iuu_script *sc,
+                                 const char *path, u_int64_t h)
+{
+   u_int32_t hd[IUU_SCRIPT_HEADER], w[IUU_SCRIPT_MARK_WORDS];
+   char tmp[1024];
+   FILE *f;
+   int i, n, ok;
+
+   n = 0;
+   iuu_script_put(hd, &n, IUU_SCRIPT_MAGIC);
+   iuu_script_put(hd, &n, IUU_SCRIPT_VERSION);
+   iuu_script_put(hd, &n, h);
+   iuu_script_put(hd, &n, h >> 32);
+   iuu_script_put(hd, &n, sc->q.s.len);
+   iuu_script_put(hd, &n, sc->q.s.ncut);
+   iuu_script_put(hd, &n, sc->q.nmark);
+   iuu_script_put(hd, &n, sc->nans);
+   iuu_script_put(hd, &n, sc->q.clk_set);
+   iuu_script_put(hd, &n, sc->q.clk);
+   iuu_script_put(hd, &n, sc->q.F);
+   iuu_script_put(hd, &n, sc->q.D);
+   iuu_script_put(hd, &n, sc->size);
+
+   if (snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid()) >=
+       (int)sizeof(tmp))
+      return IUU_FILE_ERROR;
+   f = fopen(tmp, "wb");
+   if (!f)
+      return IUU_FILE_ERROR;
+
+   ok = fwrite(hd, sizeof(hd), 1, f) == 1;
+   ok = ok && fwrite(sc->q.s.buf, 1, sc->q.s.len, f) == sc->q.s.len;
+   for (i = 0; ok && i < sc->q.s.ncut; i++) {
+      n = 0;
+      iuu_script_put(w, &n, sc->q.s.cut[i]);
+      ok = fwrite(w, 4, n, f) == (size_t)n;
+   }
+   for (i = 0; ok && i < sc->q.nmark; i++) {
+      n = 0;
+      iuu_script_put(w, &n, sc->q.mark[i].transfer);
+      iuu_script_put(w, &n, sc->q.mark[i].off);
+      iuu_script_put(w, &n, sc->q.mark[i].len);
+      iuu_script_put(w, &n, sc->q.mark[i].answer);
+      iuu_script_put(w, &n, sc->q.mark[i].atr);
+      ok = fwrite(w, 4, n, f) == (size_t)n;
+   }
+   for (i = 0; ok && i < sc->nans; i++) {
+      n = 0;
+      iuu_script_put(w, &n, sc->ans[i].mark);
+      iuu_script_put(w, &n, sc->ans[i].off);
+      iuu_script_put(w, &n, sc->ans[i].len);
+      iuu_script_put(w, &n, sc->ans[i].rx);
+      ok = fwrite(w, 4, n, f) == (size_t)n;
+   }
+
+   ok = !fclose(f) && ok;
+   if (!ok || rename(tmp, path)) {
+      unlink(tmp);
+      return IUU_FILE_ERROR;
+   }
+   return IUU_OPERATION_OK;
+}
+
+// Compiles the len bytes of script text, with the parameters in params
+// ("NAME=VALUE" strings up to a NULL, which may be NULL itself). When
+// cachedir is not NULL the compiled script is looked for and kept
+// there. On a syntax error IUU_SCRIPT_ERROR is returned and line tells
+// where, if not NULL.
+iuu_error iuu_script_compile(struct iuu_script **script, const char *text,
+                             size_t len, const char *const *params,
+                             const char *cachedir, int *line)
+{
+   struct iuu_script_line *lines = NULL;
+   const char *const *p;
+   struct iuu_script *sc;
+   char path[1024];
+   iuu_error status;
+   u_int64_t h;
+   int n;
+
+   if (line)
+      *line = 0;
+   *script = sc = calloc(1, sizeof(*sc));
+   if (!sc) {
+      iuu_process_error(IUU_OUT_OF_MEMORY, __FILE__, __LINE__);
+      return IUU_OUT_OF_MEMORY;
+   }
+   iuu_seq_init(&sc->q, IUU_CLK_3579000);
+
+   h = iuu_hash(IUU_SCRIPT_VERSION, text, len);
+   for (p = params; p && *p; p++)
+      h = iuu_hash(h, *p, strlen(*p) + 1);
+   if (cachedir && snprintf(path, sizeof(path), "%s/%016llx.iuus",
+                            cachedir, (unsigned long long)h) >=
+       (int)sizeof(path))
+      cachedir = NULL;
+
+   if (cachedir) {
+      status = iuu_script_cached(sc, path, h);
+      if (status == IUU_OPERATION_OK)
+         status = iuu_script_bind(sc);
+      if (status == IUU_OPERATION_OK)
+         return status;
+      iuu_seq_free(&sc->q);
+      free(sc->ans);
+      memset(sc, 0, sizeof(*sc));
+      iuu_seq_init(&sc->q, IUU_CLK_3579000);
+   }
+
+   sc->params = params;
+   status = iuu_script_split(text, len, &lines, &n);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_script_lines(sc, lines, 0, n);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_script_bind(sc);
+   free(lines);
+   sc->params = NULL;
+
+   if (status != IUU_OPERATION_OK) {
+      if (line)
+         *line = sc->line;
+      iuu_script_free(sc);
+      *script = NULL;
+      iuu_process_error(status, __FILE__, __LINE__);
+      return status;
+   }
+
+   // A cache that can not be written only costs compiling again
+   if (cachedir)
+      iuu_script_keep(sc, path, h);
+   return IUU_OPERATION_OK;
+}
+
+// Same as iuu_script_compile() with the script in the file at path
+iuu_error iuu_script_load(struct iuu_script **script, const char *path,
+                          const char *const *params, const char *cachedir,
+                          int *line)
+{
+   iuu_error status;
+   size_t len;
+   void *map;
+
+   *script = NULL;
+   if (line)
+      *line = 0;
+   status = iuu_image_map(path, &map, &len);
+   if (status != IUU_OPERATION_OK)
+      return status;
+
+   status = iuu_script_compile(script, map ? map : "", len, params,
+                               cachedir, line);
+   iuu_image_unmap(map, len);
+   return status;
+}
+
+// Releases a compiled script
+void iuu_script_free(struct iuu_script *sc)
+{
+   if (!sc)
+      return;
+   iuu_seq_free(&sc->q);
+   free(sc->ans);
+   free(sc->mem);
+   free(sc);
+}
+
+// The card sequence a script compiled to, e.g. to count its transfers
+const struct iuu_seq *iuu_script_seq(const struct iuu_script *sc)
+{
+   return &sc->q;
+}
+
+// Runs a compiled script on a device, see iuu_seq_run(). Its answers
+// are there until the next run.
+iuu_error iuu_script_run(iuu * inf, struct iuu_script *sc)
+{
+   int i;
+
+   for (i = 0; i < sc->nans; i++)
+      sc->ans[i].rxlen = 0;
+   return iuu_seq_run(inf, &sc->q);
+}
+
+// Number of answers a script reads
+int iuu_script_answers(const struct iuu_script *sc)
+{
+   return sc->nans;
+}
+
+// Answer i of the last run of a script, in script order, and its length
+const u_int8_t *iuu_script_answer(const struct iuu_script *sc, int i,
+                                  int *len)
+{
+   if (i < 0 || i >= sc->nans) {
+      *len = 0;
+      return NULL;
+   }
+   *len = sc->ans[i].rx ? sc->ans[i].rxlen : sc->ans[i].len;
+   return sc->mem + sc->ans[i].off;
+}
@@ -0,0 +1,377 @@
+/*
+ *  iuutool - a port of WBE's Infinity USB Unlimited SDK
+ * 
+ *  Copyright (C) 2006 Juan Carlos Borrs
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as 
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <stdio.h>
+#include <usb.h>
+
+#include <iuu.h>
+#include "iuu_priv.h"
+
+/*
+ A card sequence is a recipe such as "power at 5V, clock at 3.579MHz,
+ reset, wait for the ATR, send a command, wait, read the answer" put
+ together as a single command stream. The waits between steps are
+ IUU_WAIT_MS and IUU_WAIT_MUS commands timed by the IUU itself, worked
+ out from the card clock and etu of the sequence, so no host sleep nor
+ USB round trip is needed between steps. Only reading an answer from
+ the phoenix interface ends a transfer: the host has to fetch it before
+ the IUU gets anything else.
+*/
+
+// Initializes an empty sequence for a card clocked at clk Hz, with the
+// etu of an ATR (F = 372, D = 1)
+iuu_error iuu_seq_init(struct iuu_seq *q, u_int32_t clk)
+{
+   memset(q, 0, sizeof(*q));
+   iuu_stream_init(&q->s);
+   return iuu_seq_timing(q, clk, IUU_SEQ_F0, IUU_SEQ_D0);
+}
+
+// Releases the memory held by a sequence
+void iuu_seq_free(struct iuu_seq *q)
+{
+   iuu_stream_free(&q->s);
+   free(q->mark);
+   memset(q, 0, sizeof(*q));
+}
+
+// Empties a sequence but keeps its timings and memory for reuse
+void iuu_seq_reset(struct iuu_seq *q)
+{
+   iuu_stream_reset(&q->s);
+   q->nmark = 0;
+   q->clk_set = 0;
+}
+
+// Sets the card clock and the ISO7816 F and D the waits of the steps
+// added from now on are worked out from, e.g. after a PPS
+iuu_error iuu_seq_timing(struct iuu_seq *q, u_int32_t clk, u_int16_t F,
+                         u_int8_t D)
+{
+   if (clk == 0 || F == 0 || D == 0) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+
+   q->clk = clk;
+   q->F = F;
+   q->D = D;
+   return IUU_OPERATION_OK;
+}
+
+// Appends a command of len bytes, returning in mark (if not NULL) the
+// bookkeeping entry for it
+static iuu_error iuu_seq_add(struct iuu_seq *q, const u_int8_t * cmd,
+                             int len, struct iuu_seq_mark **mark)
+{
+   iuu_error status;
+
+   status = iuu_stream_add(&q->s, cmd, len);
+   if (status != IUU_OPERATION_OK || !mark)
+      return status;
+
+   if (q->nmark == q->maxmark) {
+      int n = q->maxmark ? 2 * q->maxmark : 16;
+      struct iuu_seq_mark *m = realloc(q->mark, n * sizeof(*m));
+
+      if (!m) {
+         iuu_process_error(IUU_OUT_OF_MEMORY, __FILE__, __LINE__);
+         return IUU_OUT_OF_MEMORY;
+      }
+      q->mark = m;
+      q->maxmark = n;
+   }
+
+   *mark = &q->mark[q->nmark++];
+   memset(*mark, 0, sizeof(**mark));
+   (*mark)->transfer = iuu_stream_transfers(&q->s) - 1;
+   (*mark)->off = q->s.len - len;
+   return IUU_OPERATION_OK;
+}
+
+// Adds any IUU command of len bytes. If it answers with a fixed number
+// of bytes, answer tells how many and they are stored in buf (or
+// thrown away if it is NULL) when the sequence is run.
+iuu_error iuu_seq_cmd(struct iuu_seq *q, const u_int8_t * cmd, int len,
+                      int answer, u_int8_t * buf)
+{
+   iuu_error status;
+   struct iuu_seq_mark *mark;
+
+   if (answer < 0 || answer > IUU_SEQ_MAX_ANSWER) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+   if (!answer)
+      return iuu_seq_add(q, cmd, len, NULL);
+
+   status = iuu_seq_add(q, cmd, len, &mark);
+   if (status != IUU_OPERATION_OK)
+      return status;
+   mark->buf = buf;
+   mark->answer = answer;
+
+   return iuu_stream_cut(&q->s);
+}
+
+// Adds setting Vcc, see iuu_vcc()
+iuu_error iuu_seq_vcc(struct iuu_seq *q, enum iuu_vcc_t vcc)
+{
+   u_int8_t cmd[2];
+
+   if (vcc != IUU_VCC_5V && vcc != IUU_VCC_3V) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+
+   cmd[0] = IUU_SET_VCC;
+   cmd[1] = vcc;
+   return iuu_seq_add(q, cmd, 2, NULL);
+}
+
+// Adds programming the card clock, see iuu_clk_solve(). Waits added
+// afterwards are worked out from the new frequency.
+iuu_error iuu_seq_clk(struct iuu_seq *q, const struct iuu_clk_setting *set)
+{
+   iuu_error status;
+
+   if (set->freq == 0) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+
+   status = iuu_clk_encode(&q->s, set);
+   if (status != IUU_OPERATION_OK)
+      return status;
+
+   q->clk = set->freq;
+   q->clk_set = 1;
+   return IUU_OPERATION_OK;
+}
+
+// Adds setting (on) or clearing the RST signal
+iuu_error iuu_seq_rst(struct iuu_seq *q, int on)
+{
+   u_int8_t cmd = on ? IUU_RST_SET : IUU_RST_CLEAR;
+
+   return iuu_seq_add(q, &cmd, 1, NULL);
+}
+
+// Adds a wait of us microseconds
+iuu_error iuu_seq_wait(struct iuu_seq *q, u_int32_t us)
+{
+   return iuu_stream_wait(&q->s, us);
+}
+
+// Adds a wait of n card clock cycles, rounded up to whole microseconds
+iuu_error iuu_seq_wait_clk(struct iuu_seq *q, u_int32_t n)
+{
+   u_int64_t us = ((u_int64_t) n * 1000000 + q->clk - 1) / q->clk;
+
+   if (us > 0xFFFFFFFF) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+   return iuu_stream_wait(&q->s, us);
+}
+
+// Adds a wait of n etus at the current F, D and clock
+iuu_error iuu_seq_wait_etu(struct iuu_seq *q, u_int32_t n)
+{
+   u_int64_t clk = ((u_int64_t) n * q->F + q->D - 1) / q->D;
+
+   if (clk > 0xFFFFFFFF) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+   return iuu_seq_wait_clk(q, clk);
+}
+
+// Adds sending len bytes to the card through the phoenix interface,
+// with a wait of egt etus after every byte when egt is not 0 (the
+// extra guard time of TC1 in the ATR). The data is given in direct
+// convention and transcoded when the sequence is run if the card
+// turns out to be an inverse convention one.
+iuu_error iuu_seq_tx(struct iuu_seq *q, const u_int8_t * data, int len,
+                     u_int8_t egt)
+{
+   iuu_error status = IUU_OPERATION_OK;
+   struct iuu_seq_mark *mark;
+   u_int8_t cmd[IUU_USB_MAX_PAYLOAD];
+   int n, max = egt ? 1 : IUU_USB_MAX_PAYLOAD - 3;
+
+   while (len > 0 && status == IUU_OPERATION_OK) {
+      n = len > max ? max : len;
+      cmd[0] = IUU_UART_ESC;
+      cmd[1] = IUU_UART_TX;
+      cmd[2] = n;
+      memcpy(&cmd[3], data, n);
+
+      status = iuu_seq_add(q, cmd, n + 3, &mark);
+      if (status != IUU_OPERATION_OK)
+         break;
+      mark->off += 3;
+      mark->len = n;
+
+      if (egt)
+         status = iuu_seq_wait_etu(q, egt);
+      data += n;
+      len -= n;
+   }
+   return status;
+}
+
+// Adds reading what the phoenix interface got from the card so far.
+// When the sequence is run the answer is stored in buf and its length
+// in len, or thrown away if buf is NULL. buf must take 255 bytes.
+iuu_error iuu_seq_rx(struct iuu_seq *q, u_int8_t * buf, u_int8_t * len)
+{
+   iuu_error status;
+   struct iuu_seq_mark *mark;
+   u_int8_t cmd = IUU_UART_RX;
+
+   status = iuu_seq_add(q, &cmd, 1, &mark);
+   if (status != IUU_OPERATION_OK)
+      return status;
+   mark->buf = buf;
+   mark->rxlen = len;
+
+   return iuu_stream_cut(&q->s);
+}
+
+// Adds a card reset and reading its ATR, like iuu_reset() followed by
+// iuu_get_atr() but with the ISO7816 timings of the card clock rather
+// than fixed host sleeps: RST is held for 40000 clock cycles and the
+// ATR is read after 40000 more plus the time the longest ATR takes at
+// F = 372, D = 1, plus us microseconds. Cards may leave up to 9600 etus
+// between characters, so give slow cards a few hundred milliseconds.
+// The TS byte sets the convention of the device when the sequence is
+// run.
+iuu_error iuu_seq_atr(struct iuu_seq *q, u_int32_t us, u_int8_t * atr,
+                      u_int8_t * len)
+{
+   iuu_error status;
+
+   status = iuu_seq_rx(q, NULL, NULL);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_seq_rst(q, 1);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_seq_wait_clk(q, IUU_SEQ_RST_CLK);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_seq_rst(q, 0);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_seq_wait_clk(q, IUU_SEQ_RST_CLK +
+                                IUU_SEQ_ATR_CHARS * IUU_SEQ_CHAR_ETU *
+                                IUU_SEQ_F0 / IUU_SEQ_D0);
+   if (status == IUU_OPERATION_OK && us)
+      status = iuu_seq_wait(q, us);
+   if (status == IUU_OPERATION_OK)
+      status = iuu_seq_rx(q, atr, len);
+   if (status == IUU_OPERATION_OK)
+      q->mark[q->nmark - 1].atr = 1;
+
+   return status;
+}
+
+// Sends transfer t of a sequence, transcoding its TX data first for
+// inverse convention cards. Marks from *m on that belong to t are
+// consumed.
+static iuu_error iuu_seq_send(iuu * inf, const struct iuu_seq *q, int t,
+                              int *m)
+{
+   u_int8_t buf[IUU_USB_MAX_PAYLOAD];
+   size_t from = t ? q->s.cut[t - 1] : 0;
+   size_t to = t < q->s.ncut ? q->s.cut[t] : q->s.len;
+   int i, inverse = 0;
+
+   for (i = *m; i < q->nmark && q->mark[i].transfer == t; i++)
+      if (q->mark[i].len && inf->conv == IUU_CONVENTION_INVERSE)
+         inverse = 1;
+   if (!inverse)
+      return iuu_stream_send_range(inf, &q->s, t, 1);
+
+   memcpy(buf, q->s.buf + from, to - from);
+   for (i = *m; i < q->nmark && q->mark[i].transfer == t; i++)
+      if (q->mark[i].len)
+         iuu_inverse(buf + q->mark[i].off - from, q->mark[i].len);
+   return iuu_write(inf, buf, to - from);
+}
+
+// Reads the answer of the command that ends a transfer
+static iuu_error iuu_seq_answer(iuu * inf, const struct iuu_seq_mark *mark)
+{
+   iuu_error status;
+   u_int8_t drop[IUU_SEQ_MAX_ANSWER], n;
+   u_int8_t *buf = mark->buf ? mark->buf : drop;
+
+   if (mark->answer) {
+      status = iuu_read(inf, buf, mark->answer);
+      if (status != IUU_OPERATION_OK)
+         iuu_process_error(status, __FILE__, __LINE__);
+      return status;
+   }
+
+   status = iuu_read(inf, &n, 1);
+   if (status == IUU_OPERATION_OK && n)
+      status = iuu_read(inf, buf, n);
+   if (status != IUU_OPERATION_OK) {
+      iuu_process_error(status, __FILE__, __LINE__);
+      return status;
+   }
+
+   // See iuu_get_atr()
+   if (mark->atr)
+      inf->conv = n > 0 && buf[0] == 0x03 ?
+          IUU_CONVENTION_INVERSE : IUU_CONVENTION_DIRECT;
+   if (inf->conv == IUU_CONVENTION_INVERSE)
+      iuu_inverse(buf, n);
+
+   if (mark->rxlen)
+      *mark->rxlen = n;
+   return IUU_OPERATION_OK;
+}
+
+// Runs a sequence on a device. The host only steps in to fetch the
+// answers of the RXs and other commands, everything else goes as fast
+// as USB allows and is timed by the IUU. The same sequence can be run
+// many times.
+iuu_error iuu_seq_run(iuu * inf, const struct iuu_seq *q)
+{
+   iuu_error status = IUU_OPERATION_OK;
+   int t, n = iuu_stream_transfers(&q->s), m = 0;
+
+   for (t = 0; t < n && status == IUU_OPERATION_OK; t++) {
+      status = iuu_seq_send(inf, q, t, &m);
+      while (status == IUU_OPERATION_OK && m < q->nmark &&
+             q->mark[m].transfer == t) {
+         if (!q->mark[m].len)
+            status = iuu_seq_answer(inf, &q->mark[m]);
+         m++;
+      }
+   }
+
+   if (q->clk_set)
+      iuu_clk_invalidate(inf);
+   if (status != IUU_OPERATION_OK)
+      iuu_process_error(status, __FILE__, __LINE__);
+   return status;
+}
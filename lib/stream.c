@@ -0,0 +1,180 @@
+/*
+ *  iuutool - a port of WBE's Infinity USB Unlimited SDK
+ * 
+ *  Copyright (C) 2006 Juan Carlos Borrs
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as 
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <stdio.h>
+#include <usb.h>
+
+#include <iuu.h>
+#include "iuu_priv.h"
+
+// Initializes an empty command stream
+iuu_error iuu_stream_init(struct iuu_stream *s)
+{
+   memset(s, 0, sizeof(*s));
+   return IUU_OPERATION_OK;
+}
+
+// Releases the memory held by a command stream
+void iuu_stream_free(struct iuu_stream *s)
+{
+   free(s->buf);
+   free(s->cut);
+   memset(s, 0, sizeof(*s));
+}
+
+// Empties a command stream but keeps its memory for reuse
+void iuu_stream_reset(struct iuu_stream *s)
+{
+   s->len = 0;
+   s->ncut = 0;
+}
+
+// Where the transfer being filled starts
+static size_t iuu_stream_last(const struct iuu_stream *s)
+{
+   return s->ncut ? s->cut[s->ncut - 1] : 0;
+}
+
+// Ends the transfer being filled, so the next command goes in a new
+// one. Use it when the device must have processed everything so far
+// before anything else is sent.
+iuu_error iuu_stream_cut(struct iuu_stream *s)
+{
+   if (s->len == iuu_stream_last(s))
+      return IUU_OPERATION_OK;
+
+   if (s->ncut == s->maxcut) {
+      int n = s->maxcut ? 2 * s->maxcut : 64;
+      size_t *cut = realloc(s->cut, n * sizeof(size_t));
+
+      if (!cut) {
+         iuu_process_error(IUU_OUT_OF_MEMORY, __FILE__, __LINE__);
+         return IUU_OUT_OF_MEMORY;
+      }
+      s->cut = cut;
+      s->maxcut = n;
+   }
+
+   s->cut[s->ncut++] = s->len;
+   return IUU_OPERATION_OK;
+}
+
+// Appends a command of len bytes. Commands never get split among
+// transfers, so when it does not fit in the transfer being filled a
+// new one is started.
+iuu_error iuu_stream_add(struct iuu_stream *s, const u_int8_t * cmd,
+                         int len)
+{
+   iuu_error status;
+
+   if (len < 0 || len > IUU_USB_MAX_PAYLOAD) {
+      iuu_process_error(IUU_INVALID_REQUEST_LENGTH, __FILE__, __LINE__);
+      return IUU_INVALID_REQUEST_LENGTH;
+   }
+
+   if (s->len - iuu_stream_last(s) + len > IUU_USB_MAX_PAYLOAD) {
+      status = iuu_stream_cut(s);
+      if (status != IUU_OPERATION_OK)
+         return status;
+   }
+
+   if (s->len + len > s->size) {
+      size_t n = s->size ? 2 * s->size : 1024;
+      u_int8_t *buf;
+
+      while (n < s->len + len)
+         n *= 2;
+      buf = realloc(s->buf, n);
+      if (!buf) {
+         iuu_process_error(IUU_OUT_OF_MEMORY, __FILE__, __LINE__);
+         return IUU_OUT_OF_MEMORY;
+      }
+      s->buf = buf;
+      s->size = n;
+   }
+
+   memcpy(s->buf + s->len, cmd, len);
+   s->len += len;
+
+   return IUU_OPERATION_OK;
+}
+
+// Adds to s a wait of us microseconds done by the IUU itself, rounded
+// up to its 10us resolution
+iuu_error iuu_stream_wait(struct iuu_stream *s, u_int32_t us)
+{
+   iuu_error status = IUU_OPERATION_OK;
+   u_int8_t cmd[2];
+
+   while (us >= 1000 && status == IUU_OPERATION_OK) {
+      cmd[0] = IUU_WAIT_MS;
+      cmd[1] = us / 1000 > 0xFF ? 0xFF : us / 1000;
+      us -= cmd[1] * 1000;
+      status = iuu_stream_add(s, cmd, 2);
+   }
+   if (us && status == IUU_OPERATION_OK) {
+      cmd[0] = IUU_WAIT_MUS;
+      cmd[1] = (us + 9) / 10;
+      status = iuu_stream_add(s, cmd, 2);
+   }
+   return status;
+}
+
+// Number of USB transfers needed to send the stream
+int iuu_stream_transfers(const struct iuu_stream *s)
+{
+   return s->ncut + (s->len > iuu_stream_last(s) ? 1 : 0);
+}
+
+// Sends n transfers of the stream to the IUU, starting with transfer
+// first, so that a stream can be sent a piece at a time
+iuu_error iuu_stream_send_range(iuu * inf, const struct iuu_stream *s,
+                                int first, int n)
+{
+   iuu_error status;
+   size_t from, to;
+   int i;
+
+   if (first < 0 || n < 0 || first + n > iuu_stream_transfers(s)) {
+      iuu_process_error(IUU_INVALID_PARAMETER, __FILE__, __LINE__);
+      return IUU_INVALID_PARAMETER;
+   }
+
+   from = first ? s->cut[first - 1] : 0;
+   for (i = first; i < first + n; i++) {
+      to = i < s->ncut ? s->cut[i] : s->len;
+      status = iuu_write(inf, s->buf + from, to - from);
+      if (status != IUU_OPERATION_OK) {
+         iuu_process_error(status, __FILE__, __LINE__);
+         return status;
+      }
+      from = to;
+   }
+
+   return IUU_OPERATION_OK;
+}
+
+// Sends the whole stream to the IUU, one transfer after another
+iuu_error iuu_stream_send(iuu * inf, const struct iuu_stream *s)
+{
+   return iuu_stream_send_range(inf, s, 0, iuu_stream_transfers(s));
+}
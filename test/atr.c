@@ -133,25 +133,26 @@ int main(int argc, char **argv)
       return 0;
    }
 
+   // The reset and the wait for the ATR are timed by the IUU itself,
+   // with as much margin for slow cards as the host sleep had
+   struct iuu_seq seq;
+   u_int8_t atrl, atr[300];
+   iuu_seq_init(&seq, IUU_CLK_3579000);
+   status = iuu_seq_atr(&seq, 500000, atr, &atrl);
+   if (status != IUU_OPERATION_OK) {
+      iuu_process_error(status, __FILE__, __LINE__);
+      status = iuu_stop(&inf);
+      iuu_process_error(status, __FILE__, __LINE__);
+      return -1;
+   }
+
    int i;
    for (i = 0; i < 5; i++) {
-      fprintf(stdout, "\nReseting card");
-      status = iuu_reset(&inf, 0x0C);
-      if (status != IUU_OPERATION_OK) {
-         iuu_process_error(status, __FILE__, __LINE__);
-         status = iuu_stop(&inf);
-         iuu_process_error(status, __FILE__, __LINE__);
-         return -1;
-      }
-
-      usleep(500000);
-      //sleep(4);
-
-      fprintf(stdout, "\nGetting the card ATR");
-      u_int8_t atrl, atr[300];
-      status = iuu_get_atr(&inf, atr, &atrl);
+      fprintf(stdout, "\nReseting card and getting its ATR");
+      status = iuu_seq_run(&inf, &seq);
       if (status != IUU_OPERATION_OK) {
          iuu_process_error(status, __FILE__, __LINE__);
+         iuu_seq_free(&seq);
          status = iuu_stop(&inf);
          iuu_process_error(status, __FILE__, __LINE__);
          return -1;
@@ -159,6 +160,7 @@ int main(int argc, char **argv)
       fprintf(stdout, "\n");
       iuu_print_atr(atr, atrl);
    }
+   iuu_seq_free(&seq);
 
    status = iuu_stop(&inf);
    if (status != IUU_OPERATION_OK) {
@@ -20,11 +20,14 @@
 
 #include <ctype.h>
 #include <errno.h>
-#include <regex.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/select.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <usb.h>
 #include <readline/readline.h>
@@ -32,207 +35,304 @@
 
 #include <iuu.h>
 
-#define CHECKPOINT fprintf(stdout, "%s:%d Checkpoint\n", __FILE__, __LINE__); fflush(stdout);
-
-char hex2dec(char in)
+// How a command takes its arguments
+enum term_args {
+   TERM_NONE,                   // none
+   TERM_COUNT,                  // a decimal number of up to 3 digits
+   TERM_NUM,                    // a decimal number
+   TERM_HEX                     // bytes as pairs of xdigits
+};
+
+// A command line, parsed
+struct term_cmd {
+   int op;                      // in term_ops[]
+   int line;                    // in the script
+   unsigned long num;           // TERM_COUNT and TERM_NUM
+   u_int8_t *data;              // TERM_HEX
+   int len;
+   struct iuu_stream *s;        // writes merged in script mode
+};
+
+struct term_op {
+   const char *name;
+   enum term_args args;
+   int device;                  // talks to the IUU, see run_command()
+   int (*run) (struct usb_infinity * inf, const struct term_cmd * c);
+};
+
+enum term_monitor_params {
+   MON_CHUNKS = 256,            // UART reads kept until they are shown
+   MON_ECHO = 1024,             // bytes sent that may still come back
+   MON_ROW = 16,                // bytes shown per line
+   MON_PERIOD_MAX = 1000        // ms
+};
+
+// What a poll of the UART FIFO got
+struct mon_chunk {
+   struct timeval t;
+   int len;
+   u_int8_t data[256];
+};
+
+// The monitor: a thread polling the UART FIFO into a ring of chunks,
+// shown by the foreground whenever the thread wakes it up
+struct term_monitor {
+   pthread_t thread;
+   int running;                 // thread started and not stopped
+   volatile int stop;           // asks the thread to end
+   unsigned long period;        // ms between polls of an empty FIFO
+   struct timeval start;        // timestamps are relative to this
+   struct mon_chunk ring[MON_CHUNKS];
+   int head, count;             // oldest chunk and chunks kept
+   unsigned long lost;          // chunks dropped as the ring was full
+   int noecho;                  // drop the bytes tx sent as they come back
+   u_int8_t echo[MON_ECHO];
+   int nech;
+   iuu_error status;            // why the thread ended by itself
+   int wake[2];                 // pipe the thread pokes after a poll
+};
+
+static struct term_monitor mon = {.wake = {-1, -1} };
+
+// mon_lock guards the ring, echo and status of mon. dev_lock is held
+// by whoever talks to the IUU, as the monitor thread does too.
+static pthread_mutex_t mon_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t dev_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int interactive;         // readline owns the terminal
+
+static const char hexdigits[] = "0123456789ABCDEF";
+
+// Writes the hex dump of what was read and its printable characters
+// with a single call, as a replayed session reads a lot
+static void dump_bytes(const u_int8_t * buf, int len)
 {
-   switch (tolower(in)) {
-   case '0':
-      return 0x00;
-      break;
-   case '1':
-      return 0x01;
-      break;
-   case '2':
-      return 0x02;
-      break;
-   case '3':
-      return 0x03;
-      break;
-   case '4':
-      return 0x04;
-      break;
-   case '5':
-      return 0x05;
-      break;
-   case '6':
-      return 0x06;
-      break;
-   case '7':
-      return 0x07;
-      break;
-   case '8':
-      return 0x08;
-      break;
-   case '9':
-      return 0x09;
-      break;
-   case 'a':
-      return 0x0a;
-      break;
-   case 'b':
-      return 0x0b;
-      break;
-   case 'c':
-      return 0x0c;
-      break;
-   case 'd':
-      return 0x0d;
-      break;
-   case 'e':
-      return 0x0e;
-      break;
-   case 'f':
-      return 0x0f;
-      break;
-   default:
-      fprintf(stdout, "Bailing out at %s:%d\n", __FILE__, __LINE__);
+   static const char head[] = "Bytes read: ", str[] = "\nString from: ";
+   char *out, *p;
+   int i;
+
+   out = malloc(sizeof(head) + sizeof(str) + 4 * len);
+   if (!out)
+      return;
+
+   p = out;
+   memcpy(p, head, sizeof(head) - 1);
+   p += sizeof(head) - 1;
+   for (i = 0; i < len; i++) {
+      *p++ = ' ';
+      *p++ = hexdigits[buf[i] >> 4];
+      *p++ = hexdigits[buf[i] & 0x0F];
    }
-   return 0;
+   memcpy(p, str, sizeof(str) - 1);
+   p += sizeof(str) - 1;
+   for (i = 0; i < len; i++)
+      *p++ = isprint(buf[i]) ? buf[i] : ' ';
+   *p++ = '\n';
+
+   fwrite(out, 1, p - out, stdout);
+   free(out);
 }
 
-char dec2hex(u_int8_t in)
+// Writes text on the terminal, moving the readline prompt and what
+// was typed so far below it
+static void print_above_prompt(const char *text, size_t len)
 {
-
-   if (in > 0x0f) {
-      fprintf(stdout,
-              "%s:%d Input parameter (%d) is bigger than 0x0F\n",
-              __FILE__, __LINE__, in);
+   char *saved = NULL;
+   int point = 0;
+
+   if (interactive) {
+      point = rl_point;
+      saved = rl_copy_text(0, rl_end);
+      rl_save_prompt();
+      rl_replace_line("", 0);
+      rl_redisplay();
    }
 
-   switch (in) {
-   case '0':
-      return 0x00;
-      break;
-   case 0x00:
-      return '0';
-      break;
-   case 0x01:
-      return '1';
-      break;
-   case 0x02:
-      return '2';
-      break;
-   case 0x03:
-      return '3';
-      break;
-   case 0x04:
-      return '4';
-      break;
-   case 0x05:
-      return '5';
-      break;
-   case 0x06:
-      return '6';
-      break;
-   case 0x07:
-      return '7';
-      break;
-   case 0x08:
-      return '8';
-      break;
-   case 0x09:
-      return '9';
-      break;
-   case 0x0a:
-      return 'A';
-      break;
-   case 0x0b:
-      return 'B';
-      break;
-   case 0x0c:
-      return 'C';
-      break;
-   case 0x0d:
-      return 'D';
-      break;
-   case 0x0e:
-      return 'E';
-      break;
-   case 0x0f:
-      return 'F';
-      break;
-   default:
-      fprintf(stdout, "Bailing out at %s:%d\n", __FILE__, __LINE__);
+   fwrite(text, 1, len, stdout);
+   fflush(stdout);
+
+   if (interactive) {
+      rl_restore_prompt();
+      rl_replace_line(saved, 0);
+      rl_point = point;
+      rl_redisplay();
+      free(saved);
    }
-   return 0;
 }
 
-// returns a byte out of two xdigits
-char hex2bin(char in1, char in2)
+// Formats a chunk as lines of a timestamp, hex and characters
+static char *format_chunk(char *p, const struct mon_chunk *c)
 {
-
-   char un = hex2dec(in1);      // upper nibble
-   un = (un << 4);
-
-   char ln = hex2dec(in2);      // lower nibble
-
-   return (un | ln);
+   struct timeval t;
+   int i, j, n;
+
+   timersub(&c->t, &mon.start, &t);
+   for (i = 0; i < c->len; i += MON_ROW) {
+      n = c->len - i < MON_ROW ? c->len - i : MON_ROW;
+      if (i == 0)
+         p += sprintf(p, "%5ld.%03ld ", (long)t.tv_sec,
+                      (long)t.tv_usec / 1000);
+      else
+         p += sprintf(p, "%10s", "");
+      for (j = 0; j < MON_ROW; j++) {
+         *p++ = ' ';
+         *p++ = j < n ? hexdigits[c->data[i + j] >> 4] : ' ';
+         *p++ = j < n ? hexdigits[c->data[i + j] & 0x0F] : ' ';
+      }
+      *p++ = ' ';
+      *p++ = ' ';
+      for (j = 0; j < n; j++)
+         *p++ = isprint(c->data[i + j]) ? c->data[i + j] : '.';
+      *p++ = '\n';
+   }
+   return p;
 }
 
-// removes everything but xdigits
-char *xdigit_only(char *in)
+// Shows and empties what the monitor thread has got so far
+static void monitor_render(void)
 {
+   char *out, *p;
+   char poke[64];
+   int i;
 
-   //fprintf(stdout, "%s:%d xdigit(in) : %s\n" , __FILE__, __LINE__, in); fflush(stdout);
+   if (mon.wake[0] >= 0)
+      while (read(mon.wake[0], poke, sizeof(poke)) > 0);
 
-   int i, j = 0;
-   for (i = 0; i < strlen(in); i++) {
-      if (isxdigit(in[i]))
-         j++;
+   pthread_mutex_lock(&mon_lock);
+   out = malloc(64 + mon.count * (MON_ROW * 5 + 16) *
+                ((256 + MON_ROW - 1) / MON_ROW));
+   if (!out) {
+      pthread_mutex_unlock(&mon_lock);
+      return;
    }
+   p = out;
+   if (mon.lost)
+      p += sprintf(p, "Monitor lost %lu reads\n", mon.lost);
+   for (i = 0; i < mon.count; i++)
+      p = format_chunk(p, &mon.ring[(mon.head + i) % MON_CHUNKS]);
+   if (mon.status)
+      p += sprintf(p, "Monitor stopped on error %d\n", mon.status);
+   mon.head = mon.count = 0;
+   mon.lost = 0;
+   mon.status = IUU_OPERATION_OK;
+   pthread_mutex_unlock(&mon_lock);
+
+   if (p != out)
+      print_above_prompt(out, p - out);
+   free(out);
+}
 
-   char *out = calloc(j + 1, sizeof(char));
-
-   j = 0;
-   for (i = 0; i < strlen(in); i++) {
-      if (isxdigit(in[i])) {
-         out[j] = in[i];
-         j++;
+// Keeps a chunk in the ring, dropping first the bytes tx sent that the
+// UART gives back if asked to
+static void monitor_keep(struct mon_chunk *c)
+{
+   int skip = 0;
+
+   pthread_mutex_lock(&mon_lock);
+   if (mon.noecho) {
+      while (skip < c->len && skip < mon.nech &&
+             c->data[skip] == mon.echo[skip])
+         skip++;
+      if (skip < c->len)
+         mon.nech = 0;          // not an echo, forget it
+      else {
+         mon.nech -= skip;
+         memmove(mon.echo, mon.echo + skip, mon.nech);
       }
    }
-
-   //fprintf(stdout, "%s:%d xdigit(out) : %s\n" , __FILE__, __LINE__, out); fflush(stdout);
-
-   return out;
+   if (skip < c->len) {
+      memmove(c->data, c->data + skip, c->len - skip);
+      c->len -= skip;
+      if (mon.count == MON_CHUNKS) {
+         mon.head = (mon.head + 1) % MON_CHUNKS;
+         mon.count--;
+         mon.lost++;
+      }
+      mon.ring[(mon.head + mon.count++) % MON_CHUNKS] = *c;
+   }
+   pthread_mutex_unlock(&mon_lock);
 }
 
-// returns a byte stream out of pairs of xdigits
-char *xdigit2bin(char *in, int *L)
+// Polls the UART FIFO until told to stop, again straight away while
+// it has data and every mon.period ms while it is empty
+static void *monitor_thread(void *arg)
 {
+   struct usb_infinity *inf = arg;
+   struct mon_chunk c;
+   u_int8_t len;
+   iuu_error status;
+
+   while (!mon.stop) {
+      pthread_mutex_lock(&dev_lock);
+      status = iuu_uart_rx(inf, c.data, &len);
+      pthread_mutex_unlock(&dev_lock);
+      gettimeofday(&c.t, NULL);
+
+      if (status != IUU_OPERATION_OK) {
+         pthread_mutex_lock(&mon_lock);
+         mon.status = status;
+         pthread_mutex_unlock(&mon_lock);
+         write(mon.wake[1], "", 1);
+         break;
+      }
+      if (len) {
+         c.len = len;
+         monitor_keep(&c);
+         write(mon.wake[1], "", 1);
+      } else
+         usleep(mon.period * 1000);
+   }
+   return NULL;
+}
 
-   //fprintf(stdout, "%s:%d xdigit(in) : %s\n" , __FILE__, __LINE__, in); fflush(stdout);
-
-   if ((strlen(in) % 2) == 0)
-      fprintf(stdout, "Even (%d) number of xdigits. We are cool.\n",
-              strlen(in));
-   else {
-      fprintf(stdout,
-              "Odd (%d) number of xdigits. Bailing out at %s:%d\n",
-              strlen(in), __FILE__, __LINE__);
-      exit(-1);
+// Stops the monitor thread, if there is one, showing what it got
+static void monitor_stop(void)
+{
+   if (mon.running) {
+      mon.stop = 1;
+      pthread_join(mon.thread, NULL);
+      mon.running = 0;
    }
+   monitor_render();
+}
 
-   *L = strlen(in) / 2;
+static int monitor_start(struct usb_infinity *inf, unsigned long period)
+{
+   iuu_error status;
+
+   monitor_stop();
+   if (mon.wake[0] < 0) {
+      if (pipe(mon.wake)) {
+         fprintf(stdout, "Unable to start the monitor: %s\n",
+                 strerror(errno));
+         return -1;
+      }
+      // nobody waits on a full pipe, the foreground reads it all anyway
+      fcntl(mon.wake[0], F_SETFL, O_NONBLOCK);
+      fcntl(mon.wake[1], F_SETFL, O_NONBLOCK);
+   }
 
-   char *out = calloc(*L + 1, sizeof(char));
+   pthread_mutex_lock(&dev_lock);
+   status = iuu_uart_on(inf);
+   pthread_mutex_unlock(&dev_lock);
+   if (status) {
+      iuu_process_error(status, __FILE__, __LINE__);
+      return -1;
+   }
 
-   int i;
-   for (i = 0; i < *L; i++)
-      out[i] = hex2bin(in[2 * i], in[2 * i + 1]);
-
-   //fprintf(stdout, "%s:%d xdigit(out) : %s\n" , __FILE__, __LINE__, out); fflush(stdout);
-   /*
-      fprintf(stdout, "\nBinary string with length=%d :", *L);
-      for (i=0; i<*L; i++) 
-      fprintf(stdout, " %x" ,  (0x00ff & out[i]));
-      fprintf(stdout, "\n");
-      fflush(stdout);
-    */
-   return out;
+   mon.period = period;
+   mon.stop = 0;
+   mon.nech = 0;
+   gettimeofday(&mon.start, NULL);
+   if (pthread_create(&mon.thread, NULL, monitor_thread, inf)) {
+      fprintf(stdout, "Unable to start the monitor thread\n");
+      return -1;
+   }
+   mon.running = 1;
+   return 0;
 }
 
-int help_command(void)
+int help_command(struct usb_infinity *inf, const struct term_cmd *c)
 {
 
    fprintf(stdout, "Usage:\n");
@@ -247,254 +347,179 @@ int help_command(void)
    fprintf(stdout,
            "                    Remember that marshalling is little endian\n");
    fprintf(stdout, "  sf n            : Sets CLK frequency\n");
-//  fprintf(stdout, "  rx      : Read from phoenix fifo\n");
-//  fprintf(stdout, "  tx      : Write to phoenix fifo (i.e. tx fe 34 01 10)\n");
+   fprintf(stdout, "  rx              : Read from phoenix fifo\n");
+   fprintf(stdout,
+           "  tx xx xx ...    : Write to phoenix fifo (i.e. tx fe 34 01 10)\n");
+   fprintf(stdout,
+           "  monitor n       : Show what the phoenix fifo gets, polling it\n");
+   fprintf(stdout,
+           "                    every n ms while empty (0 stops it)\n");
+   fprintf(stdout,
+           "  echo / noecho   : Show or hide the monitored echo of tx\n");
+   fprintf(stdout, "  sleep n         : Waits n ms\n");
    fprintf(stdout, "  help            : Shows this help\n");
    fprintf(stdout, "  quit            : Quits\n");
    fprintf(stdout, "\n");
+   fprintf(stdout,
+           "Run as 'iuuterm -f file' to play the commands in file\n");
+   fprintf(stdout,
+           "(- for stdin), one per line, consecutive writes sent together.\n");
+   fprintf(stdout, "\n");
    return 0;
 
 }
 
-int read_command(struct usb_infinity *inf, char *str)
+int read_command(struct usb_infinity *inf, const struct term_cmd *c)
 {
 
-   int i;
-   char needle[] = "read";
-   char *ptr = strstr(str, needle);
-
-   if (ptr == NULL) {
-      fprintf(stdout, "%s:%d Null pointer! Bad\n", __FILE__, __LINE__);
-      fflush(stdout);
-   } else {
-      fprintf(stdout, "%s:%d Found needle %s! Good\n", __FILE__,
-              __LINE__, ptr + strlen(needle));
-      fflush(stdout);
-   }
-
-   fprintf(stdout, "%s:%d Passing string: %s\n", __FILE__, __LINE__,
-           ptr + strlen(needle));
-   fflush(stdout);
-
-   int len = atoi(ptr + strlen(needle));
-
-   fprintf(stdout, "%s:%d Number of bytes to read: %d\n",
-           __FILE__, __LINE__, len);
-   fflush(stdout);
-
-   //u_int8_t buf[] = "cacabeefcaca";
-   //iuu_error status = 0;
-
-   u_int8_t *buf = calloc(len + 1, sizeof(u_int8_t));
-   iuu_error status = iuu_read(inf, buf, len);
+   u_int8_t *buf = calloc(c->num + 1, sizeof(u_int8_t));
+   iuu_error status = iuu_read(inf, buf, c->num);
 
    if (status)
       iuu_process_error(status, __FILE__, __LINE__);
-   else {
-      u_int8_t un, ln, tmp;
-
-      fprintf(stdout, "Bytes read: ");
-      for (i = 0; i < len; i++) {
-         tmp = 0x00F0 & buf[i];
-         un = (tmp >> 4);
-         ln = 0x000F & buf[i];
-
-         fprintf(stdout, " %c%c", dec2hex(un), dec2hex(ln));
-      }
-      fprintf(stdout, "\n");
-
-      fprintf(stdout, "String from: ");
-      for (i = 0; i < len; i++) {
-         if isprint
-            (buf[i])
-                fprintf(stdout, "%c", buf[i]);
-         else
-            fprintf(stdout, " ");
-      }
-      fprintf(stdout, "\n");
-   }
+   else
+      dump_bytes(buf, c->num);
 
    free(buf);
 
    return 0;
 }
 
-int sf_command(struct usb_infinity *inf, char *str)
+int sf_command(struct usb_infinity *inf, const struct term_cmd *c)
 {
 
-   char needle[] = "sf";
-   char *ptr = strstr(str, needle);
-
-   if (ptr == NULL) {
-      fprintf(stdout, "%s:%d Null pointer! Bad\n", __FILE__, __LINE__);
-      fflush(stdout);
-   } else {
-      fprintf(stdout, "%s:%d Found needle %s! Good\n", __FILE__,
-              __LINE__, ptr + strlen(needle));
-      fflush(stdout);
-   }
+   iuu_error status = iuu_clk(inf, c->num);
 
-   fprintf(stdout, "%s:%d Passing string: %s\n", __FILE__, __LINE__,
-           ptr + strlen(needle));
-   fflush(stdout);
+   if (status)
+      iuu_process_error(status, __FILE__, __LINE__);
 
-   int freq = atoi(ptr + strlen(needle));
+   return 0;
+}
 
-   fprintf(stdout, "%s:%d Frequency to set: %d\n",
-           __FILE__, __LINE__, freq);
-   fflush(stdout);
+int write_command(struct usb_infinity *inf, const struct term_cmd *c)
+{
 
-   iuu_error status = iuu_clk(inf, freq);
+   iuu_error status;
 
+   if (c->s)
+      status = iuu_stream_send(inf, c->s);
+   else
+      status = iuu_write(inf, c->data, c->len);
    if (status)
       iuu_process_error(status, __FILE__, __LINE__);
 
    return 0;
 }
 
-int write_command(struct usb_infinity *inf, char *str)
+int rx_command(struct usb_infinity *inf, const struct term_cmd *c)
 {
 
-   char needle[] = "write";
-   char *ptr = strstr(str, needle);
+   u_int8_t buf[256], len;
+   iuu_error status;
 
-   /*
-      if (ptr==NULL) { 
-      fprintf(stdout, "%s:%d Null pointer! Bad\n", __FILE__, __LINE__); 
-      fflush(stdout);
-      } else { 
-      fprintf(stdout, "%s:%d Found needle %s! Good\n", __FILE__, __LINE__, ptr+strlen(needle)); 
-      fflush(stdout); 
-      }
-    */
+   // the monitor thread is reading it already
+   if (mon.running) {
+      monitor_render();
+      return 0;
+   }
 
-   //fprintf(stdout, "%s:%d Passing string: %s\n", __FILE__, __LINE__, ptr+strlen(needle)); fflush(stdout);
+   pthread_mutex_lock(&dev_lock);
+   status = iuu_uart_rx(inf, buf, &len);
+   pthread_mutex_unlock(&dev_lock);
+   if (status)
+      iuu_process_error(status, __FILE__, __LINE__);
+   else
+      dump_bytes(buf, len);
 
-   char *xdo = xdigit_only(ptr + strlen(needle));
+   return 0;
+}
 
-   //fprintf(stdout, "%s:%d Passing string: %s\n", __FILE__, __LINE__, xdo); fflush(stdout);
+int tx_command(struct usb_infinity *inf, const struct term_cmd *c)
+{
 
-   int l;
-   char *binstr = xdigit2bin(xdo, &l);
+   iuu_error status;
 
-   //fprintf(stdout, "Resulting string: %s with length=%d\n", binstr, l);
+   if (c->len > 255) {
+      fprintf(stdout, "At most 255 bytes can be sent at once\n");
+      return -1;
+   }
 
-   /*
-      int i;
-      for (i=0; i<l; i++)
-      fprintf(stdout, " %x", binstr[i]);
-      fprintf(stdout, "\n");
-      fflush(stdout);
-    */
+   pthread_mutex_lock(&mon_lock);
+   if (mon.running && mon.noecho && mon.nech + c->len <= MON_ECHO) {
+      memcpy(mon.echo + mon.nech, c->data, c->len);
+      mon.nech += c->len;
+   }
+   pthread_mutex_unlock(&mon_lock);
 
-   iuu_error status = iuu_write(inf, (u_int8_t *) binstr, l);
+   pthread_mutex_lock(&dev_lock);
+   status = iuu_uart_tx(inf, c->data, c->len);
+   pthread_mutex_unlock(&dev_lock);
    if (status)
       iuu_process_error(status, __FILE__, __LINE__);
 
-   free(xdo);
-   free(binstr);
-
    return 0;
 }
 
-int rx_command(struct usb_infinity *inf, char *in)
+int monitor_command(struct usb_infinity *inf, const struct term_cmd *c)
 {
-   /* Pending */
-   return 0;
+
+   if (c->num == 0) {
+      monitor_stop();
+      return 0;
+   }
+   if (c->num > MON_PERIOD_MAX) {
+      fprintf(stdout, "Poll every %d ms at most\n", MON_PERIOD_MAX);
+      return -1;
+   }
+   return monitor_start(inf, c->num);
 }
 
-int tx_command(struct usb_infinity *inf, char *in)
+int echo_command(struct usb_infinity *inf, const struct term_cmd *c)
 {
-   /* Pending */
+
+   pthread_mutex_lock(&mon_lock);
+   mon.noecho = 0;
+   mon.nech = 0;
+   pthread_mutex_unlock(&mon_lock);
    return 0;
 }
 
-int stop_command(struct usb_infinity *inf)
+int noecho_command(struct usb_infinity *inf, const struct term_cmd *c)
 {
 
-   iuu_stop(inf);
-
+   pthread_mutex_lock(&mon_lock);
+   mon.noecho = 1;
+   pthread_mutex_unlock(&mon_lock);
    return 0;
 }
 
-int
-init_regexp_command(regex_t * help_cmd, regex_t * quit_cmd,
-                    regex_t * read_cmd, regex_t * write_cmd,
-                    regex_t * rx_cmd, regex_t * tx_cmd,
-                    regex_t * start_cmd, regex_t * stop_cmd,
-                    regex_t * sf_cmd)
+int sleep_command(struct usb_infinity *inf, const struct term_cmd *c)
 {
 
-   int status;
-
-   status =
-       regcomp(help_cmd, "^[[:space:]]*help[[:space:]]*$",
-               REG_EXTENDED);
-   if (status)
-      fprintf(stdout, "%s:%d:%s\n", __FILE__, __LINE__,
-              strerror(status));
-
-   status =
-       regcomp(quit_cmd, "^[[:space:]]*quit[[:space:]]*$",
-               REG_EXTENDED);
-   if (status)
-      fprintf(stdout, "%s:%d:%s\n", __FILE__, __LINE__,
-              strerror(status));
-
-   status = regcomp(write_cmd,
-                    "^[[:space:]]*write[[:space:]]+([[:xdigit:]]{2}[[:space:]]*)+$",
-                    REG_EXTENDED);
-   if (status)
-      fprintf(stdout, "%s:%d:%s\n", __FILE__, __LINE__,
-              strerror(status));
-
-   status = regcomp(read_cmd,
-                    "^[[:space:]]*read[[:space:]]+[[:digit:]]{1,3}[[:space:]]*$",
-                    REG_EXTENDED);
-   if (status)
-      fprintf(stdout, "%s:%d:%s\n", __FILE__, __LINE__,
-              strerror(status));
+   usleep(c->num * 1000);
+   return 0;
+}
 
-   status =
-       regcomp(rx_cmd, "^[[:space:]]*rx[[:space:]]*$", REG_EXTENDED);
-   if (status)
-      fprintf(stdout, "%s:%d:%s\n", __FILE__, __LINE__,
-              strerror(status));
+int stop_command(struct usb_infinity *inf, const struct term_cmd *c)
+{
 
-   status =
-       regcomp(tx_cmd,
-               "^[[:space:]]*tx[[:space:]]+([[:xdigit:]]{2}[[:space:]]*)+$",
-               REG_EXTENDED);
-   if (status)
-      fprintf(stdout, "%s:%d:%s\n", __FILE__, __LINE__,
-              strerror(status));
+   monitor_stop();
+   iuu_stop(inf);
 
-   status =
-       regcomp(start_cmd, "^[[:space:]]*start[[:space:]]*$",
-               REG_EXTENDED);
-   if (status)
-      fprintf(stdout, "%s:%d:%s\n", __FILE__, __LINE__,
-              strerror(status));
+   return 0;
+}
 
-   status =
-       regcomp(stop_cmd, "^[[:space:]]*stop[[:space:]]*$",
-               REG_EXTENDED);
-   if (status)
-      fprintf(stdout, "%s:%d:%s\n", __FILE__, __LINE__,
-              strerror(status));
+int quit_command(struct usb_infinity *inf, const struct term_cmd *c)
+{
 
-   status = regcomp(sf_cmd,
-                    "^[[:space:]]*sf[[:space:]]+[[:digit:]]+[[:space:]]*$",
-                    REG_EXTENDED);
-   if (status)
-      fprintf(stdout, "%s:%d:%s\n", __FILE__, __LINE__,
-              strerror(status));
+   fprintf(stdout, "Quitting...\n");
+   stop_command(inf, c);
+   exit(0);
 
    return 0;
-
 }
 
-int start_command(struct usb_infinity *inf)
+int start_command(struct usb_infinity *inf, const struct term_cmd *c)
 {
 
    int ndev;
@@ -584,128 +609,322 @@ int start_command(struct usb_infinity *inf)
    return 0;
 }
 
-int main(int argc, char **argv)
+// Every command iuuterm knows, looked up by its first word
+static const struct term_op term_ops[] = {
+   {"help", TERM_NONE, 0, help_command},
+   {"quit", TERM_NONE, 0, quit_command},
+   {"read", TERM_COUNT, 1, read_command},
+   {"write", TERM_HEX, 1, write_command},
+   {"rx", TERM_NONE, 0, rx_command},
+   {"tx", TERM_HEX, 0, tx_command},
+   {"monitor", TERM_NUM, 0, monitor_command},
+   {"echo", TERM_NONE, 0, echo_command},
+   {"noecho", TERM_NONE, 0, noecho_command},
+   {"sleep", TERM_NUM, 0, sleep_command},
+   {"start", TERM_NONE, 1, start_command},
+   {"stop", TERM_NONE, 0, stop_command},
+   {"sf", TERM_NUM, 1, sf_command},
+   {NULL, TERM_NONE, 0, NULL}
+};
+
+// Parses a command line into c. Returns 0 if it is a command, 1 if
+// there is nothing in it and -1 on a syntax error.
+int parse_command(const char *line, struct term_cmd *c)
 {
 
-   fprintf(stdout,
-           "\niuuterm version 0.1, Copyright (C) 2006 Juan Carlos Borrs\n\n");
-   fprintf(stdout,
-           "iuuterm comes with ABSOLUTELY NO WARRANTY; This is free\n");
-   fprintf(stdout,
-           "software, and you are welcome to redistribute it under\n");
-   fprintf(stdout, "certain conditions.\n\n");
+   const char *p = line, *w;
+   const struct term_op *op;
+   int digits;
+
+   memset(c, 0, sizeof(*c));
+   while (isspace((u_int8_t) * p))
+      p++;
+   if (!*p)
+      return 1;
+
+   w = p;
+   while (*p && !isspace((u_int8_t) * p))
+      p++;
+   for (op = term_ops; op->name; op++)
+      if (strlen(op->name) == p - w && !strncmp(op->name, w, p - w))
+         break;
+   if (!op->name)
+      return -1;
+   c->op = op - term_ops;
+
+   while (isspace((u_int8_t) * p))
+      p++;
+
+   switch (op->args) {
+   case TERM_NONE:
+      break;
+   case TERM_COUNT:
+   case TERM_NUM:
+      for (digits = 0; isdigit((u_int8_t) * p); p++, digits++)
+         c->num = 10 * c->num + (*p - '0');
+      if (!digits || (op->args == TERM_COUNT && digits > 3))
+         return -1;
+      break;
+   case TERM_HEX:
+      c->data = malloc(strlen(p) / 2 + 1);
+      if (!c->data)
+         return -1;
+      while (isxdigit((u_int8_t) p[0]) && isxdigit((u_int8_t) p[1])) {
+         c->data[c->len++] = (strchr(hexdigits, toupper(p[0])) -
+                              hexdigits) << 4 |
+             (strchr(hexdigits, toupper(p[1])) - hexdigits);
+         p += 2;
+         while (isspace((u_int8_t) * p))
+            p++;
+      }
+      if (!c->len) {
+         free(c->data);
+         c->data = NULL;
+         return -1;
+      }
+      break;
+   }
 
-   struct usb_infinity my_iuu;
-   //device_test(&my_iuu);
+   while (isspace((u_int8_t) * p))
+      p++;
+   if (*p) {
+      free(c->data);
+      c->data = NULL;
+      return -1;
+   }
+   return 0;
+}
 
-   int status;
-   char *prompt = ">> ";
-   regex_t helpcmd, quitcmd, readcmd, writecmd, rxcmd, txcmd;
-   regex_t startcmd, stopcmd, sfcmd;
+// Commands flagged as device ones run holding dev_lock, so that they
+// do not get in the middle of a poll of the monitor thread. The others
+// take it themselves if they need it.
+int run_command(struct usb_infinity *inf, const struct term_cmd *c)
+{
 
-   init_regexp_command(&helpcmd, &quitcmd, &readcmd, &writecmd, &rxcmd,
-                       &txcmd, &startcmd, &stopcmd, &sfcmd);
+   const struct term_op *op = &term_ops[c->op];
+   int r;
 
-   regmatch_t match_ptr;
-   char *line = NULL;
-   //char *line = "      read 12434    ";
-   int matched = 1;
+   if (!op->device)
+      return op->run(inf, c);
 
-   while (1) {
-      if (!matched)
-         fprintf(stdout, "Unrecognized command or syntax error: %s\n",
-                 line);
-      matched = 0;
+   pthread_mutex_lock(&dev_lock);
+   r = op->run(inf, c);
+   pthread_mutex_unlock(&dev_lock);
+   return r;
+}
 
-      if (line != NULL)
-         free(line);
+void free_command(struct term_cmd *c)
+{
 
-      line = readline(prompt);
-      add_history(line);
+   free(c->data);
+   if (c->s) {
+      iuu_stream_free(c->s);
+      free(c->s);
+   }
+   memset(c, 0, sizeof(*c));
+}
 
-      status = regexec(&helpcmd, line, 0, &match_ptr, 0);
-      if (status == REG_NOERROR) {
-         //fprintf(stdout, "HELP command\n");
-         //fprintf(stdout, "%d -> %s\n", strlen(line), line);
-         matched++;
-         help_command();
+// Parses the whole script before running any of it. Consecutive writes
+// are queued in a single stream so they reach the IUU in as few
+// transfers as fit. Returns the number of commands, -1 on errors.
+int load_script(FILE * f, const char *name, struct term_cmd **cmds)
+{
+
+   struct term_cmd c, *v = NULL, *prev, *tmp;
+   char *line = NULL;
+   size_t size = 0;
+   int n = 0, max = 0, lineno = 0, errors = 0, r;
+   iuu_error status;
+
+   while (getline(&line, &size, f) != -1) {
+      lineno++;
+      r = parse_command(line, &c);
+      if (r > 0)
+         continue;
+      if (r < 0) {
+         line[strcspn(line, "\r\n")] = '\0';
+         fprintf(stderr, "%s:%d: Unrecognized command or syntax error: %s\n",
+                 name, lineno, line);
+         errors++;
          continue;
       }
-
-      status = regexec(&quitcmd, line, 0, &match_ptr, 0);
-      if (status == REG_NOERROR) {
-         fprintf(stdout, "Quitting...\n");
-         //fprintf(stdout, "%d -> %s\n", strlen(line), line);
-         matched++;
-         stop_command(&my_iuu);
-         exit(0);
-         break;
+      c.line = lineno;
+
+      if (term_ops[c.op].run == write_command) {
+         prev = n ? &v[n - 1] : NULL;
+         if (!prev || !prev->s) {
+            c.s = malloc(sizeof(*c.s));
+            if (!c.s || iuu_stream_init(c.s) != IUU_OPERATION_OK) {
+               free(c.s);
+               c.s = NULL;
+               errors++;
+               free_command(&c);
+               break;
+            }
+            prev = NULL;
+         }
+         status = iuu_stream_add(prev ? prev->s : c.s, c.data, c.len);
+         if (status != IUU_OPERATION_OK) {
+            fprintf(stderr, "%s:%d: Write of %d bytes does not fit a "
+                    "transfer\n", name, lineno, c.len);
+            errors++;
+            free_command(&c);
+            continue;
+         }
+         free(c.data);
+         c.data = NULL;
+         c.len = 0;
+         if (prev)
+            continue;
       }
 
-      status = regexec(&readcmd, line, 0, &match_ptr, 0);
-      if (status == REG_NOERROR) {
-         fprintf(stdout, "READ command\n");
-         fprintf(stdout, "%d -> %s\n", strlen(line), line);
-         matched++;
-         read_command(&my_iuu, line);
-         continue;
+      if (n == max) {
+         max = max ? 2 * max : 64;
+         tmp = realloc(v, max * sizeof(*v));
+         if (!tmp) {
+            errors++;
+            free_command(&c);
+            break;
+         }
+         v = tmp;
       }
+      v[n++] = c;
+   }
+   free(line);
 
-      status = regexec(&writecmd, line, 0, &match_ptr, 0);
-      if (status == REG_NOERROR) {
-         //fprintf(stdout, "WRITE command\n");
-         //fprintf(stdout, "%d -> %s\n", strlen(line), line);
-         matched++;
-         write_command(&my_iuu, line);
-         continue;
-      }
+   if (errors) {
+      while (n > 0)
+         free_command(&v[--n]);
+      free(v);
+      return -1;
+   }
+   *cmds = v;
+   return n;
+}
 
-      status = regexec(&rxcmd, line, 0, &match_ptr, 0);
-      if (status == REG_NOERROR) {
-         fprintf(stdout, "RX command\n");
-         fprintf(stdout, "%d -> %s\n", strlen(line), line);
-         matched++;
-         rx_command(&my_iuu, line);
-         continue;
-      }
+int run_script(struct usb_infinity *inf, const char *name)
+{
 
-      status = regexec(&txcmd, line, 1, &match_ptr, 0);
-      if (status == REG_NOERROR) {
-         fprintf(stdout, "TX command\n");
-         fprintf(stdout, "%d -> %s\n", strlen(line), line);
-         matched++;
-         tx_command(&my_iuu, line);
-         continue;
-      }
+   struct term_cmd *cmds = NULL;
+   int i, n;
+   FILE *f = stdin;
 
-      status = regexec(&startcmd, line, 1, &match_ptr, 0);
-      if (status == REG_NOERROR) {
-         fprintf(stdout, "START command\n");
-         fprintf(stdout, "%d -> %s\n", strlen(line), line);
-         matched++;
-         start_command(&my_iuu);
-         continue;
+   if (strcmp(name, "-")) {
+      f = fopen(name, "r");
+      if (!f) {
+         fprintf(stderr, "%s: %s\n", name, strerror(errno));
+         return -1;
       }
+   }
+   n = load_script(f, name, &cmds);
+   if (f != stdin)
+      fclose(f);
+   if (n < 0)
+      return -1;
 
-      status = regexec(&stopcmd, line, 1, &match_ptr, 0);
-      if (status == REG_NOERROR) {
-         fprintf(stdout, "STOP command\n");
-         fprintf(stdout, "%d -> %s\n", strlen(line), line);
-         matched++;
-         stop_command(&my_iuu);
-         continue;
+   // What gets printed only goes to the terminal in big chunks
+   setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+   for (i = 0; i < n; i++) {
+      run_command(inf, &cmds[i]);
+      if (mon.running)
+         monitor_render();
+   }
+   monitor_stop();
+   fflush(stdout);
+
+   for (i = 0; i < n; i++)
+      free_command(&cmds[i]);
+   free(cmds);
+   return 0;
+}
+
+static struct usb_infinity my_iuu;
+
+// Runs a line typed at the prompt
+static void line_handler(char *line)
+{
+
+   struct term_cmd cmd;
+
+   if (line == NULL) {
+      rl_callback_handler_remove();
+      interactive = 0;
+      fprintf(stdout, "\n");
+      quit_command(&my_iuu, NULL);
+      return;
+   }
+   if (*line)
+      add_history(line);
+
+   // commands print at will, so readline lets go of the line meanwhile
+   interactive = 0;
+   switch (parse_command(line, &cmd)) {
+   case 0:
+      run_command(&my_iuu, &cmd);
+      free_command(&cmd);
+      break;
+   case -1:
+      fprintf(stdout, "Unrecognized command or syntax error: %s\n",
+              line);
+      break;
+   }
+   fflush(stdout);
+   interactive = 1;
+
+   free(line);
+}
+
+int main(int argc, char **argv)
+{
+
+   int opt;
+
+   memset(&my_iuu, 0, sizeof(my_iuu));
+
+   while ((opt = getopt(argc, argv, "f:h")) != -1) {
+      switch (opt) {
+      case 'f':
+         return run_script(&my_iuu, optarg) ? 1 : 0;
+      default:
+         fprintf(stderr, "Usage: iuuterm [-f file]\n");
+         return opt == 'h' ? 0 : 1;
       }
+   }
 
-      status = regexec(&sfcmd, line, 1, &match_ptr, 0);
-      if (status == REG_NOERROR) {
-         fprintf(stdout, "SET FREQUENCY command\n");
-         fprintf(stdout, "%d -> %s\n", strlen(line), line);
-         matched++;
-         sf_command(&my_iuu, line);
-         continue;
+   fprintf(stdout,
+           "\niuuterm version 0.1, Copyright (C) 2006 Juan Carlos Borrs\n\n");
+   fprintf(stdout,
+           "iuuterm comes with ABSOLUTELY NO WARRANTY; This is free\n");
+   fprintf(stdout,
+           "software, and you are welcome to redistribute it under\n");
+   fprintf(stdout, "certain conditions.\n\n");
+
+   // readline is fed a character at a time so that what the monitor
+   // gets is shown while a command is being typed
+   rl_callback_handler_install(">> ", line_handler);
+   interactive = 1;
+
+   while (1) {
+      fd_set fds;
+
+      FD_ZERO(&fds);
+      FD_SET(STDIN_FILENO, &fds);
+      if (mon.wake[0] >= 0)
+         FD_SET(mon.wake[0], &fds);
+      if (select((mon.wake[0] > STDIN_FILENO ? mon.wake[0] :
+                  STDIN_FILENO) + 1, &fds, NULL, NULL, NULL) < 0) {
+         if (errno == EINTR)
+            continue;
+         break;
       }
 
+      if (mon.wake[0] >= 0 && FD_ISSET(mon.wake[0], &fds))
+         monitor_render();
+      if (FD_ISSET(STDIN_FILENO, &fds))
+         rl_callback_read_char();
    }
 
+   rl_callback_handler_remove();
    return 0;
 }